@@ -0,0 +1,108 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "channel_statistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+void ChannelStatistics::configure(int numChannels, uint64_t windowScans)
+{
+    if (numChannels < 1 || windowScans < 1)
+        throw std::invalid_argument("ChannelStatistics: invalid window");
+
+    numChannels_ = numChannels;
+    windowScans_ = windowScans;
+    window_      = 0;
+    count_       = 0;
+    acc_.assign(numChannels, Accumulator());
+}
+
+void ChannelStatistics::add(
+    const float* in, std::size_t inStride, const uint64_t* scanIndices,
+    std::size_t numScans, std::vector<ChannelStatsWindow>& completed)
+{
+    // Runs of scans in the same window:
+    for (std::size_t begin = 0, end; begin < numScans; begin = end)
+    {
+        const uint64_t window = scanIndices[begin] / windowScans_;
+        for (end = begin + 1;
+             end < numScans && scanIndices[end] / windowScans_ == window;
+             end++)
+        {
+        }
+
+        if (window != window_ && count_ > 0) finishWindow(completed);
+        window_ = window;
+
+        for (int c = 0; c < numChannels_; c++)
+        {
+            const float* x = in + c * inStride;
+            Accumulator& a = acc_[c];
+
+            if (count_ == 0)
+            {
+                a.min = a.max = a.shift = x[begin];
+                a.sum = a.sumSq = 0;
+            }
+
+            float  mn = a.min, mx = a.max;
+            double sum = a.sum, sumSq = a.sumSq;
+            for (std::size_t s = begin; s < end; s++)
+            {
+                const double d = static_cast<double>(x[s]) - a.shift;
+                mn             = std::min(mn, x[s]);
+                mx             = std::max(mx, x[s]);
+                sum += d;
+                sumSq += d * d;
+            }
+            a.min   = mn;
+            a.max   = mx;
+            a.sum   = sum;
+            a.sumSq = sumSq;
+        }
+        count_ += static_cast<uint32_t>(end - begin);
+    }
+
+    // The current window is complete if its last scan has been received:
+    if (count_ > 0 && numScans > 0 &&
+        (scanIndices[numScans - 1] + 1) % windowScans_ == 0)
+        finishWindow(completed);
+}
+
+void ChannelStatistics::finishWindow(
+    std::vector<ChannelStatsWindow>& completed)
+{
+    ChannelStatsWindow w;
+    w.windowIndex = window_;
+    w.numScans    = count_;
+    w.min.resize(numChannels_);
+    w.max.resize(numChannels_);
+    w.mean.resize(numChannels_);
+    w.rms.resize(numChannels_);
+    w.stdDev.resize(numChannels_);
+
+    const double n = count_;
+    for (int c = 0; c < numChannels_; c++)
+    {
+        const Accumulator& a = acc_[c];
+
+        // Mean and variance of (sample - shift), then of the samples:
+        const double meanD = a.sum / n;
+        const double var   = std::max(0.0, a.sumSq / n - meanD * meanD);
+        const double mean  = a.shift + meanD;
+
+        w.min[c]    = a.min;
+        w.max[c]    = a.max;
+        w.mean[c]   = static_cast<float>(mean);
+        w.rms[c]    = static_cast<float>(std::sqrt(var + mean * mean));
+        w.stdDev[c] = static_cast<float>(std::sqrt(var));
+    }
+
+    completed.push_back(std::move(w));
+    count_ = 0;
+}
@@ -0,0 +1,65 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Statistics of each channel over one window of scans.
+struct ChannelStatsWindow
+{
+    uint64_t           windowIndex;  // Window k: scans [k * N, (k + 1) * N)
+    uint32_t           numScans;  // Received, i.e. N minus the lost ones
+    std::vector<float> min, max, mean, rms, stdDev;  // One entry per channel
+};
+
+/** Running per-channel min, max, mean, RMS and standard deviation over
+ * fixed windows of consecutive scans, computed incrementally, in a single
+ * pass over each decoded block.
+ *
+ * Windows are aligned to the stream-wide scan indices (window k holds scans
+ * k * N to (k + 1) * N - 1), so lost scans only reduce the count of their
+ * window. A window is complete when a scan of a later one arrives.
+ *
+ * Sums are accumulated in double precision, relative to the first sample of
+ * each window, so the variance of small signals on a large offset does not
+ * cancel out. The standard deviation is that of the population (1/n).
+ */
+class ChannelStatistics
+{
+   public:
+    /// Sets the number of channels and scans per window (N), and resets.
+    void configure(int numChannels, uint64_t windowScans);
+
+    int      numChannels() const { return numChannels_; }
+    uint64_t windowScans() const { return windowScans_; }
+
+    /** Adds numScans scans, in[channel * inStride + scan], with stream-wide
+     * indices scanIndices[scan] (increasing). Appends the windows completed
+     * by them to completed.
+     */
+    void add(
+        const float* in, std::size_t inStride, const uint64_t* scanIndices,
+        std::size_t numScans, std::vector<ChannelStatsWindow>& completed);
+
+   private:
+    struct Accumulator
+    {
+        float  min, max;
+        float  shift;  // First sample of the window
+        double sum, sumSq;  // Of (sample - shift)
+    };
+
+    int                      numChannels_ = 0;
+    uint64_t                 windowScans_ = 1;
+    uint64_t                 window_      = 0;  // Index of the current one
+    uint32_t                 count_       = 0;  // Scans in it so far
+    std::vector<Accumulator> acc_;
+
+    void finishWindow(std::vector<ChannelStatsWindow>& completed);
+};
@@ -0,0 +1,285 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "decimation_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define LJ_DECIMATION_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LJ_DECIMATION_NEON 1
+#include <arm_neon.h>
+#endif
+
+bool parseDecimationMode(const std::string& s, DecimationMode& mode)
+{
+    if (s == "fir")
+        mode = DecimationMode::Fir;
+    else if (s == "boxcar")
+        mode = DecimationMode::Boxcar;
+    else
+        return false;
+    return true;
+}
+
+namespace
+{
+// Dot products of n floats, n a multiple of 8. All of them accumulate in
+// 8 lanes (lane k: elements i with i % 8 == k) and then add the lanes in
+// the same order, so they round identically. (This file is built with
+// -ffp-contract=off: no fused multiply-add either.)
+using DotFn = float (*)(const float* a, const float* b, std::size_t n);
+
+[[maybe_unused]] float dotScalar(
+    const float* a, const float* b, std::size_t n)
+{
+    float acc[8] = {};
+    for (std::size_t i = 0; i < n; i += 8)
+        for (int k = 0; k < 8; k++) acc[k] = acc[k] + a[i + k] * b[i + k];
+
+    const float s0 = acc[0] + acc[4], s1 = acc[1] + acc[5];
+    const float s2 = acc[2] + acc[6], s3 = acc[3] + acc[7];
+    return (s0 + s2) + (s1 + s3);
+}
+
+#if defined(LJ_DECIMATION_X86)
+// (lo + hi), then (s0 + s2, s1 + s3), then their sum: as dotScalar().
+inline float reduceSse(__m128 lo, __m128 hi)
+{
+    const __m128 s = _mm_add_ps(lo, hi);
+    const __m128 t = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(
+        _mm_add_ss(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 1, 1, 1))));
+}
+
+float dotSse2(const float* a, const float* b, std::size_t n)
+{
+    __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+    for (std::size_t i = 0; i < n; i += 8)
+    {
+        lo = _mm_add_ps(
+            lo, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        hi = _mm_add_ps(
+            hi, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    return reduceSse(lo, hi);
+}
+
+__attribute__((target("avx2"))) float dotAvx2(
+    const float* a, const float* b, std::size_t n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    for (std::size_t i = 0; i < n; i += 8)
+        acc = _mm256_add_ps(
+            acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    return reduceSse(
+        _mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+}
+#endif
+
+#if defined(LJ_DECIMATION_NEON)
+float dotNeon(const float* a, const float* b, std::size_t n)
+{
+    float32x4_t lo = vdupq_n_f32(0), hi = vdupq_n_f32(0);
+    for (std::size_t i = 0; i < n; i += 8)
+    {
+        lo = vaddq_f32(lo, vmulq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+        hi = vaddq_f32(
+            hi, vmulq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4)));
+    }
+    const float32x4_t s = vaddq_f32(lo, hi);
+    const float32x2_t t = vadd_f32(vget_low_f32(s), vget_high_f32(s));
+    return vget_lane_f32(t, 0) + vget_lane_f32(t, 1);
+}
+#endif
+
+struct DotImpl
+{
+    DotFn       fn;
+    const char* name;
+};
+
+DotImpl selectDotImpl()
+{
+#if defined(LJ_DECIMATION_X86)
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return {&dotAvx2, "avx2"};
+#endif
+    return {&dotSse2, "sse2"};
+#elif defined(LJ_DECIMATION_NEON)
+    return {&dotNeon, "neon"};
+#else
+    return {&dotScalar, "scalar"};
+#endif
+}
+
+const DotImpl& dotImpl()
+{
+    static const DotImpl impl = selectDotImpl();
+    return impl;
+}
+}  // namespace
+
+const char* DecimationFilter::implementation() { return dotImpl().name; }
+
+void DecimationFilter::configure(
+    int numChannels, int factor, DecimationMode mode, int tapsPerPhase,
+    double cutoff)
+{
+    if (numChannels < 1 || factor < 1 || tapsPerPhase < 1 ||
+        !(cutoff > 0 && cutoff <= 0.5))
+        throw std::invalid_argument(
+            "DecimationFilter: invalid channels, factor, taps or cutoff");
+
+    numChannels_ = numChannels;
+    factor_      = factor;
+    mode_        = mode;
+
+    if (mode == DecimationMode::Boxcar)
+        taps_.assign(factor, 1.0f / factor);
+    else
+    {
+        // Windowed sinc, with the -6 dB point at fc cycles per input scan:
+        const int    n  = tapsPerPhase * factor + 1;
+        const double fc = cutoff / factor;
+        const double m  = (n - 1) * 0.5;
+
+        std::vector<double> h(n);
+        double              sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            const double x    = i - m;
+            const double sinc = x == 0 ? 2 * fc
+                                       : std::sin(2 * M_PI * fc * x) /
+                                             (M_PI * x);
+            const double w = 0.42 - 0.5 * std::cos(2 * M_PI * i / (n - 1)) +
+                             0.08 * std::cos(4 * M_PI * i / (n - 1));
+            h[i] = sinc * w;
+            sum += h[i];
+        }
+
+        taps_.resize(n);
+        for (int i = 0; i < n; i++) taps_[i] = static_cast<float>(h[i] / sum);
+    }
+
+    // The taps are symmetric, so no need to reverse them for the dot product
+    // with the oldest to newest scans:
+    const std::size_t padded = (taps_.size() + 7) / 8 * 8;
+    paddedTaps_.assign(padded - taps_.size(), 0.0f);
+    paddedTaps_.insert(paddedTaps_.end(), taps_.begin(), taps_.end());
+
+    history_.assign(numChannels * historyLength(), 0.0f);
+    boxcarSum_.assign(numChannels, 0.0f);
+    primed_ = false;
+}
+
+void DecimationFilter::restart(
+    const float* in, std::size_t inStride, std::size_t scan, uint64_t index)
+{
+    const std::size_t hl = historyLength();
+    for (int c = 0; c < numChannels_; c++)
+    {
+        const float x0 = in[c * inStride + scan];
+        std::fill_n(history_.begin() + c * hl, hl, x0);
+        boxcarSum_[c] = static_cast<float>(index % factor_) * x0;
+    }
+    nextIndex_ = index;
+    primed_    = true;
+}
+
+std::size_t DecimationFilter::process(
+    const float* in, std::size_t inStride, const uint64_t* scanIndices,
+    std::size_t numScans, float* out, uint64_t* outIndices,
+    std::size_t maxOut)
+{
+    std::size_t numOut = 0;
+
+    // Runs of consecutive scan indices:
+    for (std::size_t begin = 0, end; begin < numScans; begin = end)
+    {
+        for (end = begin + 1;
+             end < numScans && scanIndices[end] == scanIndices[end - 1] + 1;
+             end++)
+        {
+        }
+
+        if (!primed_ || scanIndices[begin] != nextIndex_)
+            restart(in, inStride, begin, scanIndices[begin]);
+
+        numOut += processSegment(
+            in, inStride, scanIndices, begin, end,
+            out + numOut * numChannels_, outIndices + numOut,
+            maxOut - numOut);
+        nextIndex_ = scanIndices[end - 1] + 1;
+    }
+    return numOut;
+}
+
+// Filters scans [begin, end), with consecutive indices that follow the
+// history of the filter. Writes up to maxOut outputs.
+std::size_t DecimationFilter::processSegment(
+    const float* in, std::size_t inStride, const uint64_t* scanIndices,
+    std::size_t begin, std::size_t end, float* out, uint64_t* outIndices,
+    std::size_t maxOut)
+{
+    const std::size_t len = end - begin;
+    const std::size_t d   = factor_;
+
+    // Outputs at first, first + d, ... (relative to begin):
+    const std::size_t first  = d - 1 - scanIndices[begin] % d;
+    const std::size_t numOut = std::min(
+        maxOut, first < len ? (len - 1 - first) / d + 1 : 0);
+
+    for (std::size_t j = 0; j < numOut; j++)
+        outIndices[j] = scanIndices[begin + first + j * d];
+
+    for (int c = 0; c < numChannels_; c++)
+    {
+        const float* x = in + c * inStride + begin;
+
+        if (mode_ == DecimationMode::Boxcar)
+        {
+            float       sum  = boxcarSum_[c];
+            std::size_t next = first;
+            for (std::size_t s = 0, j = 0; s < len; s++)
+            {
+                sum += x[s];
+                if (s == next)
+                {
+                    if (j < numOut) out[j * numChannels_ + c] = sum / factor_;
+                    j++;
+                    sum = 0;
+                    next += d;
+                }
+            }
+            boxcarSum_[c] = sum;
+            continue;
+        }
+
+        // FIR: history, then this segment, contiguous:
+        const std::size_t hl = historyLength();
+        if (work_.size() < hl + len) work_.resize(hl + len);
+        float* h = history_.data() + c * hl;
+        std::copy(h, h + hl, work_.begin());
+        std::copy(x, x + len, work_.begin() + hl);
+
+        // Output at segment scan p: the dot product of the taps with
+        // work_[p, p + hl], the newest scan last.
+        const DotFn dot = dotImpl().fn;
+        for (std::size_t j = 0; j < numOut; j++)
+            out[j * numChannels_ + c] = dot(
+                paddedTaps_.data(), work_.data() + first + j * d,
+                paddedTaps_.size());
+
+        std::copy(work_.begin() + len, work_.begin() + len + hl, h);
+    }
+    return numOut;
+}
@@ -0,0 +1,123 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Anti-aliasing filter of DecimationFilter.
+enum class DecimationMode
+{
+    Fir,  // Windowed-sinc lowpass FIR
+    Boxcar  // Plain average of the scans of each output period
+};
+
+/// Parses "fir" or "boxcar". Returns false if s is none of them.
+bool parseDecimationMode(const std::string& s, DecimationMode& mode);
+
+// Decimation settings, resolved from the ROS parameters.
+struct DecimationOptions
+{
+    double         outputRate   = 0;  // [Hz], 0: no decimated output
+    DecimationMode mode         = DecimationMode::Fir;
+    int            tapsPerPhase = 16;  // FIR length / decimation factor
+    double         cutoff       = 0.4;  // FIR -6 dB point / output rate
+};
+
+/** Lowpass filters and decimates by an integer factor the planar,
+ * full-rate output of StreamDecoder, for all channels of a scan list.
+ *
+ * Outputs are aligned to the stream-wide scan indices: there is one for
+ * each input scan whose index + 1 is a multiple of factor(), computed from
+ * that scan and the previous ones. The output grid (and so its timestamps)
+ * does not depend on how the stream is split into reads. Gaps in the scan
+ * indices (lost scans) restart the filter, as if the first scan after the
+ * gap had been held constant before it.
+ *
+ * The FIR mode computes only the outputs that are kept (polyphase
+ * decimation), with a dot product in SIMD lanes (AVX2, SSE2 or NEON,
+ * selected at runtime). All implementations add in the same order, so
+ * results are bit-exact across them.
+ */
+class DecimationFilter
+{
+   public:
+    /** Sets up the filter for numChannels channels, and resets it.
+     * The FIR has tapsPerPhase * factor + 1 taps, with a Blackman window
+     * and its -6 dB point at cutoff / factor of the input rate.
+     */
+    void configure(
+        int numChannels, int factor, DecimationMode mode, int tapsPerPhase,
+        double cutoff);
+
+    int            numChannels() const { return numChannels_; }
+    int            factor() const { return factor_; }
+    DecimationMode mode() const { return mode_; }
+
+    /// Filter taps (DC gain 1). Boxcar: factor() taps of 1/factor().
+    const std::vector<float>& taps() const { return taps_; }
+
+    /// Delay of the outputs vs. the scan they are aligned to, in input
+    /// scans: (taps - 1) / 2.
+    double groupDelay() const { return (taps_.size() - 1) * 0.5; }
+
+    /// Upper bound of the outputs produced by process() for numScans
+    /// scans in at most numRuns runs of consecutive scan indices (each run
+    /// may add one output).
+    std::size_t maxOutputs(std::size_t numScans, std::size_t numRuns = 1) const
+    {
+        return std::min(numScans, numScans / factor_ + numRuns);
+    }
+
+    /** Filters numScans scans, in[channel * inStride + scan], with
+     * stream-wide indices scanIndices[scan] (increasing).
+     * Writes each output scan, row-major, to out[o * numChannels() + c],
+     * and the index of the input scan it is aligned to to outIndices[o],
+     * for up to maxOut outputs. Any more are dropped, but the filter state
+     * still advances over all the scans.
+     * \return The number of output scans written, at most maxOut.
+     */
+    std::size_t process(
+        const float* in, std::size_t inStride, const uint64_t* scanIndices,
+        std::size_t numScans, float* out, uint64_t* outIndices,
+        std::size_t maxOut);
+
+    /// Forgets the filter state: the next scan restarts it.
+    void reset() { primed_ = false; }
+
+    /// Name of the FIR dot product implementation in use, e.g. "avx2".
+    static const char* implementation();
+
+   private:
+    int            numChannels_ = 0;
+    int            factor_      = 1;
+    DecimationMode mode_        = DecimationMode::Fir;
+
+    std::vector<float> taps_;
+    std::vector<float> paddedTaps_;  // Zeros first, to a multiple of 8
+
+    // Per channel, the last paddedTaps_.size() - 1 input scans (FIR), or
+    // the sum of the current output period so far (boxcar):
+    std::vector<float> history_;
+    std::vector<float> boxcarSum_;
+    std::vector<float> work_;  // History + the current segment
+    uint64_t           nextIndex_ = 0;  // Expected next scan index
+    bool               primed_    = false;
+
+    std::size_t historyLength() const { return paddedTaps_.size() - 1; }
+
+    void restart(
+        const float* in, std::size_t inStride, std::size_t scan,
+        uint64_t index);
+    std::size_t processSegment(
+        const float* in, std::size_t inStride, const uint64_t* scanIndices,
+        std::size_t begin, std::size_t end, float* out, uint64_t* outIndices,
+        std::size_t maxOut);
+};
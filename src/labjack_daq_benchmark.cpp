@@ -0,0 +1,501 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+// Benchmarks of the StreamData path, on a software U3 (no hardware needed):
+//  - decode: checksum validation and decoding throughput, for several
+//    channel counts and read sizes (readSizeMultiplier),
+//  - calibration: raw to volts conversion cost,
+//  - decimation: anti-aliasing filter and decimation throughput, per core,
+//  - end_to_end: latency from the USB completion of a stream read to the
+//    publish() of its data, through LabjackDevice.
+//
+// Results are written as JSON, to track regressions between releases:
+//   ros2 run labjack_daq labjack_daq_benchmark --output results.json
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <rclcpp/rclcpp.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decimation_filter.h"
+#include "labjack_device.h"
+#include "stream_decoder.h"
+#include "u3_simulator.h"
+
+namespace
+{
+using BenchClock = std::chrono::steady_clock;
+
+struct BenchmarkArgs
+{
+    std::string output;  // Empty: stdout
+    double      minTime      = 0.5;  // Per decode/calibration case [s]
+    bool        endToEnd     = true;
+    double      e2eDuration  = 5.0;  // [s]
+    double      e2eScanRate  = 5000.0;  // [Hz]
+    double      e2ePubRate   = 500.0;  // [Hz]
+    int         e2eChannels  = 5;
+};
+
+const char* kUsage =
+    "Usage: labjack_daq_benchmark [--output FILE] [--min-time S]\n"
+    "         [--no-e2e] [--e2e-duration S] [--e2e-scan-rate HZ]\n"
+    "         [--e2e-publish-rate HZ] [--e2e-channels N]\n";
+
+// argv: without the ROS arguments.
+bool parseArgs(const std::vector<std::string>& argv, BenchmarkArgs& args)
+{
+    for (size_t i = 1; i < argv.size(); i++)
+    {
+        const std::string& a        = argv[i];
+        const bool         hasValue = i + 1 < argv.size();
+
+        if (a == "--no-e2e")
+            args.endToEnd = false;
+        else if (a == "--output" && hasValue)
+            args.output = argv[++i];
+        else if (a == "--min-time" && hasValue)
+            args.minTime = std::atof(argv[++i].c_str());
+        else if (a == "--e2e-duration" && hasValue)
+            args.e2eDuration = std::atof(argv[++i].c_str());
+        else if (a == "--e2e-scan-rate" && hasValue)
+            args.e2eScanRate = std::atof(argv[++i].c_str());
+        else if (a == "--e2e-publish-rate" && hasValue)
+            args.e2ePubRate = std::atof(argv[++i].c_str());
+        else if (a == "--e2e-channels" && hasValue)
+            args.e2eChannels = std::atoi(argv[++i].c_str());
+        else
+            return false;
+    }
+    return args.minTime > 0 && args.e2eDuration > 0 && args.e2eScanRate > 0 &&
+           args.e2ePubRate > 0 && args.e2eChannels >= 1 &&
+           args.e2eChannels <= MaxNumChannels;
+}
+
+double secondsSince(BenchClock::time_point t0)
+{
+    return std::chrono::duration<double>(BenchClock::now() - t0).count();
+}
+
+// Keeps results alive, so the benchmarked code is not optimized out.
+volatile float gSink;
+
+// Single-ended calibration of channels 0..n-1, nominal constants.
+std::vector<AinCalibration> nominalCalibration(int numChannels)
+{
+    u3CalibrationInfo caliInfo = U3_CALIBRATION_INFO_DEFAULT;
+    caliInfo.hardwareVersion   = 1.30;
+    caliInfo.highVoltage       = 0;
+
+    std::vector<AinCalibration> calib(numChannels);
+    for (int c = 0; c < numChannels; c++)
+        makeAinCalibration(caliInfo, 0, c, 31, calib[c]);
+    return calib;
+}
+
+struct DecodeResult
+{
+    int    numChannels, readSizeMultiplier, packetsPerRead;
+    double validateSamplesPerSec, decodeSamplesPerSec, totalSamplesPerSec;
+};
+
+DecodeResult benchmarkDecode(
+    int numChannels, int multiplier, const BenchmarkArgs& args)
+{
+    constexpr int kReads = 64;  // Distinct reads, cycled through
+
+    DecodeResult r;
+    r.numChannels        = numChannels;
+    r.readSizeMultiplier = multiplier;
+    r.packetsPerRead     = StreamDecoder::packetsPerReadFor(
+        numChannels, SamplesPerPacket, multiplier);
+
+    const std::vector<AinCalibration> calib = nominalCalibration(numChannels);
+    std::vector<uint8_t> channels(numChannels), negative(numChannels, 31);
+    for (int c = 0; c < numChannels; c++) channels[c] = c;
+
+    StreamDecoder decoder;
+    decoder.configure(calib, SamplesPerPacket, r.packetsPerRead);
+
+    const int readSize = responseSize * r.packetsPerRead;
+    std::vector<uint8_t> reads(static_cast<size_t>(readSize) * kReads);
+    StreamPacketGenerator gen(
+        calib, channels, negative, SamplesPerPacket, 1e-3, SimSignal());
+    gen.generate(reads.data(), r.packetsPerRead * kReads);
+
+    std::vector<float> out(numChannels * decoder.scansPerRead());
+    const double samplesPerRead =
+        static_cast<double>(r.packetsPerRead) * SamplesPerPacket;
+
+    // Each pass is timed on its own: validation only, decoding only, both.
+    for (int pass = 0; pass < 3; pass++)
+    {
+        uint64_t   numReads = 0;
+        const auto t0       = BenchClock::now();
+        double     elapsed  = 0;
+        do
+        {
+            for (int k = 0; k < kReads; k++)
+            {
+                const uint8_t* read = reads.data() + k * readSize;
+                if (pass != 1)
+                {
+                    for (int m = 0; m < r.packetsPerRead; m++)
+                        if (checkStreamPacket(
+                                read + m * responseSize, SamplesPerPacket) !=
+                            StreamPacketStatus::Ok)
+                            throw std::runtime_error("Invalid StreamData");
+                }
+                if (pass != 0)
+                {
+                    decoder.decode(read, out.data(), decoder.scansPerRead());
+                    gSink = out[0];
+                }
+            }
+            numReads += kReads;
+        } while ((elapsed = secondsSince(t0)) < args.minTime);
+
+        const double rate = numReads * samplesPerRead / elapsed;
+        (pass == 0 ? r.validateSamplesPerSec
+                   : pass == 1 ? r.decodeSamplesPerSec
+                               : r.totalSamplesPerSec) = rate;
+    }
+    return r;
+}
+
+struct CalibrationResult
+{
+    std::string method;
+    double      nsPerSample;
+};
+
+// Cost of the raw to volts conversion, per sample: the SIMD calibration
+// used by the decoder, and the per-sample u3.c function it replaces.
+std::vector<CalibrationResult> benchmarkCalibration(const BenchmarkArgs& args)
+{
+    constexpr std::size_t kSamples = 1 << 16;
+
+    std::vector<uint16_t> raw(kSamples);
+    for (std::size_t i = 0; i < kSamples; i++)
+        raw[i] = static_cast<uint16_t>((i * 2654435761u) >> 16) & 0xFFF0;
+    std::vector<float> out(kSamples);
+
+    const AinCalibration cal = nominalCalibration(1)[0];
+    u3CalibrationInfo    caliInfo = U3_CALIBRATION_INFO_DEFAULT;
+    caliInfo.hardwareVersion      = 1.30;
+
+    std::vector<CalibrationResult> results;
+    for (int method = 0; method < 2; method++)
+    {
+        uint64_t   n       = 0;
+        const auto t0      = BenchClock::now();
+        double     elapsed = 0;
+        do
+        {
+            if (method == 0)
+                calibrateSamples(raw.data(), kSamples, cal, out.data());
+            else
+            {
+                for (std::size_t i = 0; i < kSamples; i++)
+                {
+                    double v;
+                    getAinVoltCalibrated_hw130(&caliInfo, 0, 31, raw[i], &v);
+                    out[i] = static_cast<float>(v);
+                }
+            }
+            gSink = out[kSamples - 1];
+            n += kSamples;
+        } while ((elapsed = secondsSince(t0)) < args.minTime);
+
+        results.push_back(
+            {method == 0 ? std::string("calibrateSamples_") +
+                               calibrateSamplesImplementation()
+                         : std::string("getAinVoltCalibrated_hw130"),
+             elapsed * 1e9 / n});
+    }
+    return results;
+}
+
+struct DecimationResult
+{
+    std::string mode;
+    int         numChannels, factor, numTaps;
+    double      samplesPerSec;  // Input samples, all channels
+};
+
+// Throughput of DecimationFilter on one core, fed with blocks of planar
+// scans like the decoder output.
+DecimationResult benchmarkDecimation(
+    DecimationMode mode, int numChannels, int factor,
+    const BenchmarkArgs& args)
+{
+    constexpr std::size_t kScans = 1000;  // Per block
+
+    DecimationFilter filter;
+    filter.configure(
+        numChannels, factor, mode, DecimationOptions().tapsPerPhase,
+        DecimationOptions().cutoff);
+
+    std::vector<float> in(numChannels * kScans);
+    for (std::size_t i = 0; i < in.size(); i++)
+        in[i] = std::sin(i * 0.01f);
+    std::vector<uint64_t> indices(kScans);
+    std::vector<float>    out(filter.maxOutputs(kScans) * numChannels);
+    std::vector<uint64_t> outIndices(filter.maxOutputs(kScans));
+
+    uint64_t   numScans = 0;
+    const auto t0       = BenchClock::now();
+    double     elapsed  = 0;
+    do
+    {
+        for (std::size_t s = 0; s < kScans; s++) indices[s] = numScans + s;
+        const std::size_t n = filter.process(
+            in.data(), kScans, indices.data(), kScans, out.data(),
+            outIndices.data(), outIndices.size());
+        if (n) gSink = out[0];
+        numScans += kScans;
+    } while ((elapsed = secondsSince(t0)) < args.minTime);
+
+    return {
+        mode == DecimationMode::Fir ? "fir" : "boxcar", numChannels, factor,
+        static_cast<int>(filter.taps().size()),
+        numScans * numChannels / elapsed};
+}
+
+struct EndToEndResult
+{
+    double              scanRate, publishRate;
+    int                 numChannels;
+    std::vector<double> latencyUs;  // Sorted
+};
+
+// Streams from a software U3 through LabjackDevice, as the node does, and
+// measures the time from each read's USB completion to its publish().
+EndToEndResult benchmarkEndToEnd(const BenchmarkArgs& args)
+{
+    EndToEndResult r;
+    r.scanRate    = args.e2eScanRate;
+    r.publishRate = args.e2ePubRate;
+    r.numChannels = args.e2eChannels;
+
+    U3SimulatorOptions simOptions;
+    simOptions.localID      = 200;
+    simOptions.serialNumber = 320000200;
+    U3Simulator sim(simOptions);
+
+    DeviceOptions options;
+    options.publishRate = args.e2ePubRate;
+    options.stream.positiveChannels.clear();
+    options.stream.negativeChannels.clear();
+    for (int c = 0; c < args.e2eChannels; c++)
+    {
+        options.stream.positiveChannels.push_back(c);
+        options.stream.negativeChannels.push_back(31);
+    }
+    options.stream.scanInterval =
+        static_cast<uint16>(std::lround(4e6 / args.e2eScanRate));
+    r.scanRate = options.stream.scanRate();
+
+    auto node = std::make_shared<rclcpp::Node>("labjack_daq_benchmark");
+    auto device =
+        std::make_unique<LabjackDevice>(*node, simOptions.localID, "", options);
+
+    // Only called from the device's timer:
+    std::vector<double> latencyUs;
+    latencyUs.reserve(static_cast<size_t>(args.e2ePubRate * args.e2eDuration));
+    device->setPublishHook(
+        [&latencyUs](int64_t usbCompletionNs)
+        {
+            const int64_t nowNs =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    BenchClock::now().time_since_epoch())
+                    .count();
+            latencyUs.push_back((nowNs - usbCompletionNs) * 1e-3);
+        });
+
+    std::atomic_bool usbStop{false};
+    device->startTransfers();
+    std::thread usbThread(
+        [&usbStop]()
+        {
+            while (!usbStop) LJUSB_StreamPoll(100);
+        });
+
+    rclcpp::executors::MultiThreadedExecutor executor;
+    executor.add_node(node);
+    std::thread spinThread([&executor]() { executor.spin(); });
+
+    std::this_thread::sleep_for(
+        std::chrono::duration<double>(args.e2eDuration));
+
+    executor.cancel();
+    spinThread.join();
+    usbStop = true;
+    usbThread.join();
+    device->stopTransfers();
+    device.reset();
+
+    std::sort(latencyUs.begin(), latencyUs.end());
+    r.latencyUs = std::move(latencyUs);
+    return r;
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    const std::size_t i = static_cast<std::size_t>(
+        std::min(p / 100 * sorted.size(), sorted.size() - 1.0));
+    return sorted[i];
+}
+
+void writeJson(
+    std::ostream& os, const std::vector<DecodeResult>& decode,
+    const std::vector<CalibrationResult>& calibration,
+    const std::vector<DecimationResult>& decimation,
+    const EndToEndResult* e2e)
+{
+    char date[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    os << "{\n";
+    os << "  \"benchmark\": \"labjack_daq\",\n";
+    os << "  \"date\": \"" << date << "\",\n";
+    os << "  \"samples_per_packet\": " << static_cast<int>(SamplesPerPacket)
+       << ",\n";
+    os << "  \"calibrate_implementation\": \""
+       << calibrateSamplesImplementation() << "\",\n";
+    os << "  \"decimation_implementation\": \""
+       << DecimationFilter::implementation() << "\",\n";
+
+    os << "  \"decode\": [\n";
+    for (size_t i = 0; i < decode.size(); i++)
+    {
+        const DecodeResult& d = decode[i];
+        os << "    {\"channels\": " << d.numChannels
+           << ", \"read_size_multiplier\": " << d.readSizeMultiplier
+           << ", \"packets_per_read\": " << d.packetsPerRead
+           << ", \"validate_samples_per_s\": " << d.validateSamplesPerSec
+           << ", \"decode_samples_per_s\": " << d.decodeSamplesPerSec
+           << ", \"total_samples_per_s\": " << d.totalSamplesPerSec << "}"
+           << (i + 1 < decode.size() ? ",\n" : "\n");
+    }
+    os << "  ],\n";
+
+    os << "  \"calibration\": [\n";
+    for (size_t i = 0; i < calibration.size(); i++)
+    {
+        os << "    {\"method\": \"" << calibration[i].method
+           << "\", \"ns_per_sample\": " << calibration[i].nsPerSample << "}"
+           << (i + 1 < calibration.size() ? ",\n" : "\n");
+    }
+    os << "  ],\n";
+
+    os << "  \"decimation\": [\n";
+    for (size_t i = 0; i < decimation.size(); i++)
+    {
+        const DecimationResult& d = decimation[i];
+        os << "    {\"mode\": \"" << d.mode << "\", \"channels\": "
+           << d.numChannels << ", \"factor\": " << d.factor
+           << ", \"taps\": " << d.numTaps
+           << ", \"samples_per_s\": " << d.samplesPerSec << "}"
+           << (i + 1 < decimation.size() ? ",\n" : "\n");
+    }
+    os << "  ]";
+
+    if (e2e)
+    {
+        const auto&  l = e2e->latencyUs;
+        const double mean =
+            l.empty() ? 0 : std::accumulate(l.begin(), l.end(), 0.0) / l.size();
+        os << ",\n  \"end_to_end\": {\"scan_rate\": " << e2e->scanRate
+           << ", \"publish_rate\": " << e2e->publishRate
+           << ", \"channels\": " << e2e->numChannels
+           << ", \"messages\": " << l.size() << ",\n";
+        os << "    \"latency_us\": {\"min\": " << (l.empty() ? 0 : l.front())
+           << ", \"mean\": " << mean << ", \"p50\": " << percentile(l, 50)
+           << ", \"p90\": " << percentile(l, 90)
+           << ", \"p99\": " << percentile(l, 99)
+           << ", \"max\": " << (l.empty() ? 0 : l.back()) << "}}";
+    }
+    os << "\n}\n";
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    BenchmarkArgs args;
+    if (!parseArgs(rclcpp::init_and_remove_ros_arguments(argc, argv), args))
+    {
+        std::cerr << kUsage;
+        return 1;
+    }
+
+    std::vector<DecodeResult> decode;
+    for (const int numChannels : {1, 2, 4, 5, 8, 16, 25})
+    {
+        for (const int multiplier : {1, 2, 5, 10, 25})
+        {
+            std::cerr << "decode: " << numChannels << " channels, x"
+                      << multiplier << "\n";
+            decode.push_back(benchmarkDecode(numChannels, multiplier, args));
+        }
+    }
+
+    std::cerr << "calibration\n";
+    const std::vector<CalibrationResult> calibration =
+        benchmarkCalibration(args);
+
+    std::vector<DecimationResult> decimation;
+    for (const DecimationMode mode :
+         {DecimationMode::Fir, DecimationMode::Boxcar})
+    {
+        for (const int numChannels : {1, 5, 16})
+        {
+            for (const int factor : {10, 100})
+            {
+                std::cerr << "decimation: " << numChannels << " channels, /"
+                          << factor << "\n";
+                decimation.push_back(
+                    benchmarkDecimation(mode, numChannels, factor, args));
+            }
+        }
+    }
+
+    std::unique_ptr<EndToEndResult> e2e;
+    if (args.endToEnd)
+    {
+        std::cerr << "end to end (" << args.e2eDuration << " s)\n";
+        e2e = std::make_unique<EndToEndResult>(benchmarkEndToEnd(args));
+    }
+
+    if (args.output.empty())
+        writeJson(std::cout, decode, calibration, decimation, e2e.get());
+    else
+    {
+        std::ofstream f(args.output);
+        writeJson(f, decode, calibration, decimation, e2e.get());
+        if (!f)
+        {
+            std::cerr << "Error writing " << args.output << "\n";
+            return 1;
+        }
+    }
+
+    rclcpp::shutdown();
+    return 0;
+}
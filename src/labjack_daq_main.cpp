@@ -0,0 +1,26 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include <memory>
+#include <rclcpp/rclcpp.hpp>
+
+#include "labjack_daq_node.h"
+
+int main(int argc, char** argv)
+{
+    rclcpp::init(argc, argv);
+    auto node = std::make_shared<LabjackNode>();
+
+    // hardware_concurrency() threads by default. Each device has its own
+    // mutually exclusive callback group, so its timer never runs twice at
+    // once, but different devices decode and publish in parallel:
+    rclcpp::executors::MultiThreadedExecutor executor;
+    executor.add_node(node);
+    executor.spin();
+
+    rclcpp::shutdown();
+    return 0;
+}
@@ -4,610 +4,362 @@
  *  License: MIT
  *-------------------------------------------------------------------------- */
 
-#include <cstdint>
-#include <memory>
-#include <rclcpp/rclcpp.hpp>
-#include <std_msgs/msg/float32_multi_array.hpp>
-#include <vector>
-
-#include "u3.h"
-
-int ConfigIO_example(HANDLE hDevice, int* isDAC1Enabled);
-int StreamConfig_example(HANDLE hDevice);
-int StreamStart(HANDLE hDevice);
-int StreamStop(HANDLE hDevice);
-
-// For this example to work proper SamplesPerPacket needs to be a multiple of
-// NumChannels.
-constexpr uint8 NumChannels = 5;
+#include "labjack_daq_node.h"
 
-// Needs to be 25 to read multiple  StreamData responses in one large packet,
-// otherwise can be any value between 1-25 for 1 StreamData response per packet.
-constexpr uint8 SamplesPerPacket = 25;
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <rclcpp_components/register_node_macro.hpp>
+#include <string>
 
-class LabjackNode : public rclcpp::Node
+LabjackNode::LabjackNode(const rclcpp::NodeOptions& options)
+    : Node("labjack_daq", options)
 {
-   public:
-    LabjackNode() : Node("labjack_daq")
+    // Parameters
+    this->declare_parameter<double>("publish_rate", options_.publishRate);
+    this->get_parameter("publish_rate", options_.publishRate);
+
+    this->declare_parameter<int>(
+        "usb_queued_transfers", options_.usbQueuedTransfers);
+    this->get_parameter("usb_queued_transfers", options_.usbQueuedTransfers);
+    if (options_.usbQueuedTransfers < 1)
+        throw std::runtime_error("usb_queued_transfers must be >= 1");
+
+    this->declare_parameter<bool>("publish_batches", options_.publishBatches);
+    this->get_parameter("publish_batches", options_.publishBatches);
+
+    this->declare_parameter<bool>("publish_raw", options_.publishRaw);
+    this->get_parameter("publish_raw", options_.publishRaw);
+
+    this->declare_parameter<bool>("publish_fixed", options_.publishFixed);
+    this->get_parameter("publish_fixed", options_.publishFixed);
+
+    this->declare_parameter<double>(
+        "diagnostics_period", options_.diagnosticsPeriod);
+    this->get_parameter("diagnostics_period", options_.diagnosticsPeriod);
+    if (!(options_.diagnosticsPeriod >= 0))
+        throw std::runtime_error("diagnostics_period must be >= 0");
+
+    this->declare_parameter<double>(
+        "timestamp_drift_window", options_.timestampDriftWindow);
+    this->get_parameter(
+        "timestamp_drift_window", options_.timestampDriftWindow);
+    if (!(options_.timestampDriftWindow > 0))
+        throw std::runtime_error("timestamp_drift_window must be > 0");
+
+    this->declare_parameter<std::string>(
+        "raw_capture_dir", options_.rawCaptureDir);
+    this->get_parameter("raw_capture_dir", options_.rawCaptureDir);
+
+    options_.decimation = loadDecimationOptions(*this);
+
+    this->declare_parameter<double>(
+        "statistics_window", options_.statisticsWindow);
+    this->get_parameter("statistics_window", options_.statisticsWindow);
+    if (!(options_.statisticsWindow >= 0))
+        throw std::runtime_error("statistics_window must be >= 0");
+
+    options_.trigger = loadTriggerOptions(*this);
+
+    loadStreamSettings();
+    loadRealtimeOptions();
+    addSimulatedDevices();
+
+    // Everything allocated from now on (devices, buffers, thread stacks) is
+    // faulted in right away, before streaming:
+    if (realtime_.lockMemory) lockProcessMemory();
+    if (realtime_.latencyProbe > 0) probeWakeupLatency();
+
+    std::vector<int64_t> deviceIds;
+    this->declare_parameter<std::vector<int64_t>>("device_ids", deviceIds);
+    this->get_parameter("device_ids", deviceIds);
+
+    // Open all devices before streaming from any of them:
+    if (deviceIds.empty())
     {
-        // Open the device:
-        // Opening first found U3 over USB
-        if ((hDevice_ = openUSBConnection(-1)) == nullptr)
-            throw std::runtime_error("Error: openUSBConnection");
-
-        // Getting calibration information from U3
-        if (getCalibrationInfo(hDevice_, &caliInfo_) < 0)
-            throw std::runtime_error("Error: getCalibrationInfo");
-
-        if (ConfigIO_example(hDevice_, &dac1Enabled_) != 0)
-            throw std::runtime_error("Error: ConfigIO_example");
-
-        // Stopping any previous streams
-        StreamStop(hDevice_);
-
-        if (StreamConfig_example(hDevice_) != 0)
-            throw std::runtime_error("Error: StreamConfig_example");
-
-        if (StreamStart(hDevice_) != 0)
-            throw std::runtime_error("Error: StreamStart");
-
-        // Parameters
-        this->declare_parameter<double>("publish_rate", publish_rate_);
-        this->get_parameter("publish_rate", publish_rate_);
-
-        timerPub_ = this->create_wall_timer(
-            std::chrono::duration<double>(1.0 / publish_rate_),
-            std::bind(&LabjackNode::onReadAndPubTimer, this));
-
-        adcPub_ = this->create_publisher<std_msgs::msg::Float32MultiArray>(
-            "gpio_adc", 10);
+        // Single device mode: first U3 found, topics without prefix.
+        devices_.push_back(
+            std::make_unique<LabjackDevice>(*this, -1, "", options_));
     }
-
-    ~LabjackNode()
+    else
     {
-        StreamStop(hDevice_);
-        closeUSBConnection(hDevice_);
+        for (const int64_t id : deviceIds)
+            devices_.push_back(std::make_unique<LabjackDevice>(
+                *this, static_cast<int>(id),
+                "u3_" + std::to_string(id) + "/", options_));
     }
 
-   private:
-    double                       publish_rate_ = 50.0;
-    rclcpp::TimerBase::SharedPtr timerPub_;
-    rclcpp::Publisher<std_msgs::msg::Float32MultiArray>::SharedPtr adcPub_;
-
-    HANDLE            hDevice_ = nullptr;
-    u3CalibrationInfo caliInfo_;
-    int               dac1Enabled_;
+    for (auto& dev : devices_) dev->startTransfers();
 
-    void onReadAndPubTimer();
-};
-
-int main(int argc, char** argv)
-{
-    rclcpp::init(argc, argv);
-    auto node = std::make_shared<LabjackNode>();
-    rclcpp::spin(node);
-    rclcpp::shutdown();
-    return 0;
-}
-
-// Sends a ConfigIO low-level command that configures the FIOs, DAC, Timers and
-// Counters for this example
-int ConfigIO_example(HANDLE hDevice, int* isDAC1Enabled)
-{
-    printf("ConfigIO_example...\n");
-
-    uint8  sendBuff[12], recBuff[12];
-    uint16 checksumTotal;
-    int    sendChars, recChars;
-
-    sendBuff[1] = (uint8)(0xF8);  // Command byte
-    sendBuff[2] = (uint8)(0x03);  // Number of data words
-    sendBuff[3] = (uint8)(0x0B);  // Extended command number
-
-    sendBuff[6] =
-        13;  // Writemask : Setting writemask for timerCounterConfig (bit 0),
-             //            FIOAnalog (bit 2) and EIOAnalog (bit 3)
-
-    sendBuff[7] = 0;  // Reserved
-    sendBuff[8] =
-        64;  // TimerCounterConfig: Disabling all timers and counters,
-             //                    set TimerCounterPinOffset to 4 (bits 4-7)
-    sendBuff[9] = 0;  // DAC1Enable
-
-    sendBuff[10] = 255;  // FIOAnalog : setting all FIOs as analog inputs
-    sendBuff[11] = 255;  // EIOAnalog : setting all EIOs as analog inputs
-    extendedChecksum(sendBuff, 12);
-
-    // Sending command to U3
-    if ((sendChars = LJUSB_Write(hDevice, sendBuff, 12)) < 12)
+    // All USB stream transfers complete in this single thread,
+    // decoupled from the ROS executor and publish_rate:
+    usbThread_ = std::thread(&LabjackNode::usbEventThread, this);
+    try
     {
-        if (sendChars == 0)
-            printf("ConfigIO error : write failed\n");
-        else
-            printf("ConfigIO error : did not write all of the buffer\n");
-        return -1;
+        setThreadRealtime(usbThread_, realtime_);
     }
-
-    // Reading response from U3
-    if ((recChars = LJUSB_Read(hDevice, recBuff, 12)) < 12)
-    {
-        if (recChars == 0)
-            printf("ConfigIO error : read failed\n");
-        else
-            printf("ConfigIO error : did not read all of the buffer\n");
-        return -1;
-    }
-
-    checksumTotal = extendedChecksum16(recBuff, 12);
-    if ((uint8)((checksumTotal / 256) & 0xFF) != recBuff[5])
+    catch (const std::exception&)
     {
-        printf("ConfigIO error : read buffer has bad checksum16(MSB)\n");
-        return -1;
+        // The destructor does not run if the constructor throws:
+        stopStreaming();
+        throw;
     }
-
-    if ((uint8)(checksumTotal & 0xFF) != recBuff[4])
-    {
-        printf("ConfigIO error : read buffer has bad checksum16(LBS)\n");
-        return -1;
-    }
-
-    if (extendedChecksum8(recBuff) != recBuff[0])
-    {
-        printf("ConfigIO error : read buffer has bad checksum8\n");
-        return -1;
-    }
-
-    if (recBuff[1] != (uint8)(0xF8) || recBuff[2] != (uint8)(0x03) ||
-        recBuff[3] != (uint8)(0x0B))
-    {
-        printf("ConfigIO error : read buffer has wrong command bytes\n");
-        return -1;
-    }
-
-    if (recBuff[6] != 0)
-    {
-        printf(
-            "ConfigIO error : read buffer received errorcode %d\n", recBuff[6]);
-        return -1;
-    }
-
-    if (recBuff[8] != 64)
-    {
-        printf(
-            "ConfigIO error : TimerCounterConfig did not get set correctly\n");
-        return -1;
-    }
-
-    if (recBuff[10] != 255 && recBuff[10] != (uint8)(0x0F))
-    {
-        printf("ConfigIO error : FIOAnalog did not set get correctly\n");
-        return -1;
-    }
-
-    if (recBuff[11] != 255)
-    {
-        printf(
-            "ConfigIO error : EIOAnalog did not set get correctly (%d)\n",
-            recBuff[11]);
-        return -1;
-    }
-
-    *isDAC1Enabled = (int)recBuff[9];
-
-    printf("ConfigIO_example... OK\n");
-    return 0;
 }
 
-// Sends a StreamConfig low-level command to configure the stream.
-int StreamConfig_example(HANDLE hDevice)
+LabjackNode::~LabjackNode()
 {
-    uint8  sendBuff[64], recBuff[8];
-    uint16 checksumTotal, scanInterval;
-    int    sendBuffSize, sendChars, recChars, i;
-
-    sendBuffSize = 12 + NumChannels * 2;
-
-    sendBuff[1] = (uint8)(0xF8);  // Command byte
-    sendBuff[2] = 3 + NumChannels;  // Number of data words = NumChannels + 3
-    sendBuff[3] = (uint8)(0x11);  // Extended command number
-    sendBuff[6] = NumChannels;  // NumChannels
-    sendBuff[7] = SamplesPerPacket;  // SamplesPerPacket
-    sendBuff[8] = 0;  // Reserved
-    sendBuff[9] = 1;  // ScanConfig:
-                      // Bit 7: Reserved
-                      // Bit 6: Reserved
-                      // Bit 3: Internal stream clock frequency = b0: 4 MHz
-                      // Bit 2: Divide Clock by 256 = b0
-                      // Bits 0-1: Resolution = b01: 11.9-bit effective
-
-    scanInterval = 4000;
-    sendBuff[10] = (uint8)(scanInterval & (0x00FF));  // Scan interval (low
-                                                      // byte)
-    sendBuff[11] = (uint8)(scanInterval / 256);  // Scan interval (high byte)
-
-    for (i = 0; i < NumChannels; i++)
-    {
-        sendBuff[12 + i * 2] = i;  // PChannel = i
-        sendBuff[13 + i * 2] = 31;  // NChannel = 31: Single Ended
-    }
-
-    extendedChecksum(sendBuff, sendBuffSize);
-
-    // Sending command to U3
-    sendChars = LJUSB_Write(hDevice, sendBuff, sendBuffSize);
-    if (sendChars < sendBuffSize)
-    {
-        if (sendChars == 0)
-            printf("Error : write failed (StreamConfig).\n");
-        else
-            printf("Error : did not write all of the buffer (StreamConfig).\n");
-        return -1;
-    }
-
-    for (i = 0; i < 8; i++) recBuff[i] = 0;
-
-    // Reading response from U3
-    recChars = LJUSB_Read(hDevice, recBuff, 8);
-    if (recChars < 8)
-    {
-        if (recChars == 0)
-            printf("Error : read failed (StreamConfig).\n");
-        else
-            printf(
-                "Error : did not read all of the buffer, %d (StreamConfig).\n",
-                recChars);
-
-        for (i = 0; i < 8; i++) printf("%d ", recBuff[i]);
-
-        return -1;
-    }
-
-    checksumTotal = extendedChecksum16(recBuff, 8);
-    if ((uint8)((checksumTotal / 256) & 0xFF) != recBuff[5])
-    {
-        printf("Error : read buffer has bad checksum16(MSB) (StreamConfig).\n");
-        return -1;
-    }
-
-    if ((uint8)(checksumTotal & 0xFF) != recBuff[4])
-    {
-        printf("Error : read buffer has bad checksum16(LBS) (StreamConfig).\n");
-        return -1;
-    }
-
-    if (extendedChecksum8(recBuff) != recBuff[0])
-    {
-        printf("Error : read buffer has bad checksum8 (StreamConfig).\n");
-        return -1;
-    }
-
-    if (recBuff[1] != (uint8)(0xF8) || recBuff[2] != (uint8)(0x01) ||
-        recBuff[3] != (uint8)(0x11) || recBuff[7] != (uint8)(0x00))
-    {
-        printf("Error : read buffer has wrong command bytes (StreamConfig).\n");
-        return -1;
-    }
-
-    if (recBuff[6] != 0)
-    {
-        printf(
-            "Errorcode # %d from StreamConfig read.\n",
-            (unsigned int)recBuff[6]);
-        return -1;
-    }
-
-    return 0;
+    stopStreaming();
+    devices_.clear();
+    simulators_.clear();
 }
 
-// Sends a StreamStart low-level command to start streaming.
-int StreamStart(HANDLE hDevice)
+// Stops the USB event thread, then the stream transfers of all devices.
+void LabjackNode::stopStreaming()
 {
-    uint8 sendBuff[2], recBuff[4];
-    int   sendChars, recChars;
+    usbStop_ = true;
+    if (usbThread_.joinable()) usbThread_.join();
 
-    sendBuff[0] = (uint8)(0xA8);  // CheckSum8
-    sendBuff[1] = (uint8)(0xA8);  // command byte
+    for (auto& dev : devices_) dev->stopTransfers();
+}
 
-    // Sending command to U3
-    sendChars = LJUSB_Write(hDevice, sendBuff, 2);
-    if (sendChars < 2)
+// Reads the scan list and timing parameters into options_.stream.
+void LabjackNode::loadStreamSettings()
+{
+    std::vector<int64_t> positive = {0, 1, 2, 3, 4};
+    std::vector<int64_t> negative;
+    int                  resolution = options_.stream.resolution;
+    std::string          clock      = "4MHz";
+    double               scanRate   = 1000.0;
+
+    this->declare_parameter<std::vector<int64_t>>(
+        "channels_positive", positive);
+    this->get_parameter("channels_positive", positive);
+    this->declare_parameter<std::vector<int64_t>>(
+        "channels_negative", negative);
+    this->get_parameter("channels_negative", negative);
+    this->declare_parameter<int>("resolution", resolution);
+    this->get_parameter("resolution", resolution);
+    this->declare_parameter<std::string>("stream_clock", clock);
+    this->get_parameter("stream_clock", clock);
+    this->declare_parameter<double>("scan_rate", scanRate);
+    this->get_parameter("scan_rate", scanRate);
+
+    if (positive.empty() || positive.size() > MaxNumChannels)
+        throw std::runtime_error(
+            "channels_positive must have between 1 and " +
+            std::to_string(MaxNumChannels) + " entries");
+
+    // Empty: all channels single-ended.
+    if (negative.empty()) negative.assign(positive.size(), 31);
+    if (negative.size() != positive.size())
+        throw std::runtime_error(
+            "channels_negative must be empty or have the same length as "
+            "channels_positive");
+
+    auto& s = options_.stream;
+    s.positiveChannels.clear();
+    s.negativeChannels.clear();
+    for (size_t i = 0; i < positive.size(); i++)
     {
-        if (sendChars == 0)
-            printf("Error : write failed.\n");
-        else
-            printf("Error : did not write all of the buffer.\n");
-        return -1;
+        if (positive[i] < 0 || positive[i] > 255 || negative[i] < 0 ||
+            negative[i] > 255)
+            throw std::runtime_error("Invalid channel number in scan list");
+        s.positiveChannels.push_back(static_cast<uint8>(positive[i]));
+        s.negativeChannels.push_back(static_cast<uint8>(negative[i]));
     }
 
-    // Reading response from U3
-    recChars = LJUSB_Read(hDevice, recBuff, 4);
-    if (recChars < 4)
-    {
-        if (recChars == 0)
-            printf("Error : read failed.\n");
-        else
-            printf("Error : did not read all of the buffer.\n");
-        return -1;
-    }
+    if (resolution < 0 || resolution > 3)
+        throw std::runtime_error("resolution must be in the range 0-3");
+    s.resolution = static_cast<uint8>(resolution);
+
+    if (clock == "4MHz")
+        s.clock48MHz = false;
+    else if (clock == "48MHz")
+        s.clock48MHz = true;
+    else
+        throw std::runtime_error("stream_clock must be '4MHz' or '48MHz'");
+
+    if (!(scanRate > 0))
+        throw std::runtime_error("scan_rate must be positive");
+
+    // Slow rates need the clock divided by 256 to fit the 16-bit interval:
+    double interval = (s.clock48MHz ? 48e6 : 4e6) / scanRate;
+    s.clockDiv256   = interval > 65535.0;
+    if (s.clockDiv256) interval /= 256;
+
+    if (interval < 0.5 || interval > 65535.0)
+        throw std::runtime_error(
+            "scan_rate out of range for the selected stream_clock");
+    s.scanInterval = static_cast<uint16>(std::max(1L, std::lround(interval)));
+
+    if (std::abs(s.scanRate() - scanRate) > 1e-6 * scanRate)
+        RCLCPP_WARN(
+            get_logger(),
+            "scan_rate %f Hz is not reachable, using %f Hz instead.",
+            scanRate, s.scanRate());
+}
 
-    if (normalChecksum8(recBuff, 4) != recBuff[0])
+// Reads the realtime.* parameters, for the USB event thread.
+void LabjackNode::loadRealtimeOptions()
+{
+    std::vector<int64_t> cpus;
+
+    this->declare_parameter<int>("realtime.priority", realtime_.priority);
+    this->get_parameter("realtime.priority", realtime_.priority);
+    this->declare_parameter<std::vector<int64_t>>("realtime.cpus", cpus);
+    this->get_parameter("realtime.cpus", cpus);
+    this->declare_parameter<bool>(
+        "realtime.lock_memory", realtime_.lockMemory);
+    this->get_parameter("realtime.lock_memory", realtime_.lockMemory);
+    this->declare_parameter<double>(
+        "realtime.latency_probe", realtime_.latencyProbe);
+    this->get_parameter("realtime.latency_probe", realtime_.latencyProbe);
+
+    if (realtime_.priority < 0 || realtime_.priority > 99)
+        throw std::runtime_error("realtime.priority must be in the range 0-99");
+    if (!(realtime_.latencyProbe >= 0))
+        throw std::runtime_error("realtime.latency_probe must be >= 0");
+
+    const int numCpus = static_cast<int>(std::thread::hardware_concurrency());
+    realtime_.cpus.clear();
+    for (const int64_t cpu : cpus)
     {
-        printf("Error : read buffer has bad checksum8 (StreamStart).\n");
-        return -1;
+        if (cpu < 0 || (numCpus > 0 && cpu >= numCpus))
+            throw std::runtime_error(
+                "realtime.cpus: no CPU " + std::to_string(cpu));
+        realtime_.cpus.push_back(static_cast<int>(cpu));
     }
+}
 
-    if (recBuff[1] != (uint8)(0xA9) || recBuff[3] != (uint8)(0x00))
+// Measures the wakeup latency of a thread with the same scheduling and CPU
+// affinity as the USB event thread, before streaming, and reports it. The
+// USB event thread must handle each read within the time the U3 buffer
+// lasts, or the device overflows (StreamData error 59).
+void LabjackNode::probeWakeupLatency()
+{
+    // The probe starts once its scheduling is set, or not at all:
+    WakeupLatency      latency;
+    std::promise<bool> start;
+    std::thread        probe(
+        [this, &latency, run = start.get_future()]() mutable
+        {
+            if (run.get())
+                latency = measureWakeupLatency(realtime_.latencyProbe);
+        });
+    try
     {
-        printf("Error : read buffer has wrong command bytes \n");
-        return -1;
+        setThreadRealtime(probe, realtime_);
     }
-
-    if (recBuff[2] != 0)
+    catch (...)
     {
-        printf(
-            "Errorcode # %d from StreamStart read.\n",
-            (unsigned int)recBuff[2]);
-        return -1;
+        start.set_value(false);
+        probe.join();
+        throw;
     }
-
-    return 0;
+    start.set_value(true);
+    probe.join();
+
+    RCLCPP_INFO(
+        get_logger(),
+        "Acquisition thread wakeup latency over %.1f s (%s): mean %.1f us, "
+        "p99 %.1f us, worst %.1f us.",
+        realtime_.latencyProbe,
+        realtime_.priority > 0 ? "SCHED_FIFO" : "normal scheduling",
+        latency.mean, latency.p99, latency.max);
 }
 
-// Reads the StreamData low-level function response in a loop.  All voltages
-// from the stream are stored in the voltages 2D array.
-void LabjackNode::onReadAndPubTimer()
+// Adds the software U3s of the simulated_devices parameter, which are then
+// opened like USB ones (and before them).
+void LabjackNode::addSimulatedDevices()
 {
-    uint16 voltageBytes, checksumTotal;
-    double hardwareVersion;
-    int    recBuffSize, recChars, autoRecoveryOn;
-    int    currChannel, scanNumber;
-    int    j, k, m;
-    int    totalPackets;  // The total number of StreamData responses read
-
-    // Number of packets to read before displaying streaming information
-    constexpr int numReadsPerDisplay = 1;
-
-    // Multiplier for the StreamData receive buffer size
-    constexpr int readSizeMultiplier = 5;
-    // The number of bytes in a StreamData response (differs with
-    // SamplesPerPacket)
-    constexpr int responseSize = 14 + SamplesPerPacket * 2;
-
-    /* Each StreamData response contains (SamplesPerPacket / NumChannels) *
-     * readSizeMultiplier samples for each channel. Total number of scans =
-     * (SamplesPerPacket / NumChannels) * readSizeMultiplier *
-     * numReadsPerDisplay * numDisplay
-     */
-    double voltages
-        [(SamplesPerPacket / NumChannels) * readSizeMultiplier *
-         numReadsPerDisplay][NumChannels];
-    uint8 recBuff[responseSize * readSizeMultiplier];
-
-    currChannel     = 0;
-    scanNumber      = 0;
-    totalPackets    = 0;
-    recChars        = 0;
-    autoRecoveryOn  = 0;
-    recBuffSize     = 14 + SamplesPerPacket * 2;
-    hardwareVersion = caliInfo_.hardwareVersion;
-
-    for (j = 0; j < numReadsPerDisplay; j++)
+    std::vector<int64_t> localIds;
+    std::string          waveform = "sine";
+    U3SimulatorOptions   sim;
+
+    this->declare_parameter<std::vector<int64_t>>(
+        "simulated_devices", localIds);
+    this->get_parameter("simulated_devices", localIds);
+    this->declare_parameter<std::string>("simulation.waveform", waveform);
+    this->get_parameter("simulation.waveform", waveform);
+    this->declare_parameter<double>(
+        "simulation.amplitude", sim.signal.amplitude);
+    this->get_parameter("simulation.amplitude", sim.signal.amplitude);
+    this->declare_parameter<double>(
+        "simulation.frequency", sim.signal.frequency);
+    this->get_parameter("simulation.frequency", sim.signal.frequency);
+    this->declare_parameter<double>("simulation.offset", sim.signal.offset);
+    this->get_parameter("simulation.offset", sim.signal.offset);
+    this->declare_parameter<double>("simulation.noise", sim.signal.noise);
+    this->get_parameter("simulation.noise", sim.signal.noise);
+    this->declare_parameter<double>(
+        "simulation.clock_drift_ppm", sim.clockDriftPpm);
+    this->get_parameter("simulation.clock_drift_ppm", sim.clockDriftPpm);
+    this->declare_parameter<double>(
+        "simulation.usb_latency", sim.usbLatency);
+    this->get_parameter("simulation.usb_latency", sim.usbLatency);
+
+    if (localIds.empty()) return;
+
+    if (!parseSimWaveform(waveform, sim.signal.waveform))
+        throw std::runtime_error(
+            "simulation.waveform must be one of: constant, sine, square, "
+            "triangle, sawtooth, noise");
+    if (sim.signal.noise < 0 || sim.usbLatency < 0)
+        throw std::runtime_error(
+            "simulation.noise and simulation.usb_latency must be >= 0");
+
+    for (const int64_t id : localIds)
     {
-        /* For USB StreamData, use Endpoint 3 for reads.  You can read the
-         * multiple StreamData responses of 64 bytes only if
-         * SamplesPerPacket is 25 to help improve streaming performance.  In
-         * this example this multiple is adjusted by the readSizeMultiplier
-         * variable.
-         */
-
-        // Reading stream response from U3
-        recChars =
-            LJUSB_Stream(hDevice_, recBuff, responseSize * readSizeMultiplier);
-        if (recChars < responseSize * readSizeMultiplier)
-        {
-            if (recChars == 0)
-                RCLCPP_ERROR(
-                    get_logger(), "Error : read failed (StreamData).\n");
-            else
-                RCLCPP_ERROR(
-                    get_logger(),
-                    "Error : did not read all of the buffer, expected %d "
-                    "bytes but received %d(StreamData).\n",
-                    responseSize * readSizeMultiplier, recChars);
-            return;
-        }
+        if (id < 0 || id > 255)
+            throw std::runtime_error(
+                "simulated_devices entries must be local IDs, 0-255");
 
-        // Checking for errors and getting data out of each StreamData
-        // response
-        for (m = 0; m < readSizeMultiplier; m++)
-        {
-            totalPackets++;
-
-            checksumTotal =
-                extendedChecksum16(recBuff + m * recBuffSize, recBuffSize);
-            if ((uint8)((checksumTotal / 256) & 0xFF) !=
-                recBuff[m * recBuffSize + 5])
-            {
-                RCLCPP_ERROR(
-                    get_logger(),
-                    "Error : read buffer has bad checksum16(MSB) "
-                    "(StreamData).\n");
-                return;
-            }
-
-            if ((uint8)(checksumTotal & 0xFF) != recBuff[m * recBuffSize + 4])
-            {
-                RCLCPP_ERROR(
-                    get_logger(),
-                    "Error : read buffer has bad checksum16(LBS) "
-                    "(StreamData).\n");
-                return;
-            }
-
-            checksumTotal = extendedChecksum8(recBuff + m * recBuffSize);
-            if (checksumTotal != recBuff[m * recBuffSize])
-            {
-                RCLCPP_ERROR(
-                    get_logger(),
-                    "Error : read buffer has bad checksum8 "
-                    "(StreamData).\n");
-                return;
-            }
-
-            if (recBuff[m * recBuffSize + 1] != (uint8)(0xF9) ||
-                recBuff[m * recBuffSize + 2] != 4 + SamplesPerPacket ||
-                recBuff[m * recBuffSize + 3] != (uint8)(0xC0))
-            {
-                RCLCPP_ERROR(
-                    get_logger(),
-                    "Error : read buffer has wrong command bytes "
-                    "(StreamData).\n");
-                return;
-            }
-
-            if (recBuff[m * recBuffSize + 11] == 59)
-            {
-                if (!autoRecoveryOn)
-                {
-                    printf(
-                        "\nU3 data buffer overflow detected in packet "
-                        "%d.\nNow using auto-recovery and reading buffered "
-                        "samples.\n",
-                        totalPackets);
-                    autoRecoveryOn = 1;
-                }
-            }
-            else if (recBuff[m * recBuffSize + 11] == 60)
-            {
-                printf(
-                    "Auto-recovery report in packet %d: %d scans were "
-                    "dropped.\nAuto-recovery is now off.\n",
-                    totalPackets,
-                    recBuff[m * recBuffSize + 6] +
-                        recBuff[m * recBuffSize + 7] * 256);
-                autoRecoveryOn = 0;
-            }
-            else if (recBuff[m * recBuffSize + 11] != 0)
-            {
-                RCLCPP_ERROR(
-                    get_logger(), "Errorcode # %d from StreamData read.\n",
-                    (unsigned int)recBuff[11]);
-                return;
-            }
-
-#if 0  // JLBC: Allow streaming re-start, etc.
-            if (packetCounter != (int)recBuff[m * recBuffSize + 10])
-            {
-                RCLCPP_ERROR(
-                    get_logger(),
-                    "PacketCounter (%d) does not match with with current "
-                    "packet count (%d)(StreamData).\n",
-                    recBuff[m * recBuffSize + 10], packetCounter);
-                return;
-            }
-
-            backLog = (int)recBuff[m * 48 + 12 + SamplesPerPacket * 2];
-#endif
-
-            for (k = 12; k < (12 + SamplesPerPacket * 2); k += 2)
-            {
-                voltageBytes = (uint16)recBuff[m * recBuffSize + k] +
-                               (uint16)recBuff[m * recBuffSize + k + 1] * 256;
-
-                if (hardwareVersion >= 1.30)
-                    getAinVoltCalibrated_hw130(
-                        &caliInfo_, currChannel, 31, voltageBytes,
-                        &(voltages[scanNumber][currChannel]));
-                else
-                    getAinVoltCalibrated(
-                        &caliInfo_, dac1Enabled_, 31, voltageBytes,
-                        &(voltages[scanNumber][currChannel]));
-
-                currChannel++;
-                if (currChannel >= NumChannels)
-                {
-                    currChannel = 0;
-                    scanNumber++;
-                }
-            }
-
-#if 0
-            if (packetCounter >= 255)
-                packetCounter = 0;
-            else
-                packetCounter++;
-#endif
-        }
-    }
-
-    RCLCPP_DEBUG(get_logger(), "Number of scans: %d\n", scanNumber);
-    RCLCPP_DEBUG(get_logger(), "Total packets read: %d\n", totalPackets);
-
-#if 0
-    for (k = 0; k < NumChannels; k++)
-        printf("  AI%d: %.4f V\n", k, voltages[scanNumber - 1][k]);
-#endif
-
-    std_msgs::msg::Float32MultiArray msgAdc;
-    msgAdc.data.resize(NumChannels);
+        sim.localID      = static_cast<int>(id);
+        sim.serialNumber = 320000000 + static_cast<uint32_t>(id);
+        simulators_.push_back(std::make_unique<U3Simulator>(sim));
 
-    for (k = 0; k < NumChannels; k++)
-        msgAdc.data[k] = voltages[scanNumber - 1][k];
-
-    adcPub_->publish(msgAdc);
+        RCLCPP_INFO(
+            get_logger(), "Simulated U3 added: local ID %d, serial %u.",
+            sim.localID, sim.serialNumber);
+    }
 }
 
-// Sends a StreamStop low-level command to stop streaming.
-int StreamStop(HANDLE hDevice)
+// Handles the USB events of all devices: each completed stream read is
+// handed to its device's LabjackDevice::onStreamTransfer().
+void LabjackNode::usbEventThread()
 {
-    uint8 sendBuff[2], recBuff[4];
-    int   sendChars, recChars;
-
-    sendBuff[0] = (uint8)(0xB0);  // CheckSum8
-    sendBuff[1] = (uint8)(0xB0);  // Command byte
+    // Back-off after failed polls (e.g. an unplugged device), so they do not
+    // spin this (possibly real-time) thread:
+    constexpr int maxBackoffMs = 500;
+    int           backoffMs    = 0;
+    uint64_t      numFailures  = 0;
 
-    // Sending command to U3
-    sendChars = LJUSB_Write(hDevice, sendBuff, 2);
-    if (sendChars < 2)
+    while (!usbStop_)
     {
-        if (sendChars == 0)
-            printf("Error : write failed (StreamStop).\n");
-        else
-            printf("Error : did not write all of the buffer (StreamStop).\n");
-        return -1;
-    }
-
-    // Reading response from U3
-    recChars = LJUSB_Read(hDevice, recBuff, 4);
-    if (recChars < 4)
-    {
-        if (recChars == 0)
-            printf("Error : read failed (StreamStop).\n");
-        else
-            printf("Error : did not read all of the buffer (StreamStop).\n");
-        return -1;
-    }
-
-    if (normalChecksum8(recBuff, 4) != recBuff[0])
-    {
-        printf("Error : read buffer has bad checksum8 (StreamStop).\n");
-        return -1;
-    }
+        if (LJUSB_StreamPoll(100 /*ms*/) == 0)
+        {
+            if (numFailures > 0)
+                RCLCPP_INFO(
+                    get_logger(), "LJUSB_StreamPoll recovered after %lu errors",
+                    static_cast<unsigned long>(numFailures));
+            backoffMs   = 0;
+            numFailures = 0;
+            continue;
+        }
 
-    if (recBuff[1] != (uint8)(0xB1) || recBuff[3] != (uint8)(0x00))
-    {
-        printf("Error : read buffer has wrong command bytes (StreamStop).\n");
-        return -1;
-    }
+        const int err = errno;
+        numFailures++;
+        RCLCPP_ERROR_THROTTLE(
+            get_logger(), *get_clock(), 5000,
+            "Error : LJUSB_StreamPoll failed (errno=%d, %lu times in a row)",
+            err, static_cast<unsigned long>(numFailures));
 
-    if (recBuff[2] != 0)
-    {
-#if 0
-        printf(
-            "Errorcode # %d from StreamStop read.\n", (unsigned int)recBuff[2]);
-#endif
-        return -1;
+        backoffMs = std::min(maxBackoffMs, std::max(1, backoffMs * 2));
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoffMs));
     }
-
-    return 0;
 }
+
+RCLCPP_COMPONENTS_REGISTER_NODE(LabjackNode)
@@ -0,0 +1,49 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <rclcpp/rclcpp.hpp>
+#include <thread>
+#include <vector>
+
+#include "labjack_device.h"
+#include "realtime.h"
+#include "u3_simulator.h"
+
+/** The labjack_daq node: streams from one or more U3s (or simulated ones),
+ * each with its own LabjackDevice, and handles all their USB transfers in a
+ * single thread of its own.
+ *
+ * Also registered as the rclcpp_components component "LabjackNode", to run
+ * in a component container along with the nodes that consume its data.
+ */
+class LabjackNode : public rclcpp::Node
+{
+   public:
+    explicit LabjackNode(
+        const rclcpp::NodeOptions& options = rclcpp::NodeOptions());
+    ~LabjackNode() override;
+
+   private:
+    DeviceOptions                               options_;
+    RealtimeOptions                             realtime_;
+    std::vector<std::unique_ptr<U3Simulator>>   simulators_;
+    std::vector<std::unique_ptr<LabjackDevice>> devices_;
+
+    std::thread      usbThread_;
+    std::atomic_bool usbStop_{false};
+
+    void loadStreamSettings();
+    void addSimulatedDevices();
+    void loadRealtimeOptions();
+    void probeWakeupLatency();
+    void usbEventThread();
+    void stopStreaming();
+};
+
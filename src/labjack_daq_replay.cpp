@@ -0,0 +1,245 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+// Replays raw stream captures (raw_capture_dir of labjack_daq_node) on the
+// same topics as the live node, decoded by the same LabjackDevice code, so
+// the published samples, scan indices and dropped scan counts are
+// bit-exact to the live ones:
+//   ros2 run labjack_daq labjack_daq_replay --ros-args
+//     -p files:="['u3_320000001_20230601_120000.ljraw']" -p speed:=0.0
+//
+// speed: 1.0 replays in real time, N at N times real time, and 0 as fast as
+// possible.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <rclcpp/rclcpp.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "labjack_device.h"
+#include "raw_stream_reader.h"
+
+class LabjackReplayNode : public rclcpp::Node
+{
+   public:
+    LabjackReplayNode() : Node("labjack_daq")
+    {
+        std::vector<std::string> files;
+
+        this->declare_parameter<std::vector<std::string>>("files", files);
+        this->get_parameter("files", files);
+        if (files.empty())
+            throw std::runtime_error("files must list one or more captures");
+
+        std::vector<std::string> prefixes;
+        this->declare_parameter<std::vector<std::string>>(
+            "topic_prefixes", prefixes);
+        this->get_parameter("topic_prefixes", prefixes);
+        if (!prefixes.empty() && prefixes.size() != files.size())
+            throw std::runtime_error(
+                "topic_prefixes must be empty or have one entry per file");
+
+        this->declare_parameter<double>("speed", speed_);
+        this->get_parameter("speed", speed_);
+        if (!(speed_ >= 0))
+            throw std::runtime_error("speed must be >= 0");
+
+        this->declare_parameter<double>("start_time", startTime_);
+        this->get_parameter("start_time", startTime_);
+
+        this->declare_parameter<double>("publish_rate", options_.publishRate);
+        this->get_parameter("publish_rate", options_.publishRate);
+        if (!(options_.publishRate > 0))
+            throw std::runtime_error("publish_rate must be > 0");
+
+        this->declare_parameter<bool>(
+            "publish_batches", options_.publishBatches);
+        this->get_parameter("publish_batches", options_.publishBatches);
+
+        this->declare_parameter<bool>("publish_raw", options_.publishRaw);
+        this->get_parameter("publish_raw", options_.publishRaw);
+
+        this->declare_parameter<bool>("publish_fixed", options_.publishFixed);
+        this->get_parameter("publish_fixed", options_.publishFixed);
+
+        this->declare_parameter<double>(
+            "diagnostics_period", options_.diagnosticsPeriod);
+        this->get_parameter("diagnostics_period", options_.diagnosticsPeriod);
+        if (!(options_.diagnosticsPeriod >= 0))
+            throw std::runtime_error("diagnostics_period must be >= 0");
+
+        this->declare_parameter<double>(
+            "timestamp_drift_window", options_.timestampDriftWindow);
+        this->get_parameter(
+            "timestamp_drift_window", options_.timestampDriftWindow);
+        if (!(options_.timestampDriftWindow > 0))
+            throw std::runtime_error("timestamp_drift_window must be > 0");
+
+        options_.decimation = loadDecimationOptions(*this);
+
+        this->declare_parameter<double>(
+            "statistics_window", options_.statisticsWindow);
+        this->get_parameter("statistics_window", options_.statisticsWindow);
+        if (!(options_.statisticsWindow >= 0))
+            throw std::runtime_error("statistics_window must be >= 0");
+
+        options_.trigger = loadTriggerOptions(*this);
+
+        for (std::size_t i = 0; i < files.size(); i++)
+        {
+            const std::string& file = files[i];
+
+            Source src;
+            src.reader = std::make_unique<RawStreamReader>(file);
+            if (src.reader->numChunks() == 0)
+            {
+                RCLCPP_WARN(get_logger(), "Empty capture: %s", file.c_str());
+                continue;
+            }
+
+            // All reads of a capture have the same size:
+            RawStreamReader::Record first;
+            src.reader->next(first);
+            src.reader->rewind();
+            src.packetsPerRead = static_cast<int>(first.header->numPackets);
+
+            // Single file: topics without prefix, as the single device node.
+            // Several: as the node with device_ids set to serial numbers.
+            const RawStreamFileHeader& h = src.reader->header();
+            std::string                prefix;
+            if (!prefixes.empty())
+                prefix = prefixes[i];
+            else if (files.size() > 1)
+                prefix = "u3_" + std::to_string(h.serialNumber) + "/";
+
+            src.device = std::make_unique<LabjackDevice>(
+                *this, h, src.packetsPerRead, prefix, options_);
+            sources_.push_back(std::move(src));
+        }
+    }
+
+    /// Replays all the captures, in time order. Returns when done, or on
+    /// shutdown.
+    void replay();
+
+   private:
+    struct Source
+    {
+        std::unique_ptr<RawStreamReader> reader;
+        std::unique_ptr<LabjackDevice>   device;
+        int                              packetsPerRead = 0;
+        RawStreamReader::Record          pending;  // Next record to replay
+        bool                             hasPending = false;
+        uint64_t                         numReads   = 0;
+    };
+
+    DeviceOptions       options_;
+    double              speed_     = 1.0;
+    double              startTime_ = 0;  // Since the first record [s]
+    std::vector<Source> sources_;
+
+    static void advance(Source& src)
+    {
+        src.hasPending = src.reader->next(src.pending);
+        if (src.hasPending &&
+            static_cast<int>(src.pending.header->numPackets) !=
+                src.packetsPerRead)
+            throw std::runtime_error(
+                "Read size changes within " + src.reader->path());
+    }
+};
+
+int main(int argc, char** argv)
+{
+    rclcpp::init(argc, argv);
+    auto node = std::make_shared<LabjackReplayNode>();
+
+    node->replay();
+
+    rclcpp::shutdown();
+    return 0;
+}
+
+// Feeds the recorded reads to each LabjackDevice, in the same order and
+// with the same host times they had when captured, and publishes them every
+// 1/publish_rate of capture time, as the live timer would have.
+void LabjackReplayNode::replay()
+{
+    if (sources_.empty()) return;
+
+    int64_t t0 = std::numeric_limits<int64_t>::max();
+    for (const auto& src : sources_)
+        t0 = std::min(t0, src.reader->firstTimeNs());
+    t0 += static_cast<int64_t>(startTime_ * 1e9);
+
+    for (auto& src : sources_)
+    {
+        src.reader->seek(t0);
+        advance(src);
+    }
+
+    const int64_t period =
+        std::max<int64_t>(1, std::llround(1e9 / options_.publishRate));
+    const auto wallStart = std::chrono::steady_clock::now();
+
+    int64_t tickEnd = t0 + period;
+    while (rclcpp::ok())
+    {
+        // Next recorded read, of any capture. Skip ahead over gaps:
+        int64_t next = std::numeric_limits<int64_t>::max();
+        for (const auto& src : sources_)
+            if (src.hasPending)
+                next = std::min(next, src.pending.header->hostTimeNs);
+        if (next == std::numeric_limits<int64_t>::max()) break;
+        if (next >= tickEnd)
+            tickEnd += ((next - tickEnd) / period + 1) * period;
+
+        // Publish when the live timer would have, at this speed:
+        if (speed_ > 0)
+            std::this_thread::sleep_until(
+                wallStart + std::chrono::nanoseconds(static_cast<int64_t>(
+                                (tickEnd - t0) / speed_)));
+
+        for (auto& src : sources_)
+        {
+            while (src.hasPending && src.pending.header->hostTimeNs < tickEnd)
+            {
+                const RawStreamRecordHeader& h = *src.pending.header;
+                if (!src.device->replayRead(
+                        h.hostTimeNs, h.readIndex, src.pending.packets))
+                {
+                    // More reads per period than the live ring holds:
+                    src.device->replayPublish();
+                    continue;
+                }
+                src.numReads++;
+                advance(src);
+            }
+            src.device->replayPublish();
+        }
+        tickEnd += period;
+    }
+
+    const double wallTime = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - wallStart)
+                                .count();
+    const double captureTime = (tickEnd - period - t0) * 1e-9;
+
+    for (const auto& src : sources_)
+        RCLCPP_INFO(
+            get_logger(), "%s: %lu reads replayed.",
+            src.reader->path().c_str(),
+            static_cast<unsigned long>(src.numReads));
+    RCLCPP_INFO(
+        get_logger(), "Replayed %.3f s of capture in %.3f s (%.1fx).",
+        captureTime, wallTime, wallTime > 0 ? captureTime / wallTime : 0.0);
+}
@@ -0,0 +1,1552 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "labjack_device.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+
+int ConfigU3_read(HANDLE hDevice, uint32* serialNumber, int* localID);
+int ConfigIO_example(HANDLE hDevice, int* isDAC1Enabled);
+int StreamConfig_example(HANDLE hDevice, const StreamSettings& settings);
+int StreamStart(HANDLE hDevice);
+int StreamStop(HANDLE hDevice);
+
+namespace
+{
+// Host steady clock [ns], as used for all the USB completion times.
+int64_t steadyNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Records in a histogram the time from its construction to its destruction.
+class ScopedTimer
+{
+   public:
+    explicit ScopedTimer(LatencyHistogram& hist)
+        : hist_(hist), startNs_(steadyNowNs())
+    {
+    }
+    ~ScopedTimer() { hist_.record(steadyNowNs() - startNs_); }
+
+    ScopedTimer(const ScopedTimer&)            = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+   private:
+    LatencyHistogram& hist_;
+    int64_t           startNs_;
+};
+
+// Stops any stream and closes an opened U3 on scope exit, unless released:
+// the destructor does not run if the constructor throws.
+class DeviceGuard
+{
+   public:
+    explicit DeviceGuard(HANDLE hDevice) : hDevice_(hDevice) {}
+    ~DeviceGuard()
+    {
+        if (!hDevice_) return;
+        StreamStop(hDevice_);
+        closeUSBConnection(hDevice_);
+    }
+    void release() { hDevice_ = nullptr; }
+
+    DeviceGuard(const DeviceGuard&)            = delete;
+    DeviceGuard& operator=(const DeviceGuard&) = delete;
+
+   private:
+    HANDLE hDevice_;
+};
+
+// Publishes msg by unique_ptr, moving its arrays. Intra-process
+// subscriptions (e.g. composed in the same container) then get the message
+// by pointer hand-off, with no copy nor serialization.
+template <typename MsgT>
+void publishMoved(rclcpp::Publisher<MsgT>& pub, MsgT& msg)
+{
+    pub.publish(std::make_unique<MsgT>(std::move(msg)));
+}
+}  // namespace
+
+LabjackDevice::LabjackDevice(
+    rclcpp::Node& node, int localID, const std::string& topicPrefix,
+    const DeviceOptions& options)
+    : node_(node),
+      logger_(
+          topicPrefix.empty()
+              ? node.get_logger()
+              : node.get_logger().get_child("u3_" + std::to_string(localID))),
+      name_(localID < 0 ? "first found" : std::to_string(localID)),
+      options_(options)
+{
+    const StreamSettings& settings    = options_.stream;
+    const int             numChannels = settings.numChannels();
+
+    // Open the device:
+    // Opening the U3 over USB with this local ID or serial number (or the
+    // first found, if -1)
+    if ((hDevice_ = openUSBConnection(localID)) == nullptr)
+        throw std::runtime_error("Error: openUSBConnection for U3 " + name_);
+    DeviceGuard guard(hDevice_);
+
+    // Getting calibration information from U3
+    if (getCalibrationInfo(hDevice_, &caliInfo_) < 0)
+        throw std::runtime_error("Error: getCalibrationInfo");
+
+    if (ConfigU3_read(hDevice_, &serialNumber_, &localID_) != 0)
+        throw std::runtime_error("Error: ConfigU3_read");
+
+    if (ConfigIO_example(hDevice_, &dac1Enabled_) != 0)
+        throw std::runtime_error("Error: ConfigIO_example");
+
+    // Resolve the calibration of each stream channel once, so decoding
+    // is a single multiply-add per sample:
+    std::vector<AinCalibration> channelCalib(numChannels);
+    for (int i = 0; i < numChannels; i++)
+    {
+        if (!makeAinCalibration(
+                caliInfo_, dac1Enabled_, settings.positiveChannels[i],
+                settings.negativeChannels[i], channelCalib[i]))
+            throw std::runtime_error(
+                "Error: makeAinCalibration for channel pair " +
+                std::to_string(settings.positiveChannels[i]) + "/" +
+                std::to_string(settings.negativeChannels[i]));
+    }
+
+    configureDecoder(
+        channelCalib, StreamDecoder::packetsPerReadFor(
+                          numChannels, SamplesPerPacket, readSizeMultiplier));
+
+    RCLCPP_INFO(
+        logger_,
+        "Streaming %d channels at %.3f Hz, %d scans per USB read "
+        "(%s decoder).",
+        numChannels, settings.scanRate(), decoder_.scansPerRead(),
+        decoder_.isSpecialized() ? "specialized" : "generic");
+
+    // Stopping any previous streams
+    StreamStop(hDevice_);
+
+    if (StreamConfig_example(hDevice_, settings) != 0)
+        throw std::runtime_error("Error: StreamConfig_example");
+
+    if (!options_.rawCaptureDir.empty()) startRawCapture(channelCalib);
+
+    if (StreamStart(hDevice_) != 0)
+        throw std::runtime_error("Error: StreamStart");
+
+    createPublishers(topicPrefix);
+
+    // Each device decodes and publishes independently of the others:
+    callbackGroup_ = node_.create_callback_group(
+        rclcpp::CallbackGroupType::MutuallyExclusive);
+    timerPub_ = node_.create_wall_timer(
+        std::chrono::duration<double>(1.0 / options_.publishRate),
+        std::bind(&LabjackDevice::onReadAndPubTimer, this), callbackGroup_);
+
+    // Fully built: the destructor closes it from now on.
+    guard.release();
+}
+
+LabjackDevice::LabjackDevice(
+    rclcpp::Node& node, const RawStreamFileHeader& capture,
+    int packetsPerRead, const std::string& topicPrefix,
+    const DeviceOptions& options)
+    : node_(node),
+      logger_(
+          topicPrefix.empty() ? node.get_logger()
+                              : node.get_logger().get_child(
+                                    "u3_" + std::to_string(capture.localID))),
+      name_(std::to_string(capture.serialNumber)),
+      options_(options),
+      serialNumber_(capture.serialNumber),
+      localID_(capture.localID),
+      replay_(true),
+      stampOffsetNs_(capture.startSystemTimeNs - capture.startSteadyTimeNs)
+{
+    const int numChannels = static_cast<int>(capture.numChannels);
+
+    if (capture.samplesPerPacket != SamplesPerPacket)
+        throw std::runtime_error(
+            "Error: capture of U3 " + name_ + " uses " +
+            std::to_string(capture.samplesPerPacket) +
+            " samples per packet, only " + std::to_string(SamplesPerPacket) +
+            " are supported");
+    if (numChannels < 1 || numChannels > MaxNumChannels ||
+        packetsPerRead < 1 || packetsPerRead > maxReadSizeMultiplier ||
+        (packetsPerRead * SamplesPerPacket) % numChannels != 0)
+        throw std::runtime_error(
+            "Error: invalid read layout in capture of U3 " + name_);
+
+    // Stream settings as recorded, for scanRate():
+    StreamSettings& settings = options_.stream;
+    settings.positiveChannels.assign(
+        capture.positiveChannels, capture.positiveChannels + numChannels);
+    settings.negativeChannels.assign(
+        capture.negativeChannels, capture.negativeChannels + numChannels);
+    settings.resolution   = capture.scanConfig & 0x03;
+    settings.clock48MHz   = (capture.scanConfig & 0x08) != 0;
+    settings.clockDiv256  = (capture.scanConfig & 0x04) != 0;
+    settings.scanInterval = capture.scanInterval;
+
+    // The very same calibration the live decoder used:
+    std::vector<AinCalibration> channelCalib(numChannels);
+    for (int i = 0; i < numChannels; i++)
+    {
+        channelCalib[i].slope  = capture.calibSlope[i];
+        channelCalib[i].offset = capture.calibOffset[i];
+    }
+    configureDecoder(channelCalib, packetsPerRead);
+
+    RCLCPP_INFO(
+        logger_,
+        "Replaying U3 %s: %d channels at %.3f Hz, %d scans per USB read "
+        "(%s decoder).",
+        name_.c_str(), numChannels, settings.scanRate(),
+        decoder_.scansPerRead(),
+        decoder_.isSpecialized() ? "specialized" : "generic");
+
+    createPublishers(topicPrefix);
+}
+
+LabjackDevice::~LabjackDevice()
+{
+    if (replay_) return;
+
+    stopTransfers();
+
+    RCLCPP_INFO(
+        logger_, "Worst USB read delay (vs. the fastest reads): %.3f ms.",
+        readDelayMaxNs_ * 1e-6);
+
+    StreamStop(hDevice_);
+    closeUSBConnection(hDevice_);
+}
+
+void LabjackDevice::createPublishers(const std::string& topicPrefix)
+{
+    if (options_.publishBatches)
+        adcBatchPub_ = node_.create_publisher<labjack_daq::msg::AdcScanBlock>(
+            topicPrefix + "gpio_adc_batch", 10);
+    else
+        adcPub_ = node_.create_publisher<std_msgs::msg::Float32MultiArray>(
+            topicPrefix + "gpio_adc", 10);
+
+    if (options_.publishRaw)
+        adcRawPub_ = node_.create_publisher<labjack_daq::msg::AdcRawBlock>(
+            topicPrefix + "gpio_adc_raw", 10);
+
+    if (options_.publishFixed)
+    {
+        adcFixedPub_ =
+            node_.create_publisher<labjack_daq::msg::AdcScanBlockFixed>(
+                topicPrefix + "gpio_adc_fixed", 10);
+        if (!adcFixedPub_->can_loan_messages())
+        {
+            RCLCPP_INFO(
+                logger_,
+                "gpio_adc_fixed: the middleware cannot loan messages, they "
+                "will be copied.");
+            fixedMsg_ = std::make_unique<FixedMsg>();
+        }
+    }
+
+    if (options_.decimation.outputRate > 0)
+        adcDecimatedPub_ =
+            node_.create_publisher<labjack_daq::msg::AdcScanBlock>(
+                topicPrefix + "gpio_adc_decimated", 10);
+
+    if (options_.statisticsWindow > 0)
+        adcStatsPub_ =
+            node_.create_publisher<labjack_daq::msg::AdcChannelStatistics>(
+                topicPrefix + "gpio_adc_statistics", 10);
+
+    if (!options_.trigger.channels.empty())
+        adcTriggerPub_ =
+            node_.create_publisher<labjack_daq::msg::AdcTriggerEvent>(
+                topicPrefix + "gpio_adc_trigger", 10);
+
+    // Absolute topic, with one status entry per device:
+    if (options_.diagnosticsPeriod > 0)
+    {
+        diagnosticsPub_ =
+            node_.create_publisher<diagnostic_msgs::msg::DiagnosticArray>(
+                "/diagnostics", 10);
+        diagTimeNs_ = steadyNowNs();
+    }
+}
+
+DecimationOptions loadDecimationOptions(rclcpp::Node& node)
+{
+    DecimationOptions d;
+    std::string       mode = "fir";
+
+    node.declare_parameter<double>("decimation.output_rate", d.outputRate);
+    node.get_parameter("decimation.output_rate", d.outputRate);
+    node.declare_parameter<std::string>("decimation.mode", mode);
+    node.get_parameter("decimation.mode", mode);
+    node.declare_parameter<int>("decimation.taps_per_phase", d.tapsPerPhase);
+    node.get_parameter("decimation.taps_per_phase", d.tapsPerPhase);
+    node.declare_parameter<double>("decimation.cutoff", d.cutoff);
+    node.get_parameter("decimation.cutoff", d.cutoff);
+
+    if (!(d.outputRate >= 0))
+        throw std::runtime_error("decimation.output_rate must be >= 0");
+    if (!parseDecimationMode(mode, d.mode))
+        throw std::runtime_error("decimation.mode must be 'fir' or 'boxcar'");
+    if (d.tapsPerPhase < 1 || d.tapsPerPhase > 256)
+        throw std::runtime_error(
+            "decimation.taps_per_phase must be in the range 1-256");
+    if (!(d.cutoff > 0 && d.cutoff <= 0.5))
+        throw std::runtime_error("decimation.cutoff must be in (0, 0.5]");
+    return d;
+}
+
+TriggerOptions loadTriggerOptions(rclcpp::Node& node)
+{
+    TriggerOptions           t;
+    std::vector<int64_t>     channels;
+    std::vector<std::string> conditions = {"rising"};
+    std::vector<double>      levels     = {1.0};
+    std::vector<double>      hysteresis = {0.01};
+
+    node.declare_parameter<std::vector<int64_t>>("trigger.channels", channels);
+    node.get_parameter("trigger.channels", channels);
+    node.declare_parameter<std::vector<std::string>>(
+        "trigger.conditions", conditions);
+    node.get_parameter("trigger.conditions", conditions);
+    node.declare_parameter<std::vector<double>>("trigger.levels", levels);
+    node.get_parameter("trigger.levels", levels);
+    node.declare_parameter<std::vector<double>>(
+        "trigger.hysteresis", hysteresis);
+    node.get_parameter("trigger.hysteresis", hysteresis);
+    node.declare_parameter<int>("trigger.pre_scans", t.preScans);
+    node.get_parameter("trigger.pre_scans", t.preScans);
+    node.declare_parameter<int>("trigger.post_scans", t.postScans);
+    node.get_parameter("trigger.post_scans", t.postScans);
+
+    if (t.preScans < 0 || t.postScans < 0)
+        throw std::runtime_error(
+            "trigger.pre_scans and trigger.post_scans must be >= 0");
+
+    // One entry per trigger channel, or a single one for all of them:
+    const std::size_t n       = channels.size();
+    const auto        entries = [n](std::size_t size)
+    { return size == n || size == 1; };
+    if (n > 0 && (!entries(conditions.size()) || !entries(levels.size()) ||
+                  !entries(hysteresis.size())))
+        throw std::runtime_error(
+            "trigger.conditions, trigger.levels and trigger.hysteresis must "
+            "have one entry, or one per trigger.channels entry");
+
+    for (std::size_t k = 0; k < n; k++)
+    {
+        TriggerChannel c;
+        c.channel    = static_cast<int>(channels[k]);
+        c.level      = static_cast<float>(levels[levels.size() > 1 ? k : 0]);
+        c.hysteresis = static_cast<float>(
+            hysteresis[hysteresis.size() > 1 ? k : 0]);
+
+        if (channels[k] < 0 || channels[k] >= MaxNumChannels)
+            throw std::runtime_error(
+                "trigger.channels entries are scan list indices, 0-24");
+        if (!parseTriggerCondition(
+                conditions[conditions.size() > 1 ? k : 0], c.condition))
+            throw std::runtime_error(
+                "trigger.conditions must be 'rising', 'falling', 'above' or "
+                "'below'");
+        if (!(c.hysteresis >= 0))
+            throw std::runtime_error("trigger.hysteresis must be >= 0");
+        t.channels.push_back(c);
+    }
+    return t;
+}
+
+void LabjackDevice::configureDecoder(
+    const std::vector<AinCalibration>& channelCalib, int packetsPerRead)
+{
+    const int numChannels = static_cast<int>(channelCalib.size());
+
+    decoder_.configure(channelCalib, SamplesPerPacket, packetsPerRead);
+    chunkSize_ = responseSize * decoder_.packetsPerRead();
+    scanClock_ = ScanClockEstimator(
+        1.0 / options_.stream.scanRate(), options_.timestampDriftWindow);
+    voltages_.resize(numChannels * decoder_.scansPerRead());
+    scanIndices_.resize(decoder_.scansPerRead());
+
+    const DecimationOptions& dec = options_.decimation;
+    if (dec.outputRate > 0)
+    {
+        const double scanRate = options_.stream.scanRate();
+        const int    factor   = std::max(
+            1, static_cast<int>(std::lround(scanRate / dec.outputRate)));
+        decimator_.configure(
+            numChannels, factor, dec.mode, dec.tapsPerPhase, dec.cutoff);
+        // A read has a run of consecutive scans per packet, at most:
+        const std::size_t maxOut = decimator_.maxOutputs(
+            decoder_.scansPerRead(), decoder_.packetsPerRead());
+        decimated_.resize(maxOut * numChannels);
+        decimatedIndices_.resize(maxOut);
+
+        RCLCPP_INFO(
+            logger_,
+            "Decimating by %d to %.3f Hz (%s, %zu taps, %s).", factor,
+            scanRate / factor,
+            dec.mode == DecimationMode::Fir ? "FIR" : "boxcar",
+            decimator_.taps().size(), DecimationFilter::implementation());
+    }
+
+    if (options_.statisticsWindow > 0)
+    {
+        stats_.configure(
+            numChannels,
+            std::max<uint64_t>(
+                1, std::llround(
+                       options_.statisticsWindow *
+                       options_.stream.scanRate())));
+        statsWindows_.reserve(16);
+    }
+
+    if (!options_.trigger.channels.empty())
+    {
+        for (const TriggerChannel& t : options_.trigger.channels)
+            if (t.channel >= numChannels)
+                throw std::runtime_error(
+                    "trigger.channels: no scan list entry " +
+                    std::to_string(t.channel));
+        trigger_.configure(numChannels, options_.trigger);
+    }
+}
+
+// Opens a raw stream capture file for this device in raw_capture_dir, named
+// after its serial number and the start time, with everything needed to
+// decode the stream again: scan list, device and channel calibration.
+void LabjackDevice::startRawCapture(
+    const std::vector<AinCalibration>& channelCalib)
+{
+    const StreamSettings& settings = options_.stream;
+
+    RawStreamFileHeader h = {};
+    h.serialNumber    = serialNumber_;
+    h.localID         = localID_;
+    h.hardwareVersion = caliInfo_.hardwareVersion;
+    h.highVoltage     = caliInfo_.highVoltage;
+    h.dac1Enabled     = dac1Enabled_;
+    std::memcpy(
+        h.ccConstants, caliInfo_.ccConstants, sizeof(h.ccConstants));
+
+    h.numChannels      = settings.numChannels();
+    h.samplesPerPacket = SamplesPerPacket;
+    for (int i = 0; i < settings.numChannels(); i++)
+    {
+        h.positiveChannels[i] = settings.positiveChannels[i];
+        h.negativeChannels[i] = settings.negativeChannels[i];
+        h.calibSlope[i]       = channelCalib[i].slope;
+        h.calibOffset[i]      = channelCalib[i].offset;
+    }
+    h.scanConfig = settings.resolution | (settings.clock48MHz ? 0x08 : 0) |
+                   (settings.clockDiv256 ? 0x04 : 0);
+    h.scanInterval = settings.scanInterval;
+    h.scanRate     = settings.scanRate();
+
+    h.startSystemTimeNs = node_.now().nanoseconds();
+    h.startSteadyTimeNs =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+
+    const std::time_t now = std::time(nullptr);
+    char              date[32];
+    std::strftime(date, sizeof(date), "%Y%m%d_%H%M%S", std::localtime(&now));
+
+    std::filesystem::create_directories(options_.rawCaptureDir);
+    const std::string path = options_.rawCaptureDir + "/u3_" +
+                             std::to_string(h.serialNumber) + "_" + date +
+                             ".ljraw";
+
+    recorder_ = std::make_unique<RawStreamRecorder>(path, h);
+    RCLCPP_INFO(logger_, "Raw stream capture: %s", path.c_str());
+}
+
+// Queues usb_queued_transfers reads on the stream endpoint, so the bus never
+// idles between reads. They are resubmitted as they complete, from
+// LJUSB_StreamPoll(), and never wait for the ROS side: if the ring is full,
+// reads still happen (so the U3 buffer does not overflow) but the data is
+// discarded and accounted for in droppedChunks_. Reads are numbered, so the
+// consumer knows exactly where data was discarded.
+void LabjackDevice::startTransfers()
+{
+    usbStream_ = LJUSB_StreamStart(
+        hDevice_, options_.usbQueuedTransfers, chunkSize_, 1000 /*ms*/,
+        &LabjackDevice::onStreamTransfer, this);
+    if (!usbStream_)
+        throw std::runtime_error(
+            "Error : LJUSB_StreamStart failed (errno=" +
+            std::to_string(errno) + ")");
+}
+
+void LabjackDevice::stopTransfers()
+{
+    LJUSB_StreamStop(usbStream_);
+    usbStream_ = nullptr;
+}
+
+bool LabjackDevice::replayRead(
+    int64_t hostTimeNs, uint64_t readIndex, const uint8_t* packets)
+{
+    StreamChunk* slot = streamRing_.writeSlot();
+    if (!slot) return false;
+
+    slot->readIndex  = readIndex;
+    slot->hostTimeNs = hostTimeNs;
+    std::memcpy(slot->data, packets, chunkSize_);
+    streamRing_.commitWrite();
+    return true;
+}
+
+// Sends a ConfigU3 low-level command that only reads the device
+// configuration, for its serial number and local ID.
+int ConfigU3_read(HANDLE hDevice, uint32* serialNumber, int* localID)
+{
+    uint8  sendBuff[26], recBuff[38];
+    uint16 checksumTotal;
+    int    i;
+
+    sendBuff[1] = (uint8)(0xF8);  // Command byte
+    sendBuff[2] = (uint8)(0x0A);  // Number of data words
+    sendBuff[3] = (uint8)(0x08);  // Extended command number
+
+    // WriteMask and all other bytes to 0: only read the configuration
+    for (i = 6; i < 26; i++) sendBuff[i] = 0;
+    extendedChecksum(sendBuff, 26);
+
+    if (LJUSB_Write(hDevice, sendBuff, 26) < 26)
+    {
+        printf("ConfigU3 error : write failed\n");
+        return -1;
+    }
+
+    if (LJUSB_Read(hDevice, recBuff, 38) < 38)
+    {
+        printf("ConfigU3 error : read failed\n");
+        return -1;
+    }
+
+    checksumTotal = extendedChecksum16(recBuff, 38);
+    if ((uint8)((checksumTotal / 256) & 0xFF) != recBuff[5] ||
+        (uint8)(checksumTotal & 0xFF) != recBuff[4] ||
+        extendedChecksum8(recBuff) != recBuff[0])
+    {
+        printf("ConfigU3 error : read buffer has bad checksum\n");
+        return -1;
+    }
+
+    if (recBuff[1] != (uint8)(0xF8) || recBuff[2] != (uint8)(0x10) ||
+        recBuff[3] != (uint8)(0x08) || recBuff[6] != 0)
+    {
+        printf("ConfigU3 error : read buffer has wrong command bytes\n");
+        return -1;
+    }
+
+    *serialNumber = recBuff[15] + recBuff[16] * 256u + recBuff[17] * 65536u +
+                    recBuff[18] * 16777216u;
+    *localID = recBuff[21];
+    return 0;
+}
+
+// Sends a ConfigIO low-level command that configures the FIOs, DAC, Timers and
+// Counters for this example
+int ConfigIO_example(HANDLE hDevice, int* isDAC1Enabled)
+{
+    printf("ConfigIO_example...\n");
+
+    uint8  sendBuff[12], recBuff[12];
+    uint16 checksumTotal;
+    int    sendChars, recChars;
+
+    sendBuff[1] = (uint8)(0xF8);  // Command byte
+    sendBuff[2] = (uint8)(0x03);  // Number of data words
+    sendBuff[3] = (uint8)(0x0B);  // Extended command number
+
+    sendBuff[6] =
+        13;  // Writemask : Setting writemask for timerCounterConfig (bit 0),
+             //            FIOAnalog (bit 2) and EIOAnalog (bit 3)
+
+    sendBuff[7] = 0;  // Reserved
+    sendBuff[8] =
+        64;  // TimerCounterConfig: Disabling all timers and counters,
+             //                    set TimerCounterPinOffset to 4 (bits 4-7)
+    sendBuff[9] = 0;  // DAC1Enable
+
+    sendBuff[10] = 255;  // FIOAnalog : setting all FIOs as analog inputs
+    sendBuff[11] = 255;  // EIOAnalog : setting all EIOs as analog inputs
+    extendedChecksum(sendBuff, 12);
+
+    // Sending command to U3
+    if ((sendChars = LJUSB_Write(hDevice, sendBuff, 12)) < 12)
+    {
+        if (sendChars == 0)
+            printf("ConfigIO error : write failed\n");
+        else
+            printf("ConfigIO error : did not write all of the buffer\n");
+        return -1;
+    }
+
+    // Reading response from U3
+    if ((recChars = LJUSB_Read(hDevice, recBuff, 12)) < 12)
+    {
+        if (recChars == 0)
+            printf("ConfigIO error : read failed\n");
+        else
+            printf("ConfigIO error : did not read all of the buffer\n");
+        return -1;
+    }
+
+    checksumTotal = extendedChecksum16(recBuff, 12);
+    if ((uint8)((checksumTotal / 256) & 0xFF) != recBuff[5])
+    {
+        printf("ConfigIO error : read buffer has bad checksum16(MSB)\n");
+        return -1;
+    }
+
+    if ((uint8)(checksumTotal & 0xFF) != recBuff[4])
+    {
+        printf("ConfigIO error : read buffer has bad checksum16(LBS)\n");
+        return -1;
+    }
+
+    if (extendedChecksum8(recBuff) != recBuff[0])
+    {
+        printf("ConfigIO error : read buffer has bad checksum8\n");
+        return -1;
+    }
+
+    if (recBuff[1] != (uint8)(0xF8) || recBuff[2] != (uint8)(0x03) ||
+        recBuff[3] != (uint8)(0x0B))
+    {
+        printf("ConfigIO error : read buffer has wrong command bytes\n");
+        return -1;
+    }
+
+    if (recBuff[6] != 0)
+    {
+        printf(
+            "ConfigIO error : read buffer received errorcode %d\n", recBuff[6]);
+        return -1;
+    }
+
+    if (recBuff[8] != 64)
+    {
+        printf(
+            "ConfigIO error : TimerCounterConfig did not get set correctly\n");
+        return -1;
+    }
+
+    if (recBuff[10] != 255 && recBuff[10] != (uint8)(0x0F))
+    {
+        printf("ConfigIO error : FIOAnalog did not set get correctly\n");
+        return -1;
+    }
+
+    if (recBuff[11] != 255)
+    {
+        printf(
+            "ConfigIO error : EIOAnalog did not set get correctly (%d)\n",
+            recBuff[11]);
+        return -1;
+    }
+
+    *isDAC1Enabled = (int)recBuff[9];
+
+    // So the u3.c easy functions (eAIN, eDI...) need not read it back again:
+    setConfigIOShadow(
+        hDevice, recBuff[8], recBuff[9], recBuff[10], recBuff[11]);
+
+    printf("ConfigIO_example... OK\n");
+    return 0;
+}
+
+// Sends a StreamConfig low-level command to configure the stream.
+int StreamConfig_example(HANDLE hDevice, const StreamSettings& settings)
+{
+    uint8  sendBuff[64], recBuff[8];
+    uint16 checksumTotal, scanInterval;
+    int    sendBuffSize, sendChars, recChars, i;
+
+    const int numChannels = settings.numChannels();
+    sendBuffSize          = 12 + numChannels * 2;
+
+    sendBuff[1] = (uint8)(0xF8);  // Command byte
+    sendBuff[2] = 3 + numChannels;  // Number of data words = NumChannels + 3
+    sendBuff[3] = (uint8)(0x11);  // Extended command number
+    sendBuff[6] = numChannels;  // NumChannels
+    sendBuff[7] = SamplesPerPacket;  // SamplesPerPacket
+    sendBuff[8] = 0;  // Reserved
+    sendBuff[9] = settings.resolution;  // ScanConfig:
+                                        // Bit 7: Reserved
+                                        // Bit 6: Reserved
+                                        // Bit 3: Internal stream clock
+                                        //        frequency = b0: 4 MHz,
+                                        //        b1: 48 MHz
+                                        // Bit 2: Divide Clock by 256
+                                        // Bits 0-1: Resolution
+    if (settings.clock48MHz) sendBuff[9] |= 0x08;
+    if (settings.clockDiv256) sendBuff[9] |= 0x04;
+
+    scanInterval = settings.scanInterval;
+    sendBuff[10] = (uint8)(scanInterval & (0x00FF));  // Scan interval (low
+                                                      // byte)
+    sendBuff[11] = (uint8)(scanInterval / 256);  // Scan interval (high byte)
+
+    for (i = 0; i < numChannels; i++)
+    {
+        sendBuff[12 + i * 2] = settings.positiveChannels[i];  // PChannel
+        sendBuff[13 + i * 2] =
+            settings.negativeChannels[i];  // NChannel (31: Single Ended)
+    }
+
+    extendedChecksum(sendBuff, sendBuffSize);
+
+    // Sending command to U3
+    sendChars = LJUSB_Write(hDevice, sendBuff, sendBuffSize);
+    if (sendChars < sendBuffSize)
+    {
+        if (sendChars == 0)
+            printf("Error : write failed (StreamConfig).\n");
+        else
+            printf("Error : did not write all of the buffer (StreamConfig).\n");
+        return -1;
+    }
+
+    for (i = 0; i < 8; i++) recBuff[i] = 0;
+
+    // Reading response from U3
+    recChars = LJUSB_Read(hDevice, recBuff, 8);
+    if (recChars < 8)
+    {
+        if (recChars == 0)
+            printf("Error : read failed (StreamConfig).\n");
+        else
+            printf(
+                "Error : did not read all of the buffer, %d (StreamConfig).\n",
+                recChars);
+
+        for (i = 0; i < 8; i++) printf("%d ", recBuff[i]);
+
+        return -1;
+    }
+
+    checksumTotal = extendedChecksum16(recBuff, 8);
+    if ((uint8)((checksumTotal / 256) & 0xFF) != recBuff[5])
+    {
+        printf("Error : read buffer has bad checksum16(MSB) (StreamConfig).\n");
+        return -1;
+    }
+
+    if ((uint8)(checksumTotal & 0xFF) != recBuff[4])
+    {
+        printf("Error : read buffer has bad checksum16(LBS) (StreamConfig).\n");
+        return -1;
+    }
+
+    if (extendedChecksum8(recBuff) != recBuff[0])
+    {
+        printf("Error : read buffer has bad checksum8 (StreamConfig).\n");
+        return -1;
+    }
+
+    if (recBuff[1] != (uint8)(0xF8) || recBuff[2] != (uint8)(0x01) ||
+        recBuff[3] != (uint8)(0x11) || recBuff[7] != (uint8)(0x00))
+    {
+        printf("Error : read buffer has wrong command bytes (StreamConfig).\n");
+        return -1;
+    }
+
+    if (recBuff[6] != 0)
+    {
+        printf(
+            "Errorcode # %d from StreamConfig read.\n",
+            (unsigned int)recBuff[6]);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Sends a StreamStart low-level command to start streaming.
+int StreamStart(HANDLE hDevice)
+{
+    uint8 sendBuff[2], recBuff[4];
+    int   sendChars, recChars;
+
+    sendBuff[0] = (uint8)(0xA8);  // CheckSum8
+    sendBuff[1] = (uint8)(0xA8);  // command byte
+
+    // Sending command to U3
+    sendChars = LJUSB_Write(hDevice, sendBuff, 2);
+    if (sendChars < 2)
+    {
+        if (sendChars == 0)
+            printf("Error : write failed.\n");
+        else
+            printf("Error : did not write all of the buffer.\n");
+        return -1;
+    }
+
+    // Reading response from U3
+    recChars = LJUSB_Read(hDevice, recBuff, 4);
+    if (recChars < 4)
+    {
+        if (recChars == 0)
+            printf("Error : read failed.\n");
+        else
+            printf("Error : did not read all of the buffer.\n");
+        return -1;
+    }
+
+    if (normalChecksum8(recBuff, 4) != recBuff[0])
+    {
+        printf("Error : read buffer has bad checksum8 (StreamStart).\n");
+        return -1;
+    }
+
+    if (recBuff[1] != (uint8)(0xA9) || recBuff[3] != (uint8)(0x00))
+    {
+        printf("Error : read buffer has wrong command bytes \n");
+        return -1;
+    }
+
+    if (recBuff[2] != 0)
+    {
+        printf(
+            "Errorcode # %d from StreamStart read.\n",
+            (unsigned int)recBuff[2]);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Called from LJUSB_StreamPoll() in the USB event thread for each
+// completed StreamData transfer.
+void LabjackDevice::onStreamTransfer(
+    void* userData, const BYTE* pBuff, unsigned long count, int status)
+{
+    const int64_t hostTimeNs = steadyNowNs();
+
+    auto&     me        = *static_cast<LabjackDevice*>(userData);
+    const int chunkSize = me.chunkSize_;
+
+    // No logging from here: counted, and reported by onReadAndPubTimer().
+    if (status != 0 || count < static_cast<unsigned long>(chunkSize))
+    {
+        if (count == 0)
+        {
+            me.lastTransferStatus_.store(status, std::memory_order_relaxed);
+            me.failedTransfers_++;
+        }
+        else
+        {
+            me.lastShortCount_.store(
+                static_cast<uint32_t>(count), std::memory_order_relaxed);
+            me.shortTransfers_++;
+        }
+        return;
+    }
+
+    const uint64_t readIndex = me.readCount_++;
+
+    StreamChunk* slot = me.streamRing_.writeSlot();
+    if (!slot)
+    {
+        me.droppedChunks_++;
+        return;
+    }
+
+    slot->readIndex  = readIndex;
+    slot->hostTimeNs = hostTimeNs;
+    std::memcpy(slot->data, pBuff, chunkSize);
+    me.streamRing_.commitWrite();
+
+    me.recordPhase(HotPathPhase::UsbCallback, steadyNowNs() - hostTimeNs);
+}
+
+// Validates all StreamData responses in one chunk read from the stream
+// endpoint, then decodes them at once. All voltages are stored in the planar
+// voltages_ array, and their stream-wide indices in scanIndices_.
+//
+// Lost scans are accounted for from (1) reads discarded by
+// onStreamTransfer(), (2) gaps in the StreamData PacketCounter, which also
+// cover corrupted reads, and (3) the device auto-recovery reports, so scan
+// indices (and the timestamps derived from them) stay exact.
+// Returns the number of decoded scans, or -1 on error.
+int LabjackDevice::decodeStreamChunk(const StreamChunk& chunk)
+{
+    const uint8* recBuff     = chunk.data;
+    const int    recBuffSize = responseSize;
+    const int    numChannels = decoder_.numChannels();
+    int          m;
+
+    // (Replayed reads have their recorded host times)
+    const int64_t checkStartNs = steadyNowNs();
+    if (!replay_)
+        recordPhase(HotPathPhase::RingWait, checkStartNs - chunk.hostTimeNs);
+
+    // Whole reads discarded by onStreamTransfer() before this one:
+    if (const uint64_t skipped = chunk.readIndex - nextReadIndex_; skipped)
+    {
+        nextScanIndex_ += skipped * decoder_.scansPerRead();
+        droppedScans_ += skipped * decoder_.scansPerRead();
+        droppedScansTotal_ += skipped * decoder_.scansPerRead();
+        nextPacketCounter_ += skipped * decoder_.packetsPerRead();
+    }
+    nextReadIndex_ = chunk.readIndex + 1;
+
+    // Scans lost before each packet, cumulative:
+    uint32_t droppedBefore[maxReadSizeMultiplier];
+    uint32_t scansDroppedTotal = 0;
+
+    // Only committed if the whole chunk is valid, so the packets of a
+    // corrupted chunk show up as a PacketCounter gap in the next one:
+    uint8 nextPacketCounter = nextPacketCounter_;
+    bool  synced            = packetCounterSynced_;
+
+    // Checking for errors in each StreamData response
+    for (m = 0; m < decoder_.packetsPerRead(); m++)
+    {
+        totalPackets_++;
+
+        switch (checkStreamPacket(recBuff + m * recBuffSize, SamplesPerPacket))
+        {
+            case StreamPacketStatus::Ok: break;
+            case StreamPacketStatus::BadChecksum16Msb:
+                RCLCPP_ERROR(
+                    logger_,
+                    "Error : read buffer has bad checksum16(MSB) "
+                    "(StreamData).");
+                return -1;
+            case StreamPacketStatus::BadChecksum16Lsb:
+                RCLCPP_ERROR(
+                    logger_,
+                    "Error : read buffer has bad checksum16(LBS) "
+                    "(StreamData).");
+                return -1;
+            case StreamPacketStatus::BadChecksum8:
+                RCLCPP_ERROR(
+                    logger_,
+                    "Error : read buffer has bad checksum8 "
+                    "(StreamData).");
+                return -1;
+            case StreamPacketStatus::BadCommandBytes:
+                RCLCPP_ERROR(
+                    logger_,
+                    "Error : read buffer has wrong command bytes "
+                    "(StreamData).");
+                return -1;
+        }
+
+        // PacketCounter: packets lost on the way (e.g. corrupted reads)
+        const uint8 packetCounter = recBuff[m * recBuffSize + 10];
+        if (synced && packetCounter != nextPacketCounter)
+        {
+            const int lostPackets =
+                static_cast<uint8>(packetCounter - nextPacketCounter);
+            const int lostSamples = lostPackets * SamplesPerPacket;
+            if (lostSamples % numChannels != 0)
+                RCLCPP_ERROR(
+                    logger_,
+                    "Lost %d StreamData packets, not a whole number of "
+                    "scans: channels are now misaligned.",
+                    lostPackets);
+            scansDroppedTotal += lostSamples / numChannels;
+        }
+        nextPacketCounter = packetCounter + 1;
+        synced            = true;
+
+        if (recBuff[m * recBuffSize + 11] == 59)
+        {
+            if (!autoRecoveryOn_)
+            {
+                RCLCPP_WARN(
+                    logger_,
+                    "U3 %u data buffer overflow detected in packet %d. "
+                    "Now using auto-recovery and reading buffered samples.",
+                    serialNumber_, totalPackets_);
+                autoRecoveryOn_ = 1;
+            }
+        }
+        else if (recBuff[m * recBuffSize + 11] == 60)
+        {
+            const int scansDropped = recBuff[m * recBuffSize + 6] +
+                                     recBuff[m * recBuffSize + 7] * 256;
+            RCLCPP_WARN(
+                logger_,
+                "U3 %u auto-recovery report in packet %d: %d scans were "
+                "dropped. Auto-recovery is now off.",
+                serialNumber_, totalPackets_, scansDropped);
+            autoRecoveryOn_ = 0;
+
+            scansDroppedTotal += scansDropped;
+        }
+        else if (recBuff[m * recBuffSize + 11] != 0)
+        {
+            RCLCPP_ERROR(
+                logger_, "Errorcode # %d from StreamData read.",
+                (unsigned int)recBuff[m * recBuffSize + 11]);
+            return -1;
+        }
+
+        droppedBefore[m] = scansDroppedTotal;
+    }
+
+    nextPacketCounter_   = nextPacketCounter;
+    packetCounterSynced_ = true;
+    recordPhase(HotPathPhase::Checksum, steadyNowNs() - checkStartNs);
+
+    // The capture holds exactly the reads decoded below, so replaying it
+    // reproduces this device's output:
+    if (recorder_)
+        recorder_->append(
+            chunk.hostTimeNs, chunk.readIndex, recBuff,
+            decoder_.packetsPerRead());
+
+    // Getting data out of all the StreamData responses
+    const int64_t decodeStartNs = steadyNowNs();
+    const int     scanNumber    = static_cast<int>(
+        decoder_.decode(recBuff, voltages_.data(), decoder_.scansPerRead()));
+    recordPhase(HotPathPhase::Decode, steadyNowNs() - decodeStartNs);
+    scansDecodedTotal_ += scanNumber;
+
+    for (int i = 0; i < scanNumber; i++)
+    {
+        // The packet holding the first sample of this scan:
+        const int packet = (i * numChannels) / SamplesPerPacket;
+        scanIndices_[i]  = nextScanIndex_ + i + droppedBefore[packet];
+    }
+    nextScanIndex_ += scanNumber + scansDroppedTotal;
+    droppedScans_ += scansDroppedTotal;
+    droppedScansTotal_ += scansDroppedTotal;
+
+    // The read completed right after its last scan was sampled:
+    if (scanNumber > 0)
+    {
+        const uint64_t last = scanIndices_[scanNumber - 1];
+        scanClock_.addObservation(last, chunk.hostTimeNs);
+
+        // Delay of this read vs. the fastest ones (USB transport, and
+        // waking up the USB event thread):
+        const int64_t delay = chunk.hostTimeNs - scanClock_.scanTimeNs(last);
+        readDelayMaxNs_     = std::max(readDelayMaxNs_, delay);
+        recordPhase(HotPathPhase::UsbReadDelay, delay);
+    }
+
+    return scanNumber;
+}
+
+// Consumes all the StreamData reads queued by onStreamTransfer() (or
+// replayRead()) since the last call, and publishes either the latest scan
+// (gpio_adc), or all of them (gpio_adc_batch) if publish_batches is set.
+void LabjackDevice::onReadAndPubTimer()
+{
+    const int numChannels  = decoder_.numChannels();
+    const int scansPerRead = decoder_.scansPerRead();
+
+    // (The lost scans are accounted for in decodeStreamChunk())
+    if (const uint32_t dropped = droppedChunks_.exchange(0); dropped != 0)
+    {
+        RCLCPP_WARN(
+            logger_,
+            "Stream ring buffer full: %u StreamData reads were discarded. "
+            "Consider increasing publish_rate.",
+            dropped);
+        droppedReadsTotal_ += dropped;
+    }
+    if (const uint32_t failed = failedTransfers_.exchange(0); failed != 0)
+    {
+        RCLCPP_ERROR(
+            logger_,
+            "Error : %u reads failed (StreamData), last errno=%d.", failed,
+            lastTransferStatus_.load(std::memory_order_relaxed));
+        failedReadsTotal_ += failed;
+    }
+    if (const uint32_t shortReads = shortTransfers_.exchange(0);
+        shortReads != 0)
+    {
+        RCLCPP_ERROR(
+            logger_,
+            "Error : %u reads did not read all of the buffer, expected %d "
+            "bytes but last received %u (StreamData).",
+            shortReads, chunkSize_,
+            lastShortCount_.load(std::memory_order_relaxed));
+        failedReadsTotal_ += shortReads;
+    }
+    backlogMax_ = std::max(backlogMax_, streamRing_.size());
+
+    if (recorder_ && recorder_->droppedRecords() != recorderDropped_)
+    {
+        RCLCPP_WARN(
+            logger_, "Raw capture%s: %lu StreamData reads were not recorded.",
+            recorder_->failed() ? " failed (disk full?)" : " queue full",
+            static_cast<unsigned long>(
+                recorder_->droppedRecords() - recorderDropped_));
+        recorderDropped_ = recorder_->droppedRecords();
+    }
+
+    labjack_daq::msg::AdcScanBlock msgBatch;
+    if (options_.publishBatches)
+    {
+        const size_t maxScans = streamRing_.size() * scansPerRead;
+        msgBatch.scan_index.reserve(maxScans);
+        msgBatch.data.reserve(maxScans * numChannels);
+    }
+
+    labjack_daq::msg::AdcRawBlock msgRaw;
+    if (adcRawPub_)
+    {
+        const size_t maxScans = streamRing_.size() * scansPerRead;
+        msgRaw.counts.reserve(maxScans * numChannels);
+    }
+
+    labjack_daq::msg::AdcScanBlock msgDecimated;
+    if (adcDecimatedPub_)
+    {
+        const size_t maxScans =
+            streamRing_.size() * decimatedIndices_.size();
+        msgDecimated.scan_index.reserve(maxScans);
+        msgDecimated.data.reserve(maxScans * numChannels);
+    }
+
+    int     scanNumber = 0;
+    int     numChunks  = 0;
+    int64_t chunkTime  = 0;  // USB completion of the newest decoded chunk
+    while (const StreamChunk* chunk = streamRing_.front())
+    {
+        scanNumber = decodeStreamChunk(*chunk);
+        if (scanNumber >= 0) chunkTime = chunk->hostTimeNs;
+        streamRing_.pop();
+        numChunks++;
+
+        // Corrupted chunk: its scans are accounted for as lost later on.
+        if (scanNumber < 0)
+        {
+            corruptedReadsTotal_++;
+            continue;
+        }
+
+        if (adcRawPub_)
+        {
+            for (int i = 0; i < scanNumber; i++)
+            {
+                if (msgRaw.run_start.empty() ||
+                    scanIndices_[i] != msgRaw.run_start.back() +
+                                           msgRaw.run_length.back())
+                {
+                    msgRaw.run_start.push_back(scanIndices_[i]);
+                    msgRaw.run_length.push_back(0);
+                }
+                msgRaw.run_length.back()++;
+            }
+            const uint16_t* counts = decoder_.rawScans();
+            msgRaw.counts.insert(
+                msgRaw.counts.end(), counts,
+                counts + scanNumber * numChannels);
+        }
+
+        if (adcFixedPub_) writeFixedBlocks(scanNumber);
+
+        if (adcDecimatedPub_)
+        {
+            const size_t n = decimator_.process(
+                voltages_.data(), scansPerRead, scanIndices_.data(),
+                scanNumber, decimated_.data(), decimatedIndices_.data(),
+                decimatedIndices_.size());
+            msgDecimated.scan_index.insert(
+                msgDecimated.scan_index.end(), decimatedIndices_.begin(),
+                decimatedIndices_.begin() + n);
+            msgDecimated.data.insert(
+                msgDecimated.data.end(), decimated_.begin(),
+                decimated_.begin() + n * numChannels);
+        }
+
+        if (adcStatsPub_)
+            stats_.add(
+                voltages_.data(), scansPerRead, scanIndices_.data(),
+                scanNumber, statsWindows_);
+
+        if (adcTriggerPub_)
+            trigger_.process(
+                voltages_.data(), scansPerRead, scanIndices_.data(),
+                scanNumber, triggerEvents_);
+
+        if (options_.publishBatches)
+        {
+            for (int i = 0; i < scanNumber; i++)
+            {
+                msgBatch.scan_index.push_back(scanIndices_[i]);
+                for (int k = 0; k < numChannels; k++)
+                    msgBatch.data.push_back(voltages_[k * scansPerRead + i]);
+            }
+        }
+    }
+
+    RCLCPP_DEBUG(logger_, "Chunks consumed: %d", numChunks);
+    RCLCPP_DEBUG(logger_, "Number of scans: %d", scanNumber);
+    RCLCPP_DEBUG(logger_, "Total packets read: %d", totalPackets_);
+    RCLCPP_DEBUG(
+        logger_, "Device clock drift: %.3f ppm", scanClock_.driftPpm());
+
+    if (diagnosticsPub_)
+    {
+        const int64_t now = steadyNowNs();
+        if (now - diagTimeNs_ >= options_.diagnosticsPeriod * 1e9)
+            publishDiagnostics(now);
+    }
+
+    // Converting and publishing the reads of this tick:
+    std::optional<ScopedTimer> publishTimer;
+    if (numChunks > 0)
+        publishTimer.emplace(
+            phaseTimes_[static_cast<std::size_t>(HotPathPhase::Publish)]);
+
+    for (const ChannelStatsWindow& w : statsWindows_)
+    {
+        const uint64_t firstScan = w.windowIndex * stats_.windowScans();
+        const double   window =
+            stats_.windowScans() * scanClock_.scanPeriod();
+
+        labjack_daq::msg::AdcChannelStatistics msgStats;
+        msgStats.header.stamp =
+            steadyToRosTime(scanClock_.scanTimeNs(firstScan));
+        msgStats.num_channels     = numChannels;
+        msgStats.first_scan_index = firstScan;
+        msgStats.window_scans     = stats_.windowScans();
+        msgStats.num_scans        = w.numScans;
+        msgStats.window           = window;
+        msgStats.min              = w.min;
+        msgStats.max              = w.max;
+        msgStats.mean             = w.mean;
+        msgStats.rms              = w.rms;
+        msgStats.std_dev          = w.stdDev;
+
+        publishMoved(*adcStatsPub_, msgStats);
+    }
+    statsWindows_.clear();
+
+    for (TriggerEvent& e : triggerEvents_)
+    {
+        const TriggerChannel& t = options_.trigger.channels[e.source];
+
+        labjack_daq::msg::AdcTriggerEvent msgTrigger;
+        msgTrigger.header.stamp =
+            steadyToRosTime(scanClock_.scanTimeNs(e.triggerIndex));
+        msgTrigger.num_channels       = numChannels;
+        msgTrigger.trigger_channel    = t.channel;
+        msgTrigger.condition          = triggerConditionName(t.condition);
+        msgTrigger.level              = t.level;
+        msgTrigger.trigger_scan_index = e.triggerIndex;
+        msgTrigger.pre_trigger_scans  = e.preScans;
+        msgTrigger.scan_index         = std::move(e.scanIndices);
+        msgTrigger.scan_period        = scanClock_.scanPeriod();
+        msgTrigger.data               = std::move(e.data);
+
+        publishMoved(*adcTriggerPub_, msgTrigger);
+    }
+    triggerEvents_.clear();
+
+    if (fixedOut_) publishFixedBlock();
+
+    if (!msgRaw.run_start.empty())
+    {
+        msgRaw.header.stamp = steadyToRosTime(
+            scanClock_.scanTimeNs(msgRaw.run_start.front()));
+        msgRaw.serial_number = serialNumber_;
+        msgRaw.sequence      = rawSequence_++;
+        msgRaw.num_channels  = numChannels;
+        msgRaw.dropped_scans =
+            static_cast<uint32_t>(droppedScansTotal_ - rawDroppedTotal_);
+        msgRaw.scan_period = scanClock_.scanPeriod();
+        rawDroppedTotal_   = droppedScansTotal_;
+
+        for (const AinCalibration& cal : decoder_.calibration())
+        {
+            msgRaw.slope.push_back(cal.slope);
+            msgRaw.offset.push_back(cal.offset);
+        }
+
+        publishMoved(*adcRawPub_, msgRaw);
+    }
+
+    if (!msgDecimated.scan_index.empty())
+    {
+        // Each output is delayed by the filter, so the time at which it
+        // was (virtually) sampled is earlier than that of its scan index:
+        const double period = scanClock_.scanPeriod();
+        const int64_t firstScanTime =
+            scanClock_.scanTimeNs(msgDecimated.scan_index.front()) -
+            std::llround(decimator_.groupDelay() * period * 1e9);
+
+        msgDecimated.header.stamp  = steadyToRosTime(firstScanTime);
+        msgDecimated.scan_period   = period;
+        msgDecimated.num_channels  = numChannels;
+        msgDecimated.dropped_scans = static_cast<uint32_t>(
+            droppedScansTotal_ - decimatedDroppedTotal_);
+        decimatedDroppedTotal_ = droppedScansTotal_;
+
+        publishMoved(*adcDecimatedPub_, msgDecimated);
+    }
+
+    if (options_.publishBatches)
+    {
+        if (msgBatch.scan_index.empty()) return;
+
+        msgBatch.header.stamp = steadyToRosTime(
+            scanClock_.scanTimeNs(msgBatch.scan_index.front()));
+        msgBatch.scan_period   = scanClock_.scanPeriod();
+        msgBatch.num_channels  = numChannels;
+        msgBatch.dropped_scans = droppedScans_;
+        droppedScans_          = 0;
+
+        publishMoved(*adcBatchPub_, msgBatch);
+        if (publishHook_) publishHook_(chunkTime);
+        return;
+    }
+
+    // Nothing new, or the last chunk was corrupted:
+    if (scanNumber <= 0) return;
+
+    std_msgs::msg::Float32MultiArray msgAdc;
+    msgAdc.data.resize(numChannels);
+
+    for (int k = 0; k < numChannels; k++)
+        msgAdc.data[k] = voltages_[k * scansPerRead + scanNumber - 1];
+
+    publishMoved(*adcPub_, msgAdc);
+    if (publishHook_) publishHook_(chunkTime);
+}
+
+// Appends the scans of the last decoded chunk to gpio_adc_fixed blocks,
+// written in place: in middleware loaned memory, if it can, so publishing
+// them involves no allocation nor copy.
+void LabjackDevice::writeFixedBlocks(int scanNumber)
+{
+    const int      numChannels  = decoder_.numChannels();
+    const int      scansPerRead = decoder_.scansPerRead();
+    const uint32_t maxScans     = FixedMsg::MAX_SAMPLES / numChannels;
+
+    for (int i = 0; i < scanNumber; i++)
+    {
+        if (fixedOut_ &&
+            (fixedOut_->num_scans == maxScans ||
+             scanIndices_[i] !=
+                 fixedOut_->first_scan_index + fixedOut_->num_scans))
+            publishFixedBlock();
+
+        if (!fixedOut_)
+        {
+            if (fixedMsg_)
+                fixedOut_ = fixedMsg_.get();
+            else
+            {
+                fixedLoan_.emplace(adcFixedPub_->borrow_loaned_message());
+                fixedOut_ = &fixedLoan_->get();
+            }
+            fixedOut_->first_scan_index = scanIndices_[i];
+            fixedOut_->num_scans        = 0;
+        }
+
+        float* row =
+            fixedOut_->data.data() + fixedOut_->num_scans++ * numChannels;
+        for (int k = 0; k < numChannels; k++)
+            row[k] = voltages_[k * scansPerRead + i];
+    }
+}
+
+void LabjackDevice::publishFixedBlock()
+{
+    FixedMsg& msg = *fixedOut_;
+
+    msg.stamp = steadyToRosTime(scanClock_.scanTimeNs(msg.first_scan_index));
+    msg.num_channels  = decoder_.numChannels();
+    msg.scan_period   = scanClock_.scanPeriod();
+    msg.dropped_scans =
+        static_cast<uint32_t>(droppedScansTotal_ - fixedDroppedTotal_);
+    fixedDroppedTotal_ = droppedScansTotal_;
+
+    if (fixedLoan_)
+    {
+        adcFixedPub_->publish(std::move(*fixedLoan_));
+        fixedLoan_.reset();
+    }
+    else
+        adcFixedPub_->publish(msg);
+    fixedOut_ = nullptr;
+}
+
+// Publishes the hot path latency percentiles, throughput, backlog and lost
+// data counters of the interval since the previous call on /diagnostics.
+void LabjackDevice::publishDiagnostics(int64_t nowNs)
+{
+    using diagnostic_msgs::msg::DiagnosticStatus;
+
+    static const char* const phaseNames[numHotPathPhases] = {
+        "usb_callback", "usb_read_delay", "ring_wait",
+        "checksum",     "decode",         "publish"};
+    static const double      quantiles[]     = {0.5, 0.9, 0.99, 0.999};
+    static const char* const quantileNames[] = {"p50", "p90", "p99", "p999"};
+    constexpr std::size_t    numQuantiles    = std::size(quantiles);
+
+    const double   interval = (nowNs - diagTimeNs_) * 1e-9;
+    const uint64_t scans    = scansDecodedTotal_ - diagScansDecoded_;
+    const uint64_t dropped  = droppedScansTotal_ - diagDroppedScans_;
+
+    DiagnosticStatus status;
+    status.name        = "labjack_daq: U3 " + std::to_string(serialNumber_);
+    status.hardware_id = std::to_string(serialNumber_);
+    if (dropped > 0)
+    {
+        status.level   = DiagnosticStatus::WARN;
+        status.message = std::to_string(dropped) + " scans lost";
+    }
+    else if (backlogMax_ > streamRingCapacity / 2)
+    {
+        status.level   = DiagnosticStatus::WARN;
+        status.message = "Stream ring buffer over half full";
+    }
+    else
+    {
+        status.level   = DiagnosticStatus::OK;
+        status.message = "Streaming";
+    }
+
+    const auto add = [&status](const std::string& key, double value)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6g", value);
+        diagnostic_msgs::msg::KeyValue kv;
+        kv.key   = key;
+        kv.value = buf;
+        status.values.push_back(std::move(kv));
+    };
+
+    add("scan_rate", options_.stream.scanRate());
+    add("scans_per_s", scans / interval);
+    add("samples_per_s", scans * decoder_.numChannels() / interval);
+    add("backlog_max_reads", backlogMax_);
+    add("backlog_capacity_reads", streamRingCapacity);
+    add("dropped_scans", dropped);
+    add("dropped_scans_total", droppedScansTotal_);
+    add("discarded_reads_total", droppedReadsTotal_);
+    add("corrupted_reads_total", corruptedReadsTotal_);
+    add("failed_reads_total", failedReadsTotal_);
+    if (recorder_)
+        add("raw_capture_dropped_reads_total", recorder_->droppedRecords());
+    add("clock_drift_ppm", scanClock_.driftPpm());
+
+    for (std::size_t p = 0; p < numHotPathPhases; p++)
+    {
+        LatencyHistogram::Snapshot snapshot;
+        phaseTimes_[p].read(snapshot);
+
+        double         values[numQuantiles];
+        const uint64_t count = LatencyHistogram::quantiles(
+            phaseSnapshots_[p], snapshot, quantiles, numQuantiles, values);
+        phaseSnapshots_[p] = snapshot;
+
+        const std::string prefix = phaseNames[p];
+        add(prefix + "_count", count);
+        for (std::size_t k = 0; k < numQuantiles; k++)
+            add(prefix + "_" + quantileNames[k] + "_us", values[k] * 1e-3);
+        add(prefix + "_max_us", phaseTimes_[p].takeMax() * 1e-3);
+    }
+
+    diagnostic_msgs::msg::DiagnosticArray msg;
+    msg.header.stamp = node_.now();
+    msg.status.push_back(std::move(status));
+    publishMoved(*diagnosticsPub_, msg);
+
+    diagTimeNs_       = nowNs;
+    diagScansDecoded_ = scansDecodedTotal_;
+    diagDroppedScans_ = droppedScansTotal_;
+    backlogMax_       = 0;
+}
+
+// Host steady clock -> ROS clock. When replaying, as it was at capture time.
+rclcpp::Time LabjackDevice::steadyToRosTime(int64_t steadyTimeNs)
+{
+    if (replay_) return rclcpp::Time(steadyTimeNs + stampOffsetNs_);
+
+    const rclcpp::Time rosNow    = node_.now();
+    const int64_t      steadyNow = steadyNowNs();
+
+    return rosNow -
+           rclcpp::Duration::from_nanoseconds(steadyNow - steadyTimeNs);
+}
+
+// Sends a StreamStop low-level command to stop streaming.
+int StreamStop(HANDLE hDevice)
+{
+    uint8 sendBuff[2], recBuff[4];
+    int   sendChars, recChars;
+
+    sendBuff[0] = (uint8)(0xB0);  // CheckSum8
+    sendBuff[1] = (uint8)(0xB0);  // Command byte
+
+    // Sending command to U3
+    sendChars = LJUSB_Write(hDevice, sendBuff, 2);
+    if (sendChars < 2)
+    {
+        if (sendChars == 0)
+            printf("Error : write failed (StreamStop).\n");
+        else
+            printf("Error : did not write all of the buffer (StreamStop).\n");
+        return -1;
+    }
+
+    // Reading response from U3
+    recChars = LJUSB_Read(hDevice, recBuff, 4);
+    if (recChars < 4)
+    {
+        if (recChars == 0)
+            printf("Error : read failed (StreamStop).\n");
+        else
+            printf("Error : did not read all of the buffer (StreamStop).\n");
+        return -1;
+    }
+
+    if (normalChecksum8(recBuff, 4) != recBuff[0])
+    {
+        printf("Error : read buffer has bad checksum8 (StreamStop).\n");
+        return -1;
+    }
+
+    if (recBuff[1] != (uint8)(0xB1) || recBuff[3] != (uint8)(0x00))
+    {
+        printf("Error : read buffer has wrong command bytes (StreamStop).\n");
+        return -1;
+    }
+
+    if (recBuff[2] != 0)
+    {
+#if 0
+        printf(
+            "Errorcode # %d from StreamStop read.\n", (unsigned int)recBuff[2]);
+#endif
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
+#include <functional>
+#include <labjack_daq/msg/adc_channel_statistics.hpp>
+#include <labjack_daq/msg/adc_raw_block.hpp>
+#include <labjack_daq/msg/adc_scan_block.hpp>
+#include <labjack_daq/msg/adc_scan_block_fixed.hpp>
+#include <labjack_daq/msg/adc_trigger_event.hpp>
+#include <memory>
+#include <optional>
+#include <rclcpp/rclcpp.hpp>
+#include <std_msgs/msg/float32_multi_array.hpp>
+#include <string>
+#include <vector>
+
+#include "channel_statistics.h"
+#include "decimation_filter.h"
+#include "latency_histogram.h"
+#include "raw_stream_format.h"
+#include "raw_stream_recorder.h"
+#include "scan_clock_estimator.h"
+#include "scan_trigger.h"
+#include "spsc_ring_buffer.h"
+#include "stream_decoder.h"
+#include "u3.h"
+
+// Stream scan list and timing, resolved from the ROS parameters.
+struct StreamSettings
+{
+    std::vector<uint8> positiveChannels;
+    std::vector<uint8> negativeChannels;  // Same length as positiveChannels
+    uint8              resolution   = 1;  // ScanConfig bits 0-1
+    bool               clock48MHz   = false;  // ScanConfig bit 3
+    bool               clockDiv256  = false;  // ScanConfig bit 2
+    uint16             scanInterval = 4000;  // In stream clock ticks
+
+    int numChannels() const
+    {
+        return static_cast<int>(positiveChannels.size());
+    }
+
+    double scanRate() const
+    {
+        return (clock48MHz ? 48e6 : 4e6) / (clockDiv256 ? 256 : 1) /
+               scanInterval;
+    }
+};
+
+// Settings shared by all the devices of a node.
+struct DeviceOptions
+{
+    StreamSettings    stream;
+    double            publishRate          = 50.0;
+    int               usbQueuedTransfers   = 4;  // Reads in flight
+    bool              publishBatches       = false;
+    bool              publishRaw           = false;  // gpio_adc_raw
+    bool              publishFixed         = false;  // gpio_adc_fixed
+    double            timestampDriftWindow = 300.0;  // Drift window [s]
+    std::string       rawCaptureDir;  // Raw stream capture files; empty: none
+    DecimationOptions decimation;  // gpio_adc_decimated output
+    double            statisticsWindow = 0;  // [s], 0: no gpio_adc_statistics
+    TriggerOptions    trigger;  // gpio_adc_trigger events
+    double            diagnosticsPeriod = 1.0;  // [s], 0: no /diagnostics
+};
+
+/// Declares and reads the decimation.* parameters of a node.
+/// Throws std::runtime_error if they are not valid.
+DecimationOptions loadDecimationOptions(rclcpp::Node& node);
+
+/// Declares and reads the trigger.* parameters of a node.
+/// Throws std::runtime_error if they are not valid.
+TriggerOptions loadTriggerOptions(rclcpp::Node& node);
+
+// Maximum number of channels in the stream scan list.
+constexpr int MaxNumChannels = 25;
+
+// Needs to be 25 to read multiple  StreamData responses in one large packet,
+// otherwise can be any value between 1-25 for 1 StreamData response per packet.
+constexpr uint8 SamplesPerPacket = 25;
+
+// Minimum multiplier for the StreamData receive buffer size: number of
+// 64-byte StreamData responses read in one USB transfer. The actual number
+// is rounded up so each read holds whole scans.
+constexpr int readSizeMultiplier = 5;
+
+// Upper bound of the rounded up readSizeMultiplier, for any scan list.
+constexpr int maxReadSizeMultiplier = MaxNumChannels;
+
+// The number of bytes in a StreamData response (differs with
+// SamplesPerPacket)
+constexpr int responseSize = streamDataResponseSize(SamplesPerPacket);
+
+// One raw USB read from the stream endpoint, as queued by the acquisition
+// thread for the ROS side.
+struct StreamChunk
+{
+    uint64_t readIndex;  // Counts all reads, including discarded ones
+    int64_t  hostTimeNs;  // Completion time, host steady clock
+    uint8    data[responseSize * maxReadSizeMultiplier];
+};
+
+// Phases of the acquisition path timed for the diagnostics.
+enum class HotPathPhase
+{
+    UsbCallback,  // USB completion -> read queued in the stream ring
+    UsbReadDelay,  // Read completion delay vs. the fastest reads
+    RingWait,  // Read queued -> its decoding starts
+    Checksum,  // Validation of the StreamData responses of one read
+    Decode,  // Decoding and calibration of one read
+    Publish,  // All the publishing of one timer tick
+    Count
+};
+
+constexpr std::size_t numHotPathPhases =
+    static_cast<std::size_t>(HotPathPhase::Count);
+
+// Number of StreamChunk slots between the acquisition thread and the ROS
+// timer. Must be a power of two. At the default 1 kHz scan rate, each chunk
+// holds 25 ms of data, so this buffers ~1.6 s of backlog.
+constexpr std::size_t streamRingCapacity = 64;
+
+/** One streaming U3: opens and configures the device, queues its USB stream
+ * reads, and decodes and publishes them from its own ROS timer.
+ *
+ * USB transfers complete in the caller of LJUSB_StreamPoll(), which may be
+ * shared by many devices: onStreamTransfer() only copies each read into this
+ * device's ring buffer, so no device can stall the others. Each device's
+ * timer runs in its own callback group, so decoding can also happen in
+ * parallel under a multi-threaded executor.
+ */
+class LabjackDevice
+{
+   public:
+    /** Opens the U3 with the given local ID or serial number (-1: the first
+     * one found), configures and starts its stream, and creates its
+     * publishers with the given topic prefix (e.g. "" or "u3_1/").
+     * Throws std::runtime_error on errors.
+     */
+    LabjackDevice(
+        rclcpp::Node& node, int localID, const std::string& topicPrefix,
+        const DeviceOptions& options);
+
+    /** Replays a raw stream capture instead: no USB device is opened, and
+     * the scan list and channel calibration come from the capture header.
+     * Reads of packetsPerRead StreamData responses are fed with
+     * replayRead(), and decoded and published by replayPublish(), exactly
+     * as the live device does from its timer. options.stream is ignored.
+     */
+    LabjackDevice(
+        rclcpp::Node& node, const RawStreamFileHeader& capture,
+        int packetsPerRead, const std::string& topicPrefix,
+        const DeviceOptions& options);
+
+    ~LabjackDevice();
+
+    LabjackDevice(const LabjackDevice&)            = delete;
+    LabjackDevice& operator=(const LabjackDevice&) = delete;
+
+    /// Queues the USB stream reads. Completed from LJUSB_StreamPoll().
+    void startTransfers();
+
+    /// Cancels the queued USB stream reads. Must not be called while
+    /// another thread is inside LJUSB_StreamPoll().
+    void stopTransfers();
+
+    const std::string& name() const { return name_; }
+
+    /** Queues one recorded read for the next replayPublish(), in place of
+     * a USB transfer.
+     * \return false if the queue is full: call replayPublish() first.
+     */
+    bool replayRead(
+        int64_t hostTimeNs, uint64_t readIndex, const uint8_t* packets);
+
+    /// Decodes and publishes the reads queued by replayRead().
+    void replayPublish() { onReadAndPubTimer(); }
+
+    /** Sets a function called right after each publish, with the USB
+     * completion time (host steady clock, ns) of the newest read in the
+     * message. For latency measurements. Must be set before
+     * startTransfers().
+     */
+    void setPublishHook(std::function<void(int64_t)> hook)
+    {
+        publishHook_ = std::move(hook);
+    }
+
+   private:
+    rclcpp::Node&  node_;
+    rclcpp::Logger logger_;
+    std::string    name_;
+    DeviceOptions  options_;
+
+    rclcpp::CallbackGroup::SharedPtr callbackGroup_;
+    rclcpp::TimerBase::SharedPtr     timerPub_;
+    rclcpp::Publisher<std_msgs::msg::Float32MultiArray>::SharedPtr adcPub_;
+    rclcpp::Publisher<labjack_daq::msg::AdcScanBlock>::SharedPtr adcBatchPub_;
+    rclcpp::Publisher<labjack_daq::msg::AdcRawBlock>::SharedPtr adcRawPub_;
+    rclcpp::Publisher<labjack_daq::msg::AdcScanBlockFixed>::SharedPtr
+        adcFixedPub_;
+    rclcpp::Publisher<labjack_daq::msg::AdcScanBlock>::SharedPtr
+        adcDecimatedPub_;
+    rclcpp::Publisher<labjack_daq::msg::AdcChannelStatistics>::SharedPtr
+        adcStatsPub_;
+    rclcpp::Publisher<labjack_daq::msg::AdcTriggerEvent>::SharedPtr
+        adcTriggerPub_;
+    rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr
+        diagnosticsPub_;
+
+    HANDLE             hDevice_      = nullptr;
+    uint32             serialNumber_ = 0;
+    int                localID_      = 0;  // As configured in the device
+    u3CalibrationInfo  caliInfo_;
+    int                dac1Enabled_;
+    int                chunkSize_ = 0;  // Bytes per USB stream read
+    LJUSB_AsyncStream* usbStream_ = nullptr;
+
+    // Raw capture of the validated reads (null if disabled):
+    std::unique_ptr<RawStreamRecorder> recorder_;
+    uint64_t                           recorderDropped_ = 0;
+
+    // Replaying a capture: header stamps are the recorded ROS time, i.e.
+    // host steady clock + stampOffsetNs_.
+    bool    replay_        = false;
+    int64_t stampOffsetNs_ = 0;
+
+    // USB event thread -> ROS timer queue of raw StreamData reads:
+    SpscRingBuffer<StreamChunk, streamRingCapacity> streamRing_;
+    std::atomic<uint32_t>                           droppedChunks_{0};
+    uint64_t readCount_ = 0;  // Only touched by the USB event thread
+
+    // Failed (nothing read) and short USB reads, reported from the ROS timer
+    // so the USB event thread does not log:
+    std::atomic<uint32_t> failedTransfers_{0};
+    std::atomic<uint32_t> shortTransfers_{0};
+    std::atomic<int>      lastTransferStatus_{0};  // Of the last failed read
+    std::atomic<uint32_t> lastShortCount_{0};  // Bytes of the last short read
+
+    // Stream decoding state (only touched from the ROS timer):
+    StreamDecoder         decoder_;
+    std::vector<float>    voltages_;  // Planar, [channel][scan]
+    std::vector<uint64_t> scanIndices_;  // Stream-wide index of each scan
+    uint64_t              nextScanIndex_  = 0;  // Index of next received scan
+    uint32_t              droppedScans_   = 0;  // Lost since last published
+    uint64_t              droppedScansTotal_ = 0;  // Lost since the start
+    int                   totalPackets_   = 0;  // Total StreamData responses
+    int                   autoRecoveryOn_ = 0;
+    uint64_t              nextReadIndex_  = 0;  // Expected StreamChunk
+    uint8                 nextPacketCounter_   = 0;  // Expected PacketCounter
+    bool                  packetCounterSynced_ = false;
+    ScanClockEstimator    scanClock_;  // Scan index -> host steady clock
+    int64_t               readDelayMaxNs_ = 0;  // Worst USB read delay
+    std::function<void(int64_t)> publishHook_;
+
+    // Decimated output (gpio_adc_decimated), only touched from the ROS timer:
+    DecimationFilter      decimator_;
+    std::vector<float>    decimated_;  // Output of one read, row-major
+    std::vector<uint64_t> decimatedIndices_;
+    uint64_t              decimatedDroppedTotal_ = 0;  // As last published
+
+    // Raw counts output (gpio_adc_raw), only touched from the ROS timer:
+    uint64_t rawSequence_     = 0;  // Messages published
+    uint64_t rawDroppedTotal_ = 0;  // droppedScansTotal_ as last published
+
+    // Hot path timing (recorded from the USB event thread too) and counters,
+    // for /diagnostics. The snapshots and totals are as last published:
+    std::array<LatencyHistogram, numHotPathPhases>          phaseTimes_;
+    std::array<LatencyHistogram::Snapshot, numHotPathPhases> phaseSnapshots_;
+    uint64_t    scansDecodedTotal_   = 0;
+    uint64_t    droppedReadsTotal_   = 0;  // Discarded, stream ring full
+    uint64_t    corruptedReadsTotal_ = 0;
+    uint64_t    failedReadsTotal_    = 0;  // Failed or short USB reads
+    std::size_t backlogMax_          = 0;  // Most reads queued at a tick
+    int64_t     diagTimeNs_          = 0;
+    uint64_t    diagScansDecoded_    = 0;
+    uint64_t    diagDroppedScans_    = 0;
+
+    // Fixed-size output (gpio_adc_fixed), only touched from the ROS timer.
+    // The block being filled is loaned by the middleware if it can, or else
+    // fixedMsg_, allocated once:
+    using FixedMsg = labjack_daq::msg::AdcScanBlockFixed;
+    std::optional<rclcpp::LoanedMessage<FixedMsg>> fixedLoan_;
+    std::unique_ptr<FixedMsg>                      fixedMsg_;
+    FixedMsg* fixedOut_          = nullptr;  // Block being filled, or null
+    uint64_t  fixedDroppedTotal_ = 0;  // droppedScansTotal_ as last published
+
+    // Windowed statistics (gpio_adc_statistics), only touched from the timer:
+    ChannelStatistics               stats_;
+    std::vector<ChannelStatsWindow> statsWindows_;  // Completed, to publish
+
+    // Threshold trigger (gpio_adc_trigger), only touched from the timer:
+    ScanTrigger               trigger_;
+    std::vector<TriggerEvent> triggerEvents_;  // Completed, to publish
+
+    void createPublishers(const std::string& topicPrefix);
+    void configureDecoder(
+        const std::vector<AinCalibration>& channelCalib, int packetsPerRead);
+    void startRawCapture(const std::vector<AinCalibration>& channelCalib);
+
+    static void onStreamTransfer(
+        void* userData, const BYTE* pBuff, unsigned long count, int status);
+    void onReadAndPubTimer();
+    void writeFixedBlocks(int scanNumber);
+    void publishDiagnostics(int64_t nowNs);
+    void publishFixedBlock();
+    rclcpp::Time steadyToRosTime(int64_t steadyTimeNs);
+    int  decodeStreamChunk(const StreamChunk& chunk);
+
+    void recordPhase(HotPathPhase phase, int64_t ns)
+    {
+        phaseTimes_[static_cast<std::size_t>(phase)].record(ns);
+    }
+};
@@ -10,6 +10,9 @@
 //---------------------------------------------------------------------------
 //
 
+// POSIX declarations (nanosleep) also when built as strict C99:
+#define _POSIX_C_SOURCE 200809L
+
 #include "labjackusb.h"
 #include <unistd.h>
 #include <stdlib.h>
@@ -21,6 +24,8 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -49,7 +54,46 @@
 static bool gIsLibUSBInitialized = false;
 static struct libusb_context *gLJContext = NULL;
 
-enum LJUSB_TRANSFER_OPERATION { LJUSB_WRITE, LJUSB_READ, LJUSB_STREAM };
+enum LJUSB_TRANSFER_OPERATION { LJUSB_WRITE, LJUSB_READ, LJUSB_STREAM, LJUSB_NUM_OPERATIONS };
+
+// Per-handle context. A HANDLE points to one of these. The product ID,
+// endpoints and transfer method are resolved once, when the device is opened,
+// so transfers don't need to query the device descriptor.
+struct LJUSB_Device
+{
+    struct libusb_device_handle *devh;
+    unsigned short productId;
+    unsigned short bcdDevice;
+    bool isBulk;  // Bulk (true) or interrupt (false) transfers
+    bool hasEndpoint[LJUSB_NUM_OPERATIONS];
+    unsigned char endpoint[LJUSB_NUM_OPERATIONS];
+    unsigned char userData[LJUSB_USER_DATA_SIZE];  // See LJUSB_GetUserData
+    struct LJUSB_VirtualDevice *virtualDevice;  // NULL for USB devices
+};
+
+// A device added with LJUSB_AddVirtualDevice. Its handles have no libusb
+// device handle: all their transfers go through its transport.
+struct LJUSB_VirtualDevice
+{
+    unsigned long productId;
+    const struct LJUSB_Transport *transport;
+    void *context;
+    bool isOpen;
+};
+
+static struct LJUSB_VirtualDevice gVirtualDevices[LJUSB_MAX_VIRTUAL_DEVICES];
+static unsigned int gNumVirtualDevices = 0;
+
+// Asynchronous streams of virtual devices, serviced by LJUSB_StreamPoll.
+static struct LJUSB_AsyncStream *gVirtualStreams = NULL;
+
+static struct libusb_device_handle *LJUSB_DevHandle(HANDLE hDevice)
+{
+    return ((struct LJUSB_Device *)hDevice)->devh;
+}
+
+static bool LJUSB_ResolveEndpoint(unsigned short productId, enum LJUSB_TRANSFER_OPERATION operation, unsigned char *pEndpoint, bool *pIsBulk);
+static unsigned int LJUSB_GetUSBDevCount(unsigned long ProductID);
 
 struct LJUSB_FirmwareHardwareVersion
 {
@@ -494,7 +538,9 @@ float LJUSB_GetLibraryVersion(void)
 static HANDLE LJUSB_OpenSpecificDevice(libusb_device *dev, const struct libusb_device_descriptor *desc)
 {
     int r = 1;
+    int op = 0;
     struct libusb_device_handle *devh = NULL;
+    struct LJUSB_Device *device = NULL;
 
     // Open the device to get handle.
     r = libusb_open(dev, &devh);
@@ -527,12 +573,75 @@ static HANDLE LJUSB_OpenSpecificDevice(libusb_device *dev, const struct libusb_d
         return NULL;
     }
 
-    return (HANDLE) devh;
+    device = (struct LJUSB_Device *)calloc(1, sizeof(struct LJUSB_Device));
+    if (device == NULL) {
+        libusb_release_interface(devh, 0);
+        libusb_close(devh);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    device->devh = devh;
+    device->productId = desc->idProduct;
+    device->bcdDevice = desc->bcdDevice;
+    for (op = 0; op < LJUSB_NUM_OPERATIONS; op++) {
+        device->hasEndpoint[op] = LJUSB_ResolveEndpoint(desc->idProduct, (enum LJUSB_TRANSFER_OPERATION)op, &device->endpoint[op], &device->isBulk);
+    }
+
+    return (HANDLE) device;
+}
+
+static HANDLE LJUSB_OpenVirtualDevice(struct LJUSB_VirtualDevice *virtualDevice)
+{
+    struct LJUSB_Device *device = NULL;
+    int op = 0;
+
+    if (virtualDevice->isOpen) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    device = (struct LJUSB_Device *)calloc(1, sizeof(struct LJUSB_Device));
+    if (device == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    device->productId = (unsigned short)virtualDevice->productId;
+    for (op = 0; op < LJUSB_NUM_OPERATIONS; op++) {
+        device->hasEndpoint[op] = LJUSB_ResolveEndpoint(device->productId, (enum LJUSB_TRANSFER_OPERATION)op, &device->endpoint[op], &device->isBulk);
+    }
+    device->virtualDevice = virtualDevice;
+    virtualDevice->isOpen = true;
+
+    return (HANDLE) device;
 }
 
+
+static HANDLE LJUSB_OpenUSBDevice(UINT DevNum, unsigned long ProductID);
+
 HANDLE LJUSB_OpenDevice(UINT DevNum, unsigned int dwReserved, unsigned long ProductID)
 {
+    unsigned int i = 0;
+    unsigned int virtualCount = 0;
+
     (void)dwReserved;
+
+    for (i = 0; i < gNumVirtualDevices; i++) {
+        if (gVirtualDevices[i].productId == ProductID) {
+            virtualCount++;
+            if (virtualCount == DevNum) {
+                return LJUSB_OpenVirtualDevice(&gVirtualDevices[i]);
+            }
+        }
+    }
+
+    return LJUSB_OpenUSBDevice(DevNum - virtualCount, ProductID);
+}
+
+
+static HANDLE LJUSB_OpenUSBDevice(UINT DevNum, unsigned long ProductID)
+{
     libusb_device **devs = NULL, *dev = NULL;
     struct libusb_device_descriptor desc;
     ssize_t cnt = 0;
@@ -644,11 +753,11 @@ int LJUSB_OpenAllDevices(HANDLE* devHandles, UINT* productIds, UINT maxDevices)
                     ljFoundCount++;
                 } else {
                     // Not high enough firmware, keep moving.
-                    libusb_close(handle);
+                    LJUSB_CloseDevice(handle);
                 }
             } else {
                 // Too many devices have been found.
-                libusb_close(handle);
+                LJUSB_CloseDevice(handle);
                 break;
             }
         }
@@ -707,7 +816,7 @@ int LJUSB_OpenAllDevicesOfProductId(UINT productId, HANDLE **devHandles)
                     successCount++;
                 } else {
                     // Not high enough firmware, keep moving.
-                    libusb_close(handle);
+                    LJUSB_CloseDevice(handle);
                 }
             }
         }
@@ -728,13 +837,18 @@ bool LJUSB_ResetConnection(HANDLE hDevice)
         return false;
     }
 
-    r = libusb_reset_device(hDevice);
-    if (r != 0)
-    {
-        LJUSB_libusbError(r);
-        return false;
+    if (!LJUSB_IsVirtualDevice(hDevice)) {
+        r = libusb_reset_device(LJUSB_DevHandle(hDevice));
+        if (r != 0)
+        {
+            LJUSB_libusbError(r);
+            return false;
+        }
     }
 
+    // Any state cached about the device is no longer valid.
+    memset(((struct LJUSB_Device *)hDevice)->userData, 0, LJUSB_USER_DATA_SIZE);
+
     return true; //Success
 }
 
@@ -762,17 +876,23 @@ static unsigned long LJUSB_DoTransfer(HANDLE hDevice, unsigned char endpoint, BY
         return 0;
     }
 
+    if (LJUSB_IsVirtualDevice(hDevice)) {
+        // Virtual devices only support the endpoints of their transport.
+        errno = ENOTSUP;
+        return 0;
+    }
+
     if (isBulk && endpoint != 1 && endpoint < 0x81 ) {
         fprintf(stderr, "LJUSB_DoTransfer warning: Got endpoint = %d, however this not a known endpoint. Please verify you are using the header file provided in /usr/local/include/labjackusb.h and not an older header file.\n", endpoint);
     }
 
     if (isBulk) {
-        r = libusb_bulk_transfer(hDevice, endpoint, pBuff, (int)count, &transferred, timeout);
+        r = libusb_bulk_transfer(LJUSB_DevHandle(hDevice), endpoint, pBuff, (int)count, &transferred, timeout);
     }
     else {
         if (endpoint == 0) {
             //HID feature request.
-            r = libusb_control_transfer(hDevice, 0xa1, 0x01, 0x0300, 0x0000, pBuff, (uint16_t)count, timeout);
+            r = libusb_control_transfer(LJUSB_DevHandle(hDevice), 0xa1, 0x01, 0x0300, 0x0000, pBuff, (uint16_t)count, timeout);
             if (r < 0) {
                 LJUSB_libusbError(r);
                 return 0;
@@ -785,7 +905,7 @@ static unsigned long LJUSB_DoTransfer(HANDLE hDevice, unsigned char endpoint, BY
             return r;
         }
         else {
-            r = libusb_interrupt_transfer(hDevice, endpoint, pBuff, (int)count, &transferred, timeout);
+            r = libusb_interrupt_transfer(LJUSB_DevHandle(hDevice), endpoint, pBuff, (int)count, &transferred, timeout);
         }
     }
 
@@ -811,36 +931,15 @@ static unsigned long LJUSB_DoTransfer(HANDLE hDevice, unsigned char endpoint, BY
 }
 
 
-// Automatically uses the correct endpoint and transfer method (bulk or interrupt)
-static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned long count, unsigned int timeout, enum LJUSB_TRANSFER_OPERATION operation)
+// Determines the correct endpoint and transfer method (bulk or interrupt) for
+// an operation on a product. Only called when opening a device. Returns false
+// and sets errno on error.
+static bool LJUSB_ResolveEndpoint(unsigned short productId, enum LJUSB_TRANSFER_OPERATION operation, unsigned char *pEndpoint, bool *pIsBulk)
 {
-    libusb_device *dev = NULL;
-    struct libusb_device_descriptor desc;
     bool isBulk = true;
     unsigned char endpoint = 0;
-    int r = 0;
-
-#if LJ_DEBUG
-    fprintf(stderr, "Calling LJUSB_SetupTransfer with count = %lu and operation = %d.\n", count, operation);
-#endif
-
-    if (LJUSB_isNullHandle(hDevice)) {
-#if LJ_DEBUG
-        fprintf(stderr, "LJUSB_SetupTransfer: returning 0. hDevice is NULL.\n");
-#endif
-        return 0;
-    }
-
-    //First determine the device from handle.
-    dev = libusb_get_device(hDevice);
-    r = libusb_get_device_descriptor(dev, &desc);
-
-    if (r < 0) {
-        LJUSB_libusbError(r);
-        return 0;
-    }
 
-    switch (desc.idProduct) {
+    switch (productId) {
 
     /* These devices use bulk transfers */
     case UE9_PRODUCT_ID:
@@ -857,7 +956,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case U3_PRODUCT_ID:
@@ -874,7 +973,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case U6_PRODUCT_ID:
@@ -891,7 +990,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case BRIDGE_PRODUCT_ID:
@@ -908,7 +1007,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case T4_PRODUCT_ID:
@@ -925,7 +1024,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case T5_PRODUCT_ID:
@@ -942,7 +1041,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case T7_PRODUCT_ID:
@@ -959,7 +1058,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     case DIGIT_PRODUCT_ID:
@@ -975,7 +1074,7 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
         default:
             //No streaming interface
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
 
@@ -994,14 +1093,144 @@ static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned l
             break;
         default:
             errno = EINVAL;
-            return 0;
+            return false;
         }
         break;
     default:
         // Error, not a labjack device
+        errno = EINVAL;
+        return false;
+    }
+
+    *pEndpoint = endpoint;
+    *pIsBulk = isBulk;
+    return true;
+}
+
+
+// Returns the endpoint and transfer method of an operation, as resolved when
+// the device was opened. Returns false and sets errno on error.
+static bool LJUSB_GetEndpoint(HANDLE hDevice, enum LJUSB_TRANSFER_OPERATION operation, unsigned char *pEndpoint, bool *pIsBulk)
+{
+    const struct LJUSB_Device *device = (const struct LJUSB_Device *)hDevice;
+
+    if (!device->hasEndpoint[operation]) {
+        errno = EINVAL;
+        return false;
+    }
+
+    *pEndpoint = device->endpoint[operation];
+    *pIsBulk = device->isBulk;
+    return true;
+}
+
+
+bool LJUSB_AddVirtualDevice(unsigned long ProductID, const struct LJUSB_Transport *transport, void *context)
+{
+    struct LJUSB_VirtualDevice *virtualDevice = NULL;
+    unsigned int i = 0;
+
+    if (transport == NULL || transport->write == NULL || transport->read == NULL ||
+        transport->stream == NULL || transport->streamWait == NULL) {
+        errno = EINVAL;
+        return false;
+    }
+
+    // Reuse the slot of a removed device, if any.
+    for (i = 0; i < gNumVirtualDevices && virtualDevice == NULL; i++) {
+        if (gVirtualDevices[i].transport == NULL) {
+            virtualDevice = &gVirtualDevices[i];
+        }
+    }
+
+    if (virtualDevice == NULL) {
+        if (gNumVirtualDevices == LJUSB_MAX_VIRTUAL_DEVICES) {
+            errno = ENOMEM;
+            return false;
+        }
+        virtualDevice = &gVirtualDevices[gNumVirtualDevices++];
+    }
+
+    virtualDevice->productId = ProductID;
+    virtualDevice->transport = transport;
+    virtualDevice->context = context;
+    virtualDevice->isOpen = false;
+    return true;
+}
+
+
+bool LJUSB_RemoveVirtualDevice(void *context)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < gNumVirtualDevices; i++) {
+        if (gVirtualDevices[i].transport != NULL && gVirtualDevices[i].context == context) {
+            if (gVirtualDevices[i].isOpen) {
+                errno = EBUSY;
+                return false;
+            }
+            // Keep the slot, open handles of other devices point into the
+            // array. A product ID of 0 matches no device.
+            gVirtualDevices[i].productId = 0;
+            gVirtualDevices[i].transport = NULL;
+            gVirtualDevices[i].context = NULL;
+            return true;
+        }
+    }
+
+    errno = ENODEV;
+    return false;
+}
+
+
+bool LJUSB_IsVirtualDevice(HANDLE hDevice)
+{
+    return hDevice != NULL && ((const struct LJUSB_Device *)hDevice)->virtualDevice != NULL;
+}
+
+
+static unsigned long LJUSB_VirtualTransfer(HANDLE hDevice, BYTE *pBuff, unsigned long count, unsigned int timeout, enum LJUSB_TRANSFER_OPERATION operation)
+{
+    const struct LJUSB_VirtualDevice *virtualDevice = ((const struct LJUSB_Device *)hDevice)->virtualDevice;
+
+    switch (operation) {
+    case LJUSB_WRITE:
+        return virtualDevice->transport->write(virtualDevice->context, pBuff, count, timeout);
+    case LJUSB_READ:
+        return virtualDevice->transport->read(virtualDevice->context, pBuff, count, timeout);
+    case LJUSB_STREAM:
+        return virtualDevice->transport->stream(virtualDevice->context, pBuff, count, timeout);
+    default:
         errno = EINVAL;
         return 0;
     }
+}
+
+
+// Automatically uses the correct endpoint and transfer method (bulk or interrupt)
+static unsigned long LJUSB_SetupTransfer(HANDLE hDevice, BYTE *pBuff, unsigned long count, unsigned int timeout, enum LJUSB_TRANSFER_OPERATION operation)
+{
+    bool isBulk = true;
+    unsigned char endpoint = 0;
+
+#if LJ_DEBUG
+    fprintf(stderr, "Calling LJUSB_SetupTransfer with count = %lu and operation = %d.\n", count, operation);
+#endif
+
+    if (LJUSB_isNullHandle(hDevice)) {
+#if LJ_DEBUG
+        fprintf(stderr, "LJUSB_SetupTransfer: returning 0. hDevice is NULL.\n");
+#endif
+        return 0;
+    }
+
+    if (LJUSB_IsVirtualDevice(hDevice)) {
+        return LJUSB_VirtualTransfer(hDevice, pBuff, count, timeout, operation);
+    }
+
+    if (!LJUSB_GetEndpoint(hDevice, operation, &endpoint, &isBulk)) {
+        return 0;
+    }
 
     return LJUSB_DoTransfer(hDevice, endpoint, pBuff, count, timeout, isBulk);
 }
@@ -1057,6 +1286,569 @@ unsigned long LJUSB_StreamTO(HANDLE hDevice, BYTE *pBuff, unsigned long count, u
 }
 
 
+struct LJUSB_AsyncStream
+{
+    HANDLE hDevice;
+    unsigned char endpoint;
+    unsigned int numTransfers;
+    unsigned long transferSize;
+    struct libusb_transfer **transfers;
+    BYTE *buffers;
+    LJUSB_StreamCallback callback;
+    void *userData;
+    unsigned int numActive;  // Transfers currently owned by libusb
+    bool stopping;
+    struct LJUSB_AsyncStream *next;  // In gVirtualStreams (virtual devices)
+};
+
+
+static void LIBUSB_CALL LJUSB_StreamTransferCallback(struct libusb_transfer *transfer)
+{
+    LJUSB_AsyncStream *stream = (LJUSB_AsyncStream *)transfer->user_data;
+    int status = 0;
+    int r = 0;
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        status = 0;
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        status = ETIMEDOUT;
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        stream->numActive--;
+        return;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        status = ENXIO;
+        break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        status = EOVERFLOW;
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        status = EPIPE;
+        break;
+    case LIBUSB_TRANSFER_ERROR:
+    default:
+        status = EIO;
+        break;
+    }
+
+    if (!stream->stopping) {
+        stream->callback(stream->userData, transfer->buffer, (unsigned long)transfer->actual_length, status);
+    }
+
+    // Keep the transfer queued, unless the device is gone or we are stopping.
+    if (stream->stopping || status == ENXIO) {
+        stream->numActive--;
+        return;
+    }
+
+    r = libusb_submit_transfer(transfer);
+    if (r < 0) {
+        stream->numActive--;
+        LJUSB_libusbError(r);
+        stream->callback(stream->userData, NULL, 0, errno);
+    }
+}
+
+
+LJUSB_AsyncStream *LJUSB_StreamStart(HANDLE hDevice, unsigned int numTransfers, unsigned long transferSize, unsigned int timeout, LJUSB_StreamCallback callback, void *userData)
+{
+    LJUSB_AsyncStream *stream = NULL;
+    bool isBulk = true;
+    unsigned char endpoint = 0;
+    unsigned int i = 0;
+    int r = 0;
+
+#if LJ_DEBUG
+    fprintf(stderr, "Calling LJUSB_StreamStart with numTransfers = %u and transferSize = %lu.\n", numTransfers, transferSize);
+#endif
+
+    if (LJUSB_isNullHandle(hDevice)) {
+        return NULL;
+    }
+
+    if (numTransfers == 0 || transferSize == 0 || transferSize > 65535 /*UINT16_MAX*/ || callback == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!LJUSB_GetEndpoint(hDevice, LJUSB_STREAM, &endpoint, &isBulk)) {
+        return NULL;
+    }
+
+    if (!isBulk) {
+        // Only bulk stream endpoints are supported
+        errno = EINVAL;
+        return NULL;
+    }
+
+    stream = (LJUSB_AsyncStream *)calloc(1, sizeof(LJUSB_AsyncStream));
+    if (stream == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    stream->hDevice = hDevice;
+    stream->endpoint = endpoint;
+    stream->numTransfers = numTransfers;
+    stream->transferSize = transferSize;
+    stream->callback = callback;
+    stream->userData = userData;
+    stream->buffers = (BYTE *)malloc(numTransfers * transferSize);
+    if (stream->buffers == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    if (LJUSB_IsVirtualDevice(hDevice)) {
+        // No transfers: LJUSB_StreamPoll reads the transport when ready.
+        stream->next = gVirtualStreams;
+        gVirtualStreams = stream;
+        return stream;
+    }
+
+    stream->transfers = (struct libusb_transfer **)calloc(numTransfers, sizeof(struct libusb_transfer *));
+    if (stream->transfers == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    for (i = 0; i < numTransfers; i++) {
+        stream->transfers[i] = libusb_alloc_transfer(0);
+        if (stream->transfers[i] == NULL) {
+            errno = ENOMEM;
+            goto error;
+        }
+        libusb_fill_bulk_transfer(stream->transfers[i], LJUSB_DevHandle(hDevice), endpoint, stream->buffers + i * transferSize, (int)transferSize, LJUSB_StreamTransferCallback, stream, timeout);
+    }
+
+    for (i = 0; i < numTransfers; i++) {
+        r = libusb_submit_transfer(stream->transfers[i]);
+        if (r < 0) {
+            LJUSB_libusbError(r);
+            LJUSB_StreamStop(stream);
+            return NULL;
+        }
+        stream->numActive++;
+    }
+
+    return stream;
+
+error:
+    LJUSB_StreamStop(stream);
+    return NULL;
+}
+
+
+// Completes the reads of all virtual device streams that are ready, up to
+// numTransfers per stream, as their queued transfers would. Returns the
+// number of microseconds until the next one is ready, at most maxWait.
+static long LJUSB_PollVirtualStreams(long maxWait)
+{
+    LJUSB_AsyncStream *stream = NULL;
+    const struct LJUSB_VirtualDevice *virtualDevice = NULL;
+    unsigned long count = 0;
+    unsigned int i = 0;
+    long wait = maxWait;
+    long streamWait = 0;
+
+    for (stream = gVirtualStreams; stream != NULL; stream = stream->next) {
+        virtualDevice = ((const struct LJUSB_Device *)stream->hDevice)->virtualDevice;
+
+        for (i = 0; i < stream->numTransfers; i++) {
+            streamWait = virtualDevice->transport->streamWait(virtualDevice->context, stream->transferSize);
+            if (streamWait != 0) {
+                break;
+            }
+
+            count = virtualDevice->transport->stream(virtualDevice->context, stream->buffers, stream->transferSize, 0);
+            stream->callback(stream->userData, stream->buffers, count, (count < stream->transferSize) ? errno : 0);
+        }
+
+        if (streamWait == 0) {
+            wait = 0;  // Maybe more data is ready already
+        }
+        else if (streamWait > 0 && streamWait < wait) {
+            wait = streamWait;
+        }
+    }
+
+    return wait;
+}
+
+
+int LJUSB_StreamPoll(unsigned int timeout)
+{
+    struct timeval tv;
+    long wait = (long)timeout * 1000;
+    int r = 0;
+
+    if (gVirtualStreams != NULL) {
+        wait = LJUSB_PollVirtualStreams(wait);
+        if (!gIsLibUSBInitialized) {
+            if (wait > 0) {
+                struct timespec ts;
+                ts.tv_sec = wait / 1000000;
+                ts.tv_nsec = (wait % 1000000) * 1000;
+                nanosleep(&ts, NULL);
+            }
+            return 0;
+        }
+    }
+
+    if (!gIsLibUSBInitialized) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tv.tv_sec = wait / 1000000;
+    tv.tv_usec = wait % 1000000;
+
+    r = libusb_handle_events_timeout_completed(gLJContext, &tv, NULL);
+    if (r < 0) {
+        LJUSB_libusbError(r);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void LJUSB_StreamStop(LJUSB_AsyncStream *stream)
+{
+    LJUSB_AsyncStream **pStream = NULL;
+    struct timeval tv;
+    unsigned int i = 0;
+    int r = 0;
+
+    if (stream == NULL) {
+        return;
+    }
+
+    stream->stopping = true;
+
+    for (pStream = &gVirtualStreams; *pStream != NULL; pStream = &(*pStream)->next) {
+        if (*pStream == stream) {
+            *pStream = stream->next;
+            break;
+        }
+    }
+
+    if (stream->transfers != NULL) {
+        for (i = 0; i < stream->numTransfers; i++) {
+            if (stream->transfers[i] != NULL) {
+                libusb_cancel_transfer(stream->transfers[i]);
+            }
+        }
+
+        // Wait for all cancellations to be reported before freeing anything.
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        while (stream->numActive > 0) {
+            r = libusb_handle_events_timeout_completed(gLJContext, &tv, NULL);
+            if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+                LJUSB_libusbError(r);
+                break;
+            }
+        }
+
+        if (stream->numActive > 0) {
+            // libusb still owns these transfers, and their callbacks will
+            // use the stream: leak it all rather than free memory in use.
+            // (With stopping set, the callbacks just count them as done.)
+            fprintf(stderr, "LJUSB_StreamStop: %u transfers could not be cancelled\n", stream->numActive);
+            return;
+        }
+
+        for (i = 0; i < stream->numTransfers; i++) {
+            libusb_free_transfer(stream->transfers[i]);
+        }
+        free(stream->transfers);
+    }
+
+    free(stream->buffers);
+    free(stream);
+}
+
+
+// State of one LJUSB_WriteReadPipelined call.  Its transfers are arranged
+// in maxInFlight slots of one command (write) and one response (read)
+// transfer each. A slot is reused for the next command once both are done.
+// Completion callbacks may run in another thread handling events (e.g. one
+// in LJUSB_StreamPoll), so everything below lock is only accessed with it
+// held.
+struct LJUSB_Pipeline
+{
+    pthread_mutex_t lock;
+    unsigned int numCommands;
+    BYTE *const *pCommands;
+    const unsigned long *commandSizes;
+    BYTE *const *pResponses;
+    const unsigned long *responseSizes;
+    unsigned long *responseCounts;
+    unsigned int numSlots;
+    struct libusb_transfer **transfers;  // Write, read, write, read...
+    unsigned int *slotCommand;  // Command index in each slot
+    unsigned int *slotPending;  // Transfers of each slot owned by libusb
+    unsigned int numSubmitted;  // Commands submitted
+    unsigned int numResponses;  // Responses read, in order
+    unsigned int numActive;  // Transfers owned by libusb
+    int error;  // First errno value, 0 if none
+    int completed;  // For libusb_handle_events_timeout_completed
+};
+
+
+static int LJUSB_TransferErrno(enum libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return ETIMEDOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return ECANCELED;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return ENXIO;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return EOVERFLOW;
+    case LIBUSB_TRANSFER_STALL:
+        return EPIPE;
+    case LIBUSB_TRANSFER_ERROR:
+    default:
+        return EIO;
+    }
+}
+
+
+// Called with pipeline->lock held.
+static void LJUSB_PipelineFail(struct LJUSB_Pipeline *pipeline, int error)
+{
+    unsigned int i = 0;
+
+    if (pipeline->error != 0) {
+        return;
+    }
+    pipeline->error = error;
+
+    // Everything still queued is discarded.
+    for (i = 0; i < 2 * pipeline->numSlots; i++) {
+        if (pipeline->slotPending[i / 2] > 0) {
+            libusb_cancel_transfer(pipeline->transfers[i]);
+        }
+    }
+}
+
+
+// Called with pipeline->lock held.  The transfers are counted as owned by
+// libusb before submitting them, since their callbacks may run (in another
+// thread) as soon as they are submitted.
+static void LJUSB_PipelineSubmit(struct LJUSB_Pipeline *pipeline, unsigned int slot)
+{
+    struct libusb_transfer *write = pipeline->transfers[2 * slot];
+    struct libusb_transfer *read = pipeline->transfers[2 * slot + 1];
+    unsigned int i = pipeline->numSubmitted;
+    int r = 0;
+
+    write->buffer = pipeline->pCommands[i];
+    write->length = (int)pipeline->commandSizes[i];
+    read->buffer = pipeline->pResponses[i];
+    read->length = (int)pipeline->responseSizes[i];
+
+    pipeline->slotCommand[slot] = i;
+    pipeline->numSubmitted++;
+
+    pipeline->slotPending[slot]++;
+    pipeline->numActive++;
+    r = libusb_submit_transfer(write);
+    if (r < 0) {
+        pipeline->slotPending[slot]--;
+        pipeline->numActive--;
+        LJUSB_libusbError(r);
+        LJUSB_PipelineFail(pipeline, errno);
+        return;
+    }
+
+    pipeline->slotPending[slot]++;
+    pipeline->numActive++;
+    r = libusb_submit_transfer(read);
+    if (r < 0) {
+        pipeline->slotPending[slot]--;
+        pipeline->numActive--;
+        LJUSB_libusbError(r);
+        LJUSB_PipelineFail(pipeline, errno);
+        return;
+    }
+}
+
+
+// Whether all the transfers of a pipeline are done: none owned by libusb.
+static bool LJUSB_PipelineDone(struct LJUSB_Pipeline *pipeline)
+{
+    bool done = false;
+
+    pthread_mutex_lock(&pipeline->lock);
+    done = (pipeline->numActive == 0);
+    pthread_mutex_unlock(&pipeline->lock);
+    return done;
+}
+
+
+static void LIBUSB_CALL LJUSB_PipelineTransferCallback(struct libusb_transfer *transfer)
+{
+    struct LJUSB_Pipeline *pipeline = (struct LJUSB_Pipeline *)transfer->user_data;
+    unsigned int index = 0;
+    unsigned int slot = 0;
+    int status = LJUSB_TransferErrno(transfer->status);
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    while (pipeline->transfers[index] != transfer) {
+        index++;
+    }
+    slot = index / 2;
+    pipeline->slotPending[slot]--;
+    pipeline->numActive--;
+
+    if (status == 0 && index % 2 == 0 && transfer->actual_length < transfer->length) {
+        status = EIO;  // Command not fully written
+    }
+
+    if (status != 0) {
+        LJUSB_PipelineFail(pipeline, status);
+    }
+    else if (index % 2 == 1) {
+        // Responses complete in order, since they share one endpoint.
+        pipeline->responseCounts[pipeline->slotCommand[slot]] = (unsigned long)transfer->actual_length;
+        pipeline->numResponses++;
+    }
+
+    if (pipeline->error == 0 && pipeline->slotPending[slot] == 0 && pipeline->numSubmitted < pipeline->numCommands) {
+        LJUSB_PipelineSubmit(pipeline, slot);
+    }
+
+    // Last access to the pipeline: once numActive is 0 and the lock is
+    // released, the waiting thread may free it.
+    if (pipeline->numActive == 0) {
+        pipeline->completed = 1;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+
+unsigned int LJUSB_WriteReadPipelined(HANDLE hDevice, unsigned int numCommands, BYTE *const *pCommands, const unsigned long *commandSizes, BYTE *const *pResponses, const unsigned long *responseSizes, unsigned long *responseCounts, unsigned int maxInFlight, unsigned int timeout)
+{
+    struct LJUSB_Pipeline pipeline;
+    unsigned char writeEndpoint = 0;
+    unsigned char readEndpoint = 0;
+    bool isBulk = true;
+    unsigned int i = 0;
+    int r = 0;
+
+#if LJ_DEBUG
+    fprintf(stderr, "Calling LJUSB_WriteReadPipelined with numCommands = %u and maxInFlight = %u.\n", numCommands, maxInFlight);
+#endif
+
+    if (LJUSB_isNullHandle(hDevice)) {
+        return 0;
+    }
+
+    if (maxInFlight == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    for (i = 0; i < numCommands; i++) {
+        if (commandSizes[i] > 65535 /*UINT16_MAX*/ || responseSizes[i] > 65535) {
+            errno = EINVAL;
+            return 0;
+        }
+    }
+
+    if (!LJUSB_GetEndpoint(hDevice, LJUSB_WRITE, &writeEndpoint, &isBulk) ||
+        !LJUSB_GetEndpoint(hDevice, LJUSB_READ, &readEndpoint, &isBulk)) {
+        return 0;
+    }
+
+    if (!isBulk || maxInFlight == 1 || LJUSB_IsVirtualDevice(hDevice)) {
+        // Nothing to overlap: one command at a time.
+        for (i = 0; i < numCommands; i++) {
+            if (LJUSB_WriteTO(hDevice, pCommands[i], commandSizes[i], timeout) < commandSizes[i]) {
+                break;
+            }
+            responseCounts[i] = LJUSB_ReadTO(hDevice, pResponses[i], responseSizes[i], timeout);
+            if (responseCounts[i] == 0) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.numCommands = numCommands;
+    pipeline.pCommands = pCommands;
+    pipeline.commandSizes = commandSizes;
+    pipeline.pResponses = pResponses;
+    pipeline.responseSizes = responseSizes;
+    pipeline.responseCounts = responseCounts;
+    pipeline.numSlots = (maxInFlight < numCommands) ? maxInFlight : numCommands;
+    if (pipeline.numSlots == 0) {
+        return 0;
+    }
+
+    pipeline.transfers = (struct libusb_transfer **)calloc(2 * pipeline.numSlots, sizeof(struct libusb_transfer *));
+    pipeline.slotCommand = (unsigned int *)calloc(pipeline.numSlots, sizeof(unsigned int));
+    pipeline.slotPending = (unsigned int *)calloc(pipeline.numSlots, sizeof(unsigned int));
+    if (pipeline.transfers == NULL || pipeline.slotCommand == NULL || pipeline.slotPending == NULL) {
+        pipeline.error = ENOMEM;
+    }
+
+    for (i = 0; pipeline.error == 0 && i < 2 * pipeline.numSlots; i++) {
+        pipeline.transfers[i] = libusb_alloc_transfer(0);
+        if (pipeline.transfers[i] == NULL) {
+            pipeline.error = ENOMEM;
+            break;
+        }
+        libusb_fill_bulk_transfer(pipeline.transfers[i], LJUSB_DevHandle(hDevice), (i % 2 == 0) ? writeEndpoint : readEndpoint, NULL, 0, LJUSB_PipelineTransferCallback, &pipeline, timeout);
+    }
+
+    pthread_mutex_init(&pipeline.lock, NULL);
+
+    pthread_mutex_lock(&pipeline.lock);
+    for (i = 0; pipeline.error == 0 && i < pipeline.numSlots; i++) {
+        LJUSB_PipelineSubmit(&pipeline, i);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+
+    // Callbacks may also run in another thread handling events (e.g. one in
+    // LJUSB_StreamPoll); libusb wakes this one up when completed is set.
+    while (!LJUSB_PipelineDone(&pipeline)) {
+        r = libusb_handle_events_completed(gLJContext, &pipeline.completed);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+            LJUSB_libusbError(r);
+            pthread_mutex_lock(&pipeline.lock);
+            LJUSB_PipelineFail(&pipeline, errno);
+            pthread_mutex_unlock(&pipeline.lock);
+        }
+    }
+    pthread_mutex_destroy(&pipeline.lock);
+
+    if (pipeline.transfers != NULL) {
+        for (i = 0; i < 2 * pipeline.numSlots; i++) {
+            libusb_free_transfer(pipeline.transfers[i]);
+        }
+    }
+    free(pipeline.transfers);
+    free(pipeline.slotCommand);
+    free(pipeline.slotPending);
+
+    if (pipeline.numResponses < numCommands) {
+        errno = (pipeline.error != 0) ? pipeline.error : EIO;
+    }
+    return pipeline.numResponses;
+}
+
+
 void LJUSB_CloseDevice(HANDLE hDevice)
 {
 #if LJ_DEBUG
@@ -1067,21 +1859,53 @@ void LJUSB_CloseDevice(HANDLE hDevice)
         return;
     }
 
+    if (LJUSB_IsVirtualDevice(hDevice)) {
+        struct LJUSB_VirtualDevice *virtualDevice = ((struct LJUSB_Device *)hDevice)->virtualDevice;
+        if (virtualDevice->transport->close != NULL) {
+            virtualDevice->transport->close(virtualDevice->context);
+        }
+        virtualDevice->isOpen = false;
+        free(hDevice);
+        return;
+    }
+
     //Release
-    int r = libusb_release_interface(hDevice, 0);
+    int r = libusb_release_interface(LJUSB_DevHandle(hDevice), 0);
     if (r < 0) {
         fprintf(stderr, "LJUSB_CloseDevice: failed to release interface\n");
     }
 
     //Close
-    libusb_close(hDevice);
+    libusb_close(LJUSB_DevHandle(hDevice));
+    free(hDevice);
 #if LJ_DEBUG
     fprintf(stderr, "LJUSB_CloseDevice: closed\n");
 #endif
 }
 
 
+static unsigned int LJUSB_GetVirtualDevCount(unsigned long ProductID)
+{
+    unsigned int i = 0;
+    unsigned int count = 0;
+
+    for (i = 0; i < gNumVirtualDevices; i++) {
+        if (gVirtualDevices[i].productId == ProductID) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
 unsigned int LJUSB_GetDevCount(unsigned long ProductID)
+{
+    return LJUSB_GetVirtualDevCount(ProductID) + LJUSB_GetUSBDevCount(ProductID);
+}
+
+
+static unsigned int LJUSB_GetUSBDevCount(unsigned long ProductID)
 {
     libusb_device **devs = NULL;
     ssize_t cnt = 0;
@@ -1261,13 +2085,17 @@ bool LJUSB_IsHandleValid(HANDLE hDevice)
         return false;
     }
 
+    if (LJUSB_IsVirtualDevice(hDevice)) {
+        return true;
+    }
+
     // If we can call get configuration without getting an error,
     // the handle is still valid.
     // Note that libusb_get_configuration() will return a cached value,
     // so we replace this call
     // r = libusb_get_configuration(hDevice, &config);
     // to the actual control tranfser, from the libusb source
-    r = libusb_control_transfer(hDevice, LIBUSB_ENDPOINT_IN,
+    r = libusb_control_transfer(LJUSB_DevHandle(hDevice), LIBUSB_ENDPOINT_IN,
         LIBUSB_REQUEST_GET_CONFIGURATION, 0, 0, &config, 1, LJ_LIBUSB_TIMEOUT_DEFAULT);
     if (r < 0) {
 #if LJ_DEBUG
@@ -1286,10 +2114,6 @@ bool LJUSB_IsHandleValid(HANDLE hDevice)
 
 unsigned short LJUSB_GetDeviceDescriptorReleaseNumber(HANDLE hDevice)
 {
-    libusb_device *dev = NULL;
-    struct libusb_device_descriptor desc;
-    int r = 0;
-
     if (LJUSB_isNullHandle(hDevice)) {
 #if LJ_DEBUG
         fprintf(stderr, "LJUSB_GetDeviceDescriptorReleaseNumber: returning 0. hDevice is NULL.\n");
@@ -1297,22 +2121,25 @@ unsigned short LJUSB_GetDeviceDescriptorReleaseNumber(HANDLE hDevice)
         return 0;
     }
 
-    dev = libusb_get_device(hDevice);
-    r = libusb_get_device_descriptor(dev, &desc);
+    return ((const struct LJUSB_Device *)hDevice)->bcdDevice;
+}
 
-    if (r < 0) {
-        LJUSB_libusbError(r);
-        return 0;
+
+void *LJUSB_GetUserData(HANDLE hDevice)
+{
+    if (LJUSB_isNullHandle(hDevice)) {
+#if LJ_DEBUG
+        fprintf(stderr, "LJUSB_GetUserData: returning NULL. hDevice is NULL.\n");
+#endif
+        return NULL;
     }
 
-    return desc.bcdDevice;
+    return ((struct LJUSB_Device *)hDevice)->userData;
 }
 
 
 unsigned long LJUSB_GetHIDReportDescriptor(HANDLE hDevice, BYTE *pBuff, unsigned long count)
 {
-    libusb_device *dev = NULL;
-    struct libusb_device_descriptor desc;
     int r = 0;
 
     if (count > UINT16_MAX) {
@@ -1329,22 +2156,13 @@ unsigned long LJUSB_GetHIDReportDescriptor(HANDLE hDevice, BYTE *pBuff, unsigned
         return 0;
     }
 
-    //Determine the device from handle.
-    dev = libusb_get_device(hDevice);
-    r = libusb_get_device_descriptor(dev, &desc);
-
-    if (r < 0) {
-        LJUSB_libusbError(r);
-        return 0;
-    }
-
-    if (desc.idProduct != U12_PRODUCT_ID) {
+    if (((const struct LJUSB_Device *)hDevice)->productId != U12_PRODUCT_ID || LJUSB_IsVirtualDevice(hDevice)) {
         //Only U12 supported
         errno = EINVAL;
         return 0;
     }
 
-    r = libusb_control_transfer(hDevice, 0x81, 0x06, 0x2200, 0x0000, pBuff, (uint16_t)count, LJ_LIBUSB_TIMEOUT_DEFAULT);
+    r = libusb_control_transfer(LJUSB_DevHandle(hDevice), 0x81, 0x06, 0x2200, 0x0000, pBuff, (uint16_t)count, LJ_LIBUSB_TIMEOUT_DEFAULT);
     if (r < 0) {
         LJUSB_libusbError(r);
         return 0;
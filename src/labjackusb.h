@@ -152,7 +152,8 @@ float LJUSB_GetLibraryVersion(void);
 //Returns the labjackusb library version number.
 
 unsigned int LJUSB_GetDevCount(unsigned long ProductID);
-// Returns the total number of LabJack USB devices connected.
+// Returns the total number of LabJack USB devices connected, plus the virtual
+// ones added with LJUSB_AddVirtualDevice.
 // ProductID = The product ID of the devices you want to get the count of.
 
 unsigned int LJUSB_GetDevCounts(UINT *productCounts, UINT * productIds, UINT n);
@@ -209,6 +210,7 @@ HANDLE LJUSB_OpenDevice(UINT DevNum, unsigned int dwReserved, unsigned long Prod
 // DevNum = The device number of the LabJack USB device you want to open.  For
 //          example, if there is one device connected, set DevNum = 1.  If you
 //          have two devices connected, then set DevNum = 1, or DevNum = 2.
+//          Virtual devices (see LJUSB_AddVirtualDevice) come first.
 // dwReserved = Not used, set to 0.
 // ProductID = The product ID of the LabJack USB device.
 
@@ -282,6 +284,73 @@ unsigned long LJUSB_StreamTO(HANDLE hDevice, BYTE *pBuff, unsigned long count, u
 // timeout = The USB communication timeout value in milliseconds.  Pass 0 for
 //           an unlimited timeout.
 
+typedef struct LJUSB_AsyncStream LJUSB_AsyncStream;
+// Opaque state of an asynchronous stream started with LJUSB_StreamStart.
+
+typedef void (*LJUSB_StreamCallback)(void *userData, const BYTE *pBuff, unsigned long count, int status);
+// Called once per completed stream transfer, from within LJUSB_StreamPoll.
+// userData = The pointer passed to LJUSB_StreamStart.
+// pBuff = The received bytes. Only valid until the callback returns, since
+//         the buffer is immediately queued again for the next transfer.
+// count = The number of bytes received.
+// status = 0 on success, or an errno value (e.g. ETIMEDOUT for a transfer
+//          that timed out, possibly with count > 0 bytes of partial data,
+//          or ENXIO if the device was disconnected).
+
+LJUSB_AsyncStream *LJUSB_StreamStart(HANDLE hDevice, unsigned int numTransfers, unsigned long transferSize, unsigned int timeout, LJUSB_StreamCallback callback, void *userData);
+// Starts asynchronous reads from a device's stream interface, keeping
+// numTransfers reads of transferSize bytes queued on the stream endpoint at
+// all times, so the bus never idles between reads. Each completed transfer is
+// reported through callback and queued again. Returns NULL on error and errno
+// is set.
+// Note that this only starts the USB transfers. The device stream itself
+// must still be started with the device's StreamStart command.
+// hDevice = The handle for your device
+// numTransfers = The number of transfers to keep in flight.
+// transferSize = The size of each transfer, in bytes.
+// timeout = The USB communication timeout value in milliseconds for each
+//           transfer.  Pass 0 for an unlimited timeout.
+// callback = Function called for each completed transfer.
+// userData = Pointer passed as is to callback.
+
+int LJUSB_StreamPoll(unsigned int timeout);
+// Handles pending USB events for all started asynchronous streams, invoking
+// their callbacks in the calling thread.  Waits up to timeout milliseconds
+// for events.  Returns 0 on success, or -1 on error and errno is set.
+// Call it in a loop from one thread (e.g. a dedicated acquisition thread).
+// The streams of virtual devices are read from their transport, in the
+// calling thread too, as soon as a whole transfer is ready.
+
+void LJUSB_StreamStop(LJUSB_AsyncStream *stream);
+// Cancels all the queued transfers of a stream, waits for the cancellations
+// to complete and frees all its resources.  No more callbacks are invoked
+// for this stream after this call returns.  Call it before closing the device.
+// If libusb fails to report some cancellations, their transfers and the
+// stream are left allocated (leaked), since libusb still uses them.
+
+unsigned int LJUSB_WriteReadPipelined(HANDLE hDevice, unsigned int numCommands, BYTE *const *pCommands, const unsigned long *commandSizes, BYTE *const *pResponses, const unsigned long *responseSizes, unsigned long *responseCounts, unsigned int maxInFlight, unsigned int timeout);
+// Sends numCommands commands to a device and reads their responses, like a
+// LJUSB_Write and LJUSB_Read pair per command, but keeping up to maxInFlight
+// commands written ahead of their responses, so the bus does not idle for a
+// host round trip between commands.  The device's endpoints flow-control the
+// commands it cannot buffer yet.  Commands are sent and responses read in
+// order, so response i belongs to command i; validating that is up to the
+// caller (e.g. by command and echo bytes).  Returns the number of responses
+// read, from the first one, which is less than numCommands on error and errno
+// is set.  Devices without bulk endpoints just use one command at a time.
+// It may run while another thread calls LJUSB_StreamPoll, which may then
+// handle the completions of its transfers.
+// hDevice = The handle for your device
+// numCommands = The number of commands to send.
+// pCommands = The bytes of each command.
+// commandSizes = The size of each command, in bytes.
+// pResponses = The buffer of each response.
+// responseSizes = The number of bytes expected in each response.
+// responseCounts = Returns the number of bytes read for each response.
+// maxInFlight = The maximum number of commands written but not yet responded.
+// timeout = The USB communication timeout value in milliseconds for each
+//           transfer.  Pass 0 for an unlimited timeout.
+
 void LJUSB_CloseDevice(HANDLE hDevice);
 // Closes the handle of a LabJack USB device.
 
@@ -294,6 +363,50 @@ unsigned short LJUSB_GetDeviceDescriptorReleaseNumber(HANDLE hDevice);
 // device descriptor.
 // hDevice = The handle for your device.
 
+struct LJUSB_Transport
+{
+    unsigned long (*write)(void *context, const BYTE *pBuff, unsigned long count, unsigned int timeout);
+    unsigned long (*read)(void *context, BYTE *pBuff, unsigned long count, unsigned int timeout);
+    unsigned long (*stream)(void *context, BYTE *pBuff, unsigned long count, unsigned int timeout);
+    long (*streamWait)(void *context, unsigned long count);
+    void (*close)(void *context);
+};
+// Transfer functions of a virtual device (e.g. a software emulator), with the
+// same semantics as LJUSB_WriteTO, LJUSB_ReadTO and LJUSB_StreamTO.
+// streamWait returns the number of microseconds until count bytes can be read
+// from the stream interface without blocking (0 if they already can), or -1
+// if the device is not streaming.  close, which can be NULL, is called when a
+// handle to the device is closed.
+
+#define LJUSB_MAX_VIRTUAL_DEVICES 16
+
+bool LJUSB_AddVirtualDevice(unsigned long ProductID, const struct LJUSB_Transport *transport, void *context);
+// Adds a virtual device, which LJUSB_GetDevCount and LJUSB_OpenDevice report
+// before the USB devices of the same product ID, so code that opens devices
+// (e.g. the U3 openUSBConnection) works with it unchanged.  All transfers of
+// its handles, including asynchronous streams, go through transport, which
+// is passed context.  Both must remain valid while the device is open.  Up to
+// LJUSB_MAX_VIRTUAL_DEVICES can be added.  Not thread-safe: add all virtual
+// devices before opening any device.  Returns false on error and errno is
+// set.
+
+bool LJUSB_RemoveVirtualDevice(void *context);
+// Removes the virtual device added with context.  Returns false on error
+// (EBUSY if the device is open, ENODEV if there is no such device) and errno
+// is set.
+
+bool LJUSB_IsVirtualDevice(HANDLE hDevice);
+// Returns true if the handle belongs to a virtual device.
+
+#define LJUSB_USER_DATA_SIZE 16
+
+void *LJUSB_GetUserData(HANDLE hDevice);
+// Returns LJUSB_USER_DATA_SIZE bytes of storage attached to an open handle,
+// where device-specific code can cache per-device state (e.g. u3.c keeps the
+// last known ConfigIO settings there).  The storage is zeroed when the device
+// is opened or its connection is reset, and freed by LJUSB_CloseDevice.
+// Returns NULL if the handle is NULL.
+
 unsigned long LJUSB_GetHIDReportDescriptor(HANDLE hDevice, BYTE *pBuff, unsigned long count);
 // Reads the HID report descriptor bytes from a device with a 1 second timeout.
 // If the timeout time elapses and no data is transferred the USB request is
@@ -0,0 +1,123 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Lock-free histogram of durations in nanoseconds, with HDR-style
+ * log-linear buckets: values below 16 ns are exact, and above that each
+ * power of two is split into 16 buckets, so any value is known within
+ * 1/16 (6.25%) of itself, up to ~2^40 ns (18 minutes). Longer values land
+ * in the last bucket.
+ *
+ * record() is a single relaxed atomic increment (plus a compare-and-swap
+ * for a new maximum), so any thread may call it, from the hot path, while
+ * another one reads it. Readers take a Snapshot and compute the statistics
+ * of the interval since their previous one from the difference.
+ */
+class LatencyHistogram
+{
+   public:
+    static constexpr int         kSubBits    = 4;  // 16 buckets per octave
+    static constexpr int         kMaxBits    = 40;
+    static constexpr std::size_t kNumBuckets = (kMaxBits - kSubBits + 1)
+                                               << kSubBits;
+
+    // Counts of every bucket at one point in time.
+    struct Snapshot
+    {
+        std::array<uint64_t, kNumBuckets> counts = {};
+    };
+
+    LatencyHistogram() = default;
+
+    LatencyHistogram(const LatencyHistogram&)            = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(int64_t ns)
+    {
+        const uint64_t v = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+        counts_[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (v > max && !max_.compare_exchange_weak(
+                              max, v, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /// Reads all the counts (each one atomically, not all of them at once).
+    void read(Snapshot& s) const
+    {
+        for (std::size_t i = 0; i < kNumBuckets; i++)
+            s.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+
+    /// Largest value recorded since the previous call, and resets it.
+    uint64_t takeMax() { return max_.exchange(0, std::memory_order_relaxed); }
+
+    /// Bucket of value v.
+    static std::size_t bucketOf(uint64_t v)
+    {
+        if (v < (1u << kSubBits)) return static_cast<std::size_t>(v);
+
+        const int e = 63 - __builtin_clzll(v);  // 2^e <= v < 2^(e+1)
+        if (e >= kMaxBits) return kNumBuckets - 1;
+        const uint64_t sub = (v >> (e - kSubBits)) & ((1u << kSubBits) - 1);
+        return ((e - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    /// Middle of the range of values of bucket i.
+    static double bucketValue(std::size_t i)
+    {
+        if (i < (1u << kSubBits)) return static_cast<double>(i);
+
+        const int      e   = static_cast<int>(i >> kSubBits) + kSubBits - 1;
+        const uint64_t sub = i & ((1u << kSubBits) - 1);
+        const uint64_t lo  = ((1ull << kSubBits) + sub) << (e - kSubBits);
+        return lo + 0.5 * (1ull << (e - kSubBits));
+    }
+
+    /** Count, and the values at quantiles q[0..n) (in [0, 1]), of the values
+     * recorded between the snapshots older and newer.
+     */
+    static uint64_t quantiles(
+        const Snapshot& older, const Snapshot& newer, const double* q,
+        std::size_t n, double* values)
+    {
+        uint64_t total = 0;
+        for (std::size_t i = 0; i < kNumBuckets; i++)
+            total += newer.counts[i] - older.counts[i];
+
+        for (std::size_t k = 0; k < n; k++)
+        {
+            values[k] = 0;
+            if (total == 0) continue;
+
+            // Rank of the quantile, 1-based:
+            const auto rank = static_cast<uint64_t>(q[k] * (total - 1)) + 1;
+            uint64_t   seen = 0;
+            for (std::size_t i = 0; i < kNumBuckets; i++)
+            {
+                seen += newer.counts[i] - older.counts[i];
+                if (seen >= rank)
+                {
+                    values[k] = bucketValue(i);
+                    break;
+                }
+            }
+        }
+        return total;
+    }
+
+   private:
+    std::array<std::atomic<uint64_t>, kNumBuckets> counts_ = {};
+    std::atomic<uint64_t>                          max_{0};
+};
@@ -0,0 +1,100 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Raw stream capture files (.ljraw): validated StreamData reads, exactly as
+ * received from the U3, plus everything needed to decode them again.
+ *
+ * Layout (all integers little-endian, as the host writing them):
+ *
+ *   RawStreamFileHeader, padded to kRawStreamHeaderSize bytes
+ *   chunk 0, chunk 1, ... : chunkSize bytes each, at
+ *                           kRawStreamHeaderSize + k * chunkSize
+ *
+ * Each chunk starts with a RawStreamChunkHeader, followed by records:
+ *
+ *   RawStreamRecordHeader
+ *   numPackets * packetSize bytes of StreamData responses
+ *   padding to a multiple of 8 bytes
+ *
+ * The chunk headers (first and last record times, first read index) are the
+ * time index of the file: a chunk can be found by time with a binary search,
+ * without reading the records.
+ */
+
+constexpr char kRawStreamMagic[8] = {'L', 'J', 'U', '3', 'R', 'A', 'W', 0};
+constexpr char kRawStreamChunkMagic[4] = {'L', 'J', 'C', 'K'};
+constexpr uint32_t kRawStreamVersion       = 1;
+constexpr uint32_t kRawStreamHeaderSize    = 4096;
+constexpr int      kRawStreamMaxChannels   = 25;
+
+struct RawStreamFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t chunkSize;
+    uint64_t numChunks;  // Set when the file is closed, 0 if it was not
+
+    // Device and its calibration:
+    uint32_t serialNumber;
+    int32_t  localID;
+    double   hardwareVersion;
+    int32_t  highVoltage;
+    int32_t  dac1Enabled;
+    double   ccConstants[20];
+
+    // Stream configuration (StreamConfig command):
+    uint32_t numChannels;
+    uint32_t samplesPerPacket;
+    uint8_t  positiveChannels[kRawStreamMaxChannels];
+    uint8_t  negativeChannels[kRawStreamMaxChannels];
+    uint8_t  scanConfig;  // Resolution and clock bits
+    uint8_t  reserved;
+    uint16_t scanInterval;
+    double   scanRate;  // [Hz]
+
+    // Calibration of each channel, as used by the live decoder:
+    float calibSlope[kRawStreamMaxChannels];
+    float calibOffset[kRawStreamMaxChannels];
+
+    int64_t startSystemTimeNs;  // Wall clock at the start of the capture
+    int64_t startSteadyTimeNs;  // Host steady clock, same instant
+};
+static_assert(sizeof(RawStreamFileHeader) <= kRawStreamHeaderSize);
+
+struct RawStreamChunkHeader
+{
+    char     magic[4];
+    uint32_t numRecords;
+    uint64_t chunkIndex;
+    uint64_t bytesUsed;  // Including this header
+    uint64_t firstReadIndex;
+    int64_t  firstTimeNs;  // hostTimeNs of the first and last records
+    int64_t  lastTimeNs;
+};
+static_assert(sizeof(RawStreamChunkHeader) % 8 == 0);
+
+struct RawStreamRecordHeader
+{
+    int64_t  hostTimeNs;  // USB completion, host steady clock
+    uint64_t readIndex;  // Counts all stream reads, including lost ones
+    uint32_t numPackets;
+    uint32_t packetSize;
+};
+static_assert(sizeof(RawStreamRecordHeader) % 8 == 0);
+
+/// Bytes taken by a record of numPackets StreamData responses.
+constexpr std::size_t rawStreamRecordSize(int numPackets, int packetSize)
+{
+    return (sizeof(RawStreamRecordHeader) +
+            static_cast<std::size_t>(numPackets) * packetSize + 7) &
+           ~std::size_t(7);
+}
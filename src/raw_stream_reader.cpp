@@ -0,0 +1,179 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "raw_stream_reader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+RawStreamReader::RawStreamReader(const std::string& path) : path_(path)
+{
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+        throw std::runtime_error(
+            "RawStreamReader: cannot open " + path + ": " +
+            std::strerror(errno));
+
+    struct stat st;
+    if (::fstat(fd_, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < kRawStreamHeaderSize)
+    {
+        close();
+        throw std::runtime_error(
+            "RawStreamReader: " + path + " is not a raw stream capture");
+    }
+    mapSize_ = static_cast<std::size_t>(st.st_size);
+
+    void* p = ::mmap(nullptr, mapSize_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+    {
+        const int err = errno;
+        close();
+        throw std::runtime_error(
+            "RawStreamReader: cannot map " + path + ": " +
+            std::strerror(err));
+    }
+    map_ = static_cast<const uint8_t*>(p);
+    ::madvise(p, mapSize_, MADV_SEQUENTIAL);
+
+    header_ = reinterpret_cast<const RawStreamFileHeader*>(map_);
+
+    const RawStreamFileHeader& h = *header_;
+    if (std::memcmp(h.magic, kRawStreamMagic, sizeof(h.magic)) != 0 ||
+        h.version != kRawStreamVersion || h.headerSize < sizeof(h) ||
+        h.chunkSize < sizeof(RawStreamChunkHeader) || h.numChannels < 1 ||
+        h.numChannels > kRawStreamMaxChannels || h.samplesPerPacket < 1 ||
+        h.samplesPerPacket > 25)
+    {
+        close();
+        throw std::runtime_error(
+            "RawStreamReader: " + path +
+            " is not a raw stream capture, or has an unsupported version");
+    }
+    packetSize_ = 14 + 2 * h.samplesPerPacket;
+
+    // numChunks is only set when the file is closed. Otherwise (or if the
+    // file was truncated) keep the chunks that are complete and valid:
+    const uint64_t chunksInFile = (mapSize_ - h.headerSize) / h.chunkSize;
+    const uint64_t maxChunks =
+        h.numChunks ? std::min(h.numChunks, chunksInFile) : chunksInFile;
+    while (numChunks_ < maxChunks)
+    {
+        const RawStreamChunkHeader& c = chunk(numChunks_);
+        if (std::memcmp(c.magic, kRawStreamChunkMagic, 4) != 0 ||
+            c.chunkIndex != numChunks_ || c.numRecords == 0 ||
+            c.bytesUsed > h.chunkSize)
+            break;
+        numChunks_++;
+    }
+
+    rewind();
+}
+
+RawStreamReader::~RawStreamReader() { close(); }
+
+void RawStreamReader::close()
+{
+    if (map_) ::munmap(const_cast<uint8_t*>(map_), mapSize_);
+    if (fd_ >= 0) ::close(fd_);
+    map_ = nullptr;
+    fd_  = -1;
+}
+
+int64_t RawStreamReader::firstTimeNs() const
+{
+    return numChunks_ ? chunk(0).firstTimeNs : 0;
+}
+
+int64_t RawStreamReader::lastTimeNs() const
+{
+    return numChunks_ ? chunk(numChunks_ - 1).lastTimeNs : 0;
+}
+
+void RawStreamReader::seekChunk(uint64_t index)
+{
+    chunkIndex_  = index;
+    chunkOffset_ = sizeof(RawStreamChunkHeader);
+    recordIndex_ = 0;
+}
+
+bool RawStreamReader::next(Record& record)
+{
+    while (chunkIndex_ < numChunks_)
+    {
+        const uint8_t*              data = chunkData(chunkIndex_);
+        const RawStreamChunkHeader& c    = chunk(chunkIndex_);
+
+        if (recordIndex_ >= c.numRecords)
+        {
+            seekChunk(chunkIndex_ + 1);
+            continue;
+        }
+
+        if (chunkOffset_ + sizeof(RawStreamRecordHeader) > c.bytesUsed)
+            break;
+
+        const auto* h = reinterpret_cast<const RawStreamRecordHeader*>(
+            data + chunkOffset_);
+        const std::size_t size = rawStreamRecordSize(
+            static_cast<int>(h->numPackets), static_cast<int>(h->packetSize));
+        if (h->packetSize != packetSize_ || h->numPackets == 0 ||
+            chunkOffset_ + size > c.bytesUsed)
+            break;
+
+        record.header  = h;
+        record.packets = data + chunkOffset_ + sizeof(RawStreamRecordHeader);
+        chunkOffset_ += size;
+        recordIndex_++;
+        return true;
+    }
+
+    if (chunkIndex_ < numChunks_)
+        throw std::runtime_error(
+            "RawStreamReader: corrupted record in chunk " +
+            std::to_string(chunkIndex_) + " of " + path_);
+    return false;
+}
+
+void RawStreamReader::seek(int64_t timeNs)
+{
+    // First chunk whose last record is not older than timeNs:
+    uint64_t lo = 0, hi = numChunks_;
+    while (lo < hi)
+    {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (chunk(mid).lastTimeNs < timeNs)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    seekChunk(lo);
+
+    // Then, the record within that chunk:
+    const uint64_t startChunk = lo;
+    std::size_t    offset     = chunkOffset_;
+    uint32_t       index      = 0;
+    Record         r;
+    while (chunkIndex_ == startChunk && next(r))
+    {
+        if (r.header->hostTimeNs >= timeNs)
+        {
+            chunkIndex_  = startChunk;
+            chunkOffset_ = offset;
+            recordIndex_ = index;
+            return;
+        }
+        offset = chunkOffset_;
+        index  = recordIndex_;
+    }
+}
@@ -0,0 +1,88 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "raw_stream_format.h"
+
+/** Reads a raw stream capture file (see raw_stream_format.h), as written by
+ * RawStreamRecorder.
+ *
+ * The whole file is memory-mapped read-only, so records are returned in
+ * place, without copies. Files that were not closed cleanly (e.g. the node
+ * was killed) are read up to their last valid chunk.
+ */
+class RawStreamReader
+{
+   public:
+    /// One read of StreamData responses, pointing into the mapped file.
+    struct Record
+    {
+        const RawStreamRecordHeader* header  = nullptr;
+        const uint8_t*               packets = nullptr;
+    };
+
+    /// Opens and validates the file. Throws std::runtime_error on errors.
+    explicit RawStreamReader(const std::string& path);
+    ~RawStreamReader();
+
+    RawStreamReader(const RawStreamReader&)            = delete;
+    RawStreamReader& operator=(const RawStreamReader&) = delete;
+
+    const RawStreamFileHeader& header() const { return *header_; }
+    const std::string&         path() const { return path_; }
+
+    /// Number of chunks with records.
+    uint64_t numChunks() const { return numChunks_; }
+
+    const RawStreamChunkHeader& chunk(uint64_t index) const
+    {
+        return *reinterpret_cast<const RawStreamChunkHeader*>(
+            chunkData(index));
+    }
+
+    /// First and last record times in the file (host steady clock, ns).
+    int64_t firstTimeNs() const;
+    int64_t lastTimeNs() const;
+
+    /** Returns the next record, in file order, or false at the end of the
+     * file. Throws std::runtime_error on corrupted records.
+     */
+    bool next(Record& record);
+
+    /// Moves to the first record with hostTimeNs >= timeNs, using the chunk
+    /// headers as time index.
+    void seek(int64_t timeNs);
+
+    /// Moves back to the first record.
+    void rewind() { seekChunk(0); }
+
+   private:
+    std::string                path_;
+    int                        fd_      = -1;
+    const uint8_t*             map_     = nullptr;
+    std::size_t                mapSize_ = 0;
+    const RawStreamFileHeader* header_  = nullptr;
+    uint64_t                   numChunks_  = 0;
+    std::size_t                packetSize_ = 0;
+
+    // Position of next():
+    uint64_t    chunkIndex_  = 0;
+    std::size_t chunkOffset_ = 0;  // Within the chunk
+    uint32_t    recordIndex_ = 0;  // Within the chunk
+
+    const uint8_t* chunkData(uint64_t index) const
+    {
+        return map_ + header_->headerSize + index * header_->chunkSize;
+    }
+
+    void seekChunk(uint64_t index);
+    void close();
+};
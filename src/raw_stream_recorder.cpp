@@ -0,0 +1,219 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "raw_stream_recorder.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+RawStreamRecorder::RawStreamRecorder(
+    const std::string& path, const RawStreamFileHeader& header,
+    std::size_t chunkSize, int preallocateChunks)
+    : path_(path),
+      chunkSize_(((std::max<std::size_t>(chunkSize, 1) + (1 << 20) - 1) >> 20)
+                 << 20),
+      preallocateChunks_(std::max(1, preallocateChunks)),
+      packetSize_(14 + 2 * static_cast<int>(header.samplesPerPacket))
+{
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        throw std::runtime_error(
+            "RawStreamRecorder: cannot create " + path + ": " +
+            std::strerror(errno));
+
+    uint8_t headerBlock[kRawStreamHeaderSize] = {};
+    RawStreamFileHeader h = header;
+    std::memcpy(h.magic, kRawStreamMagic, sizeof(h.magic));
+    h.version    = kRawStreamVersion;
+    h.headerSize = kRawStreamHeaderSize;
+    h.chunkSize  = chunkSize_;
+    h.numChunks  = 0;
+    std::memcpy(headerBlock, &h, sizeof(h));
+
+    if (::pwrite(fd_, headerBlock, sizeof(headerBlock), 0) !=
+        static_cast<ssize_t>(sizeof(headerBlock)))
+    {
+        const int err = errno;
+        ::close(fd_);
+        throw std::runtime_error(
+            "RawStreamRecorder: cannot write " + path + ": " +
+            std::strerror(err));
+    }
+    fileSize_ = kRawStreamHeaderSize;
+
+    if (!mapChunk(0))
+    {
+        const int err = errno;
+        ::close(fd_);
+        throw std::runtime_error(
+            "RawStreamRecorder: cannot preallocate " + path + ": " +
+            std::strerror(err));
+    }
+
+    writer_ = std::thread(&RawStreamRecorder::writerThread, this);
+}
+
+RawStreamRecorder::~RawStreamRecorder()
+{
+    stop_ = true;
+    if (writer_.joinable()) writer_.join();
+}
+
+bool RawStreamRecorder::append(
+    int64_t hostTimeNs, uint64_t readIndex, const uint8_t* packets,
+    int numPackets)
+{
+    QueuedRecord* slot = failed_ ? nullptr : queue_.writeSlot();
+    if (!slot || numPackets < 1 || numPackets > kMaxPacketsPerRecord ||
+        packetSize_ > kMaxPacketSize)
+    {
+        dropped_++;
+        return false;
+    }
+
+    slot->header.hostTimeNs = hostTimeNs;
+    slot->header.readIndex  = readIndex;
+    slot->header.numPackets = numPackets;
+    slot->header.packetSize = packetSize_;
+    std::memcpy(slot->data, packets, numPackets * packetSize_);
+    queue_.commitWrite();
+    return true;
+}
+
+// Maps chunk index (growing the file if needed) and initializes its header.
+bool RawStreamRecorder::mapChunk(uint64_t index)
+{
+    const uint64_t offset = kRawStreamHeaderSize + index * chunkSize_;
+
+    if (offset + chunkSize_ > fileSize_)
+    {
+        const uint64_t newSize = offset + preallocateChunks_ * chunkSize_;
+        const int      err =
+            ::posix_fallocate(fd_, fileSize_, newSize - fileSize_);
+        if (err != 0)
+        {
+            errno = err;
+            return false;
+        }
+        fileSize_ = newSize;
+    }
+
+    void* p = ::mmap(
+        nullptr, chunkSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+        static_cast<off_t>(offset));
+    if (p == MAP_FAILED) return false;
+
+    chunk_      = static_cast<uint8_t*>(p);
+    chunkHead_  = reinterpret_cast<RawStreamChunkHeader*>(chunk_);
+    chunkIndex_ = index;
+
+    std::memset(chunkHead_, 0, sizeof(*chunkHead_));
+    std::memcpy(chunkHead_->magic, kRawStreamChunkMagic, 4);
+    chunkHead_->chunkIndex = index;
+    chunkHead_->bytesUsed  = sizeof(RawStreamChunkHeader);
+    return true;
+}
+
+void RawStreamRecorder::unmapChunk()
+{
+    if (!chunk_) return;
+
+    // Start writing back now, rather than all at once on close:
+    ::msync(chunk_, chunkSize_, MS_ASYNC);
+    ::munmap(chunk_, chunkSize_);
+    chunk_     = nullptr;
+    chunkHead_ = nullptr;
+}
+
+void RawStreamRecorder::writeRecord(const QueuedRecord& record)
+{
+    const RawStreamRecordHeader& h = record.header;
+    const std::size_t            size =
+        rawStreamRecordSize(h.numPackets, h.packetSize);
+
+    if (size > chunkSize_ - sizeof(RawStreamChunkHeader))
+    {
+        dropped_++;  // Can only happen with tiny chunks
+        return;
+    }
+
+    if (chunkHead_->bytesUsed + size > chunkSize_)
+    {
+        unmapChunk();
+        if (!mapChunk(chunkIndex_ + 1))
+        {
+            failed_ = true;
+            dropped_++;
+            return;
+        }
+    }
+
+    uint8_t* dst = chunk_ + chunkHead_->bytesUsed;
+    std::memcpy(dst, &h, sizeof(h));
+    std::memcpy(
+        dst + sizeof(h), record.data,
+        static_cast<std::size_t>(h.numPackets) * h.packetSize);
+    std::memset(
+        dst + sizeof(h) + h.numPackets * h.packetSize, 0,
+        size - sizeof(h) - h.numPackets * h.packetSize);
+
+    if (chunkHead_->numRecords == 0)
+    {
+        chunkHead_->firstReadIndex = h.readIndex;
+        chunkHead_->firstTimeNs    = h.hostTimeNs;
+        numChunks_                 = chunkIndex_ + 1;
+    }
+    chunkHead_->lastTimeNs = h.hostTimeNs;
+    chunkHead_->bytesUsed += size;
+    chunkHead_->numRecords++;
+    written_++;
+}
+
+void RawStreamRecorder::writerThread()
+{
+    for (;;)
+    {
+        const bool stopping = stop_;
+
+        while (const QueuedRecord* record = queue_.front())
+        {
+            if (!failed_) writeRecord(*record);
+            queue_.pop();
+        }
+
+        if (stopping) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    finish();
+}
+
+// Drops the preallocated chunks left unused, and completes the header.
+void RawStreamRecorder::finish()
+{
+    unmapChunk();
+
+    const uint64_t numChunks = std::max<uint64_t>(numChunks_, 1);
+    if (::ftruncate(fd_, kRawStreamHeaderSize + numChunks * chunkSize_) != 0)
+        failed_ = true;
+
+    if (::pwrite(
+            fd_, &numChunks, sizeof(numChunks),
+            offsetof(RawStreamFileHeader, numChunks)) !=
+        static_cast<ssize_t>(sizeof(numChunks)))
+        failed_ = true;
+
+    ::fdatasync(fd_);
+    ::close(fd_);
+    fd_ = -1;
+}
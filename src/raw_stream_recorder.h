@@ -0,0 +1,102 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "raw_stream_format.h"
+#include "spsc_ring_buffer.h"
+
+/** Records validated StreamData reads to a raw stream capture file (see
+ * raw_stream_format.h), losslessly and at full rate.
+ *
+ * append() only copies the read into a lock-free ring buffer, so the
+ * acquisition never blocks on disk I/O. A writer thread moves the records
+ * into the file, which is preallocated and memory-mapped one chunk at a
+ * time.
+ */
+class RawStreamRecorder
+{
+   public:
+    /// Largest read accepted by append().
+    static constexpr int kMaxPacketsPerRecord = 25;
+    static constexpr int kMaxPacketSize       = 64;
+
+    /// Records queued between append() and the writer thread.
+    static constexpr std::size_t kQueueCapacity = 512;
+
+    static constexpr std::size_t kDefaultChunkSize = 16 << 20;
+
+    /** Creates (or truncates) the file and writes its header, which must be
+     * filled in except for magic, version, sizes and numChunks. The file
+     * grows preallocateChunks chunks at a time. chunkSize is rounded up to
+     * a multiple of 1 MiB. Throws std::runtime_error on errors.
+     */
+    RawStreamRecorder(
+        const std::string& path, const RawStreamFileHeader& header,
+        std::size_t chunkSize = kDefaultChunkSize, int preallocateChunks = 4);
+
+    /// Writes all queued records and closes the file.
+    ~RawStreamRecorder();
+
+    RawStreamRecorder(const RawStreamRecorder&)            = delete;
+    RawStreamRecorder& operator=(const RawStreamRecorder&) = delete;
+
+    /** Queues one read of numPackets StreamData responses. Must be called
+     * from a single thread. Never blocks.
+     * \return false if the record was dropped: queue full, read too large,
+     *         or the writer failed (e.g. disk full).
+     */
+    bool append(
+        int64_t hostTimeNs, uint64_t readIndex, const uint8_t* packets,
+        int numPackets);
+
+    uint64_t droppedRecords() const { return dropped_; }
+    uint64_t writtenRecords() const { return written_; }
+
+    /// True if writing to the file failed. No more records are written.
+    bool failed() const { return failed_; }
+
+    const std::string& path() const { return path_; }
+
+   private:
+    struct QueuedRecord
+    {
+        RawStreamRecordHeader header;
+        uint8_t               data[kMaxPacketsPerRecord * kMaxPacketSize];
+    };
+
+    std::string path_;
+    int         fd_ = -1;
+    std::size_t chunkSize_;
+    int         preallocateChunks_;
+    int         packetSize_;  // Of a StreamData response
+    uint64_t    fileSize_ = 0;  // Preallocated
+
+    // Owned by the writer thread:
+    uint8_t*              chunk_      = nullptr;  // Mapped current chunk
+    RawStreamChunkHeader* chunkHead_  = nullptr;
+    uint64_t              chunkIndex_ = 0;
+    uint64_t              numChunks_  = 0;  // Chunks with records
+
+    SpscRingBuffer<QueuedRecord, kQueueCapacity> queue_;
+    std::thread                                  writer_;
+    std::atomic_bool                             stop_{false};
+    std::atomic_bool                             failed_{false};
+    std::atomic<uint64_t>                        dropped_{0};
+    std::atomic<uint64_t>                        written_{0};
+
+    void writerThread();
+    void writeRecord(const QueuedRecord& record);
+    bool mapChunk(uint64_t index);
+    void unmapChunk();
+    void finish();
+};
@@ -0,0 +1,104 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "realtime.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+void setThreadRealtime(std::thread& thread, const RealtimeOptions& options)
+{
+    if (!options.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const int cpu : options.cpus) CPU_SET(cpu, &set);
+
+        if (const int err = pthread_setaffinity_np(
+                thread.native_handle(), sizeof(set), &set);
+            err != 0)
+            throw std::runtime_error(
+                "Error: cannot set the CPU affinity: " +
+                std::string(std::strerror(err)));
+    }
+
+    if (options.priority > 0)
+    {
+        sched_param param = {};
+        param.sched_priority = options.priority;
+
+        if (const int err = pthread_setschedparam(
+                thread.native_handle(), SCHED_FIFO, &param);
+            err != 0)
+            throw std::runtime_error(
+                "Error: cannot set SCHED_FIFO priority " +
+                std::to_string(options.priority) + ": " +
+                std::string(std::strerror(err)) +
+                " (needs CAP_SYS_NICE or an rtprio limit)");
+    }
+}
+
+void lockProcessMemory()
+{
+    // Keep freed heap memory, and serve large blocks from it too:
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        throw std::runtime_error(
+            "Error: mlockall failed: " + std::string(std::strerror(errno)) +
+            " (needs CAP_IPC_LOCK or a larger memlock limit)");
+}
+
+WakeupLatency measureWakeupLatency(double duration, double period)
+{
+    const long periodNs = static_cast<long>(period * 1e9);
+    const auto numWakeups =
+        static_cast<std::size_t>(std::max(1.0, duration / period));
+
+    // Allocated (and so faulted in) before measuring:
+    std::vector<double> latencies(numWakeups);
+
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (std::size_t i = 0; i < numWakeups; i++)
+    {
+        next.tv_nsec += periodNs;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(
+                   CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR)
+        {
+        }
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        latencies[i] = (now.tv_sec - next.tv_sec) * 1e6 +
+                       (now.tv_nsec - next.tv_nsec) * 1e-3;
+    }
+
+    WakeupLatency r;
+    r.numWakeups = numWakeups;
+    for (const double l : latencies) r.mean += l;
+    r.mean /= numWakeups;
+
+    std::sort(latencies.begin(), latencies.end());
+    r.p99 = latencies[std::min(numWakeups - 1, numWakeups * 99 / 100)];
+    r.max = latencies.back();
+    return r;
+}
@@ -0,0 +1,50 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Real-time settings of the acquisition (USB event) thread, resolved from
+// the ROS parameters.
+struct RealtimeOptions
+{
+    int              priority = 0;  // SCHED_FIFO 1-99, 0: normal scheduling
+    std::vector<int> cpus;  // CPU affinity, empty: any CPU
+    bool             lockMemory   = false;  // lockProcessMemory() at start
+    double           latencyProbe = 0;  // [s] of measureWakeupLatency()
+};
+
+/** Sets the SCHED_FIFO priority (if options.priority > 0) and CPU affinity
+ * (if options.cpus is not empty) of thread.
+ * Throws std::runtime_error if they cannot be set, e.g. for lack of
+ * permissions (CAP_SYS_NICE, or an rtprio limit).
+ */
+void setThreadRealtime(std::thread& thread, const RealtimeOptions& options);
+
+/** Locks all the current and future memory of the process in RAM, so it is
+ * faulted in now (including the stacks of threads created later) and never
+ * paged out, and stops malloc from returning freed memory to the system, so
+ * reusing it does not page fault either.
+ * Throws std::runtime_error on errors (e.g. RLIMIT_MEMLOCK).
+ */
+void lockProcessMemory();
+
+// Wakeup latency of a thread, as measured by measureWakeupLatency() [us].
+struct WakeupLatency
+{
+    uint64_t numWakeups = 0;
+    double   mean = 0, p99 = 0, max = 0;
+};
+
+/** Measures how late the calling thread wakes up from absolute-deadline
+ * sleeps, every period seconds for duration seconds, as cyclictest does.
+ * Run it in a thread with the same scheduling as the one of interest.
+ */
+WakeupLatency measureWakeupLatency(double duration, double period = 1e-3);
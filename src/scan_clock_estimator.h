@@ -0,0 +1,124 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/** Online estimator of the host time at which each stream scan was sampled.
+ *
+ * The device samples scan k at t0 + k * T, with T the configured scan
+ * interval, as measured by the device clock. This estimator maps that
+ * nominal device time onto the host steady clock, y = a + b * x, from
+ * (scan index, host receive time) observations, one per USB read:
+ *
+ *  - The clock rate ratio b (drift) is an exponentially weighted least
+ *    squares fit over the last few timeConstant seconds, so it follows
+ *    slow (e.g. thermal) changes of either oscillator.
+ *  - The offset a follows the lower envelope of the observations, i.e. the
+ *    reads with the least transport latency, since USB and scheduling
+ *    delays only ever make data arrive later. It leaks upwards by
+ *    envelopeLeak seconds per second, so it recovers from any outlier.
+ *
+ * All state is kept relative to the latest observation, so precision does
+ * not degrade over hours of streaming.
+ */
+class ScanClockEstimator
+{
+   public:
+    /** \param scanPeriod   Nominal scan interval [s].
+     *  \param timeConstant Averaging window of the drift estimate [s].
+     *  \param envelopeLeak Upwards leak of the offset estimate [s/s].
+     */
+    explicit ScanClockEstimator(
+        double scanPeriod = 1e-3, double timeConstant = 300.0,
+        double envelopeLeak = 1e-7)
+        : scanPeriod_(scanPeriod),
+          timeConstant_(timeConstant),
+          envelopeLeak_(envelopeLeak)
+    {
+    }
+
+    void reset(double scanPeriod)
+    {
+        *this = ScanClockEstimator(scanPeriod, timeConstant_, envelopeLeak_);
+    }
+
+    /// Adds one observation: scan scanIndex was received by the host at
+    /// hostTimeNs (steady clock). Scan indices must not decrease.
+    void addObservation(uint64_t scanIndex, int64_t hostTimeNs)
+    {
+        if (numObservations_++ == 0)
+        {
+            firstIndex_ = scanIndex;
+            refIndex_   = scanIndex;
+            refTime_    = hostTimeNs;
+            return;
+        }
+
+        // Move the reference to this observation:
+        const double dx = (scanIndex - refIndex_) * scanPeriod_;
+        const double dy = (hostTimeNs - refTime_) * 1e-9;
+        refIndex_       = scanIndex;
+        refTime_        = hostTimeNs;
+
+        sxy_ += -dx * sy_ - dy * sx_ + dx * dy * sw_;
+        sxx_ += -2 * dx * sx_ + dx * dx * sw_;
+        sx_ -= dx * sw_;
+        sy_ -= dy * sw_;
+
+        // Lower envelope, relative to this observation (which is at 0):
+        offset_ =
+            std::min(offset_ + rate_ * dx - dy + envelopeLeak_ * dx, 0.0);
+
+        // Forget old observations, then add this one (at x=y=0):
+        const double forget = std::exp(-dx / timeConstant_);
+        sw_                 = sw_ * forget + 1.0;
+        sx_ *= forget;
+        sy_ *= forget;
+        sxx_ *= forget;
+        sxy_ *= forget;
+
+        const double varX = sxx_ * sw_ - sx_ * sx_;
+        if (varX > 0 && (scanIndex - firstIndex_) * scanPeriod_ >= minSpan_)
+            rate_ = (sxy_ * sw_ - sx_ * sy_) / varX;
+    }
+
+    /// Estimated host steady clock time at which scan scanIndex was sampled.
+    int64_t scanTimeNs(uint64_t scanIndex) const
+    {
+        const double x =
+            (static_cast<double>(scanIndex) - static_cast<double>(refIndex_)) *
+            scanPeriod_;
+        return refTime_ + std::llround((offset_ + rate_ * x) * 1e9);
+    }
+
+    /// Estimated scan period [s], in host clock units.
+    double scanPeriod() const { return rate_ * scanPeriod_; }
+
+    /// Device clock drift vs. the host clock, in parts per million.
+    double driftPpm() const { return (rate_ - 1.0) * 1e6; }
+
+    uint64_t numObservations() const { return numObservations_; }
+
+   private:
+    double scanPeriod_, timeConstant_, envelopeLeak_;
+
+    // Don't trust the drift estimate until observations span this [s]:
+    static constexpr double minSpan_ = 1.0;
+
+    uint64_t numObservations_ = 0;
+    uint64_t firstIndex_      = 0;
+    uint64_t refIndex_        = 0;  // Latest observation
+    int64_t  refTime_         = 0;
+    double   rate_            = 1.0;  // Host seconds per device second
+    double   offset_          = 0.0;  // Envelope at refIndex_, from refTime_
+
+    // Exponentially weighted sums, relative to the latest observation:
+    double sw_ = 0, sx_ = 0, sy_ = 0, sxx_ = 0, sxy_ = 0;
+};
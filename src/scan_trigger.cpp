@@ -0,0 +1,165 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "scan_trigger.h"
+
+#include <stdexcept>
+
+bool parseTriggerCondition(const std::string& s, TriggerCondition& cond)
+{
+    if (s == "rising")
+        cond = TriggerCondition::Rising;
+    else if (s == "falling")
+        cond = TriggerCondition::Falling;
+    else if (s == "above")
+        cond = TriggerCondition::Above;
+    else if (s == "below")
+        cond = TriggerCondition::Below;
+    else
+        return false;
+    return true;
+}
+
+const char* triggerConditionName(TriggerCondition cond)
+{
+    switch (cond)
+    {
+        case TriggerCondition::Rising:
+            return "rising";
+        case TriggerCondition::Falling:
+            return "falling";
+        case TriggerCondition::Above:
+            return "above";
+        case TriggerCondition::Below:
+            return "below";
+    }
+    return "";
+}
+
+void ScanTrigger::configure(int numChannels, const TriggerOptions& options)
+{
+    if (numChannels < 1 || options.preScans < 0 || options.postScans < 0)
+        throw std::invalid_argument("ScanTrigger: invalid channels or scans");
+    for (const TriggerChannel& t : options.channels)
+        if (t.channel < 0 || t.channel >= numChannels || !(t.hysteresis >= 0))
+            throw std::invalid_argument(
+                "ScanTrigger: trigger channel " + std::to_string(t.channel) +
+                " out of range, or negative hysteresis");
+
+    numChannels_ = numChannels;
+    options_     = options;
+
+    // Level conditions start armed, edges once seen on the other side:
+    armed_.resize(options.channels.size());
+    for (std::size_t k = 0; k < armed_.size(); k++)
+        armed_[k] = options.channels[k].condition == TriggerCondition::Above ||
+                    options.channels[k].condition == TriggerCondition::Below;
+
+    preData_.assign(options.preScans * numChannels, 0.0f);
+    preIndices_.assign(options.preScans, 0);
+    preHead_   = 0;
+    preCount_  = 0;
+    capturing_ = false;
+}
+
+// Updates the state of every trigger channel with one scan. Returns the
+// first one that fired, or -1.
+int ScanTrigger::evaluate(
+    const float* in, std::size_t inStride, std::size_t scan)
+{
+    int fired = -1;
+    for (std::size_t k = 0; k < armed_.size(); k++)
+    {
+        const TriggerChannel& t = options_.channels[k];
+        const float           x = in[t.channel * inStride + scan];
+
+        bool hit, rearm;
+        if (t.condition == TriggerCondition::Rising ||
+            t.condition == TriggerCondition::Above)
+        {
+            hit   = x >= t.level;
+            rearm = x < t.level - t.hysteresis;
+        }
+        else
+        {
+            hit   = x <= t.level;
+            rearm = x > t.level + t.hysteresis;
+        }
+
+        if (armed_[k] && hit)
+        {
+            armed_[k] = false;
+            if (fired < 0) fired = static_cast<int>(k);
+        }
+        else if (!armed_[k] && rearm)
+            armed_[k] = true;
+    }
+    return fired;
+}
+
+// Starts capturing an event with the scans in the pre-trigger ring buffer,
+// oldest first.
+void ScanTrigger::startEvent(int source, uint64_t triggerIndex)
+{
+    const std::size_t total =
+        preCount_ + 1 + static_cast<std::size_t>(options_.postScans);
+
+    event_.triggerIndex = triggerIndex;
+    event_.source       = source;
+    event_.preScans     = static_cast<uint32_t>(preCount_);
+    event_.scanIndices.clear();
+    event_.scanIndices.reserve(total);
+    event_.data.clear();
+    event_.data.reserve(total * numChannels_);
+
+    const std::size_t cap = preIndices_.size();
+    for (std::size_t i = 0; i < preCount_; i++)
+    {
+        const std::size_t j = (preHead_ + cap - preCount_ + i) % cap;
+        event_.scanIndices.push_back(preIndices_[j]);
+        event_.data.insert(
+            event_.data.end(), preData_.begin() + j * numChannels_,
+            preData_.begin() + (j + 1) * numChannels_);
+    }
+    capturing_ = true;
+}
+
+void ScanTrigger::process(
+    const float* in, std::size_t inStride, const uint64_t* scanIndices,
+    std::size_t numScans, std::vector<TriggerEvent>& completed)
+{
+    if (armed_.empty()) return;
+
+    const std::size_t cap = preIndices_.size();
+    for (std::size_t s = 0; s < numScans; s++)
+    {
+        const int source = evaluate(in, inStride, s);
+        if (source >= 0 && !capturing_) startEvent(source, scanIndices[s]);
+
+        if (capturing_)
+        {
+            event_.scanIndices.push_back(scanIndices[s]);
+            for (int c = 0; c < numChannels_; c++)
+                event_.data.push_back(in[c * inStride + s]);
+
+            if (event_.scanIndices.size() ==
+                event_.preScans + 1 +
+                    static_cast<std::size_t>(options_.postScans))
+            {
+                completed.push_back(std::move(event_));
+                capturing_ = false;
+            }
+        }
+
+        // Keep the last scans for the pre-trigger part of the next event:
+        if (cap == 0) continue;
+        preIndices_[preHead_] = scanIndices[s];
+        for (int c = 0; c < numChannels_; c++)
+            preData_[preHead_ * numChannels_ + c] = in[c * inStride + s];
+        preHead_ = (preHead_ + 1) % cap;
+        if (preCount_ < cap) preCount_++;
+    }
+}
@@ -0,0 +1,107 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Condition of one trigger channel vs. its level.
+enum class TriggerCondition
+{
+    Rising,  // Edge: crosses the level upwards
+    Falling,  // Edge: crosses the level downwards
+    Above,  // Level: at or above the level
+    Below  // Level: at or below the level
+};
+
+/// Parses "rising", "falling", "above" or "below". Returns false if s is
+/// none of them.
+bool parseTriggerCondition(const std::string& s, TriggerCondition& cond);
+
+/// Name of a condition, as parsed by parseTriggerCondition().
+const char* triggerConditionName(TriggerCondition cond);
+
+// One channel condition of the trigger.
+struct TriggerChannel
+{
+    int              channel    = 0;  // Index in the scan list
+    TriggerCondition condition  = TriggerCondition::Rising;
+    float            level      = 0;  // [V]
+    float            hysteresis = 0;  // [V], >= 0
+};
+
+// Trigger settings, resolved from the ROS parameters.
+struct TriggerOptions
+{
+    std::vector<TriggerChannel> channels;  // Any of them fires. Empty: off
+    int                         preScans  = 100;  // Before the trigger scan
+    int                         postScans = 400;  // After the trigger scan
+};
+
+/// One captured event: the scan that fired the trigger, with the scans
+/// received before and after it.
+struct TriggerEvent
+{
+    uint64_t              triggerIndex;  // Stream-wide index of that scan
+    int                   source;  // Index in TriggerOptions::channels
+    uint32_t              preScans;  // Scans before it, <= preScans option
+    std::vector<uint64_t> scanIndices;
+    std::vector<float>    data;  // Row-major, [scan * numChannels + channel]
+};
+
+/** Threshold trigger with pre- and post-trigger capture, evaluated on every
+ * scan of the planar, full-rate output of StreamDecoder.
+ *
+ * Each trigger channel is armed and fires with hysteresis: a rising edge
+ * fires when the channel reaches the level, and is only armed again once
+ * it has fallen to level - hysteresis (falling edges, the other way
+ * round). Edge conditions must see the channel on the other side of the
+ * band first, level conditions start armed. Conditions keep being tracked
+ * while an event is being captured, but events do not overlap: the trigger
+ * does not fire until the previous one is complete.
+ *
+ * The last preScans scans are kept in a ring buffer, so capturing an event
+ * only copies them once, when it fires.
+ */
+class ScanTrigger
+{
+   public:
+    /** Sets up the trigger for numChannels channels, and resets it.
+     * Throws std::invalid_argument if a trigger channel is out of range.
+     */
+    void configure(int numChannels, const TriggerOptions& options);
+
+    int                   numChannels() const { return numChannels_; }
+    const TriggerOptions& options() const { return options_; }
+
+    /** Processes numScans scans, in[channel * inStride + scan], with
+     * stream-wide indices scanIndices[scan] (increasing). Appends the
+     * events completed by them to completed.
+     */
+    void process(
+        const float* in, std::size_t inStride, const uint64_t* scanIndices,
+        std::size_t numScans, std::vector<TriggerEvent>& completed);
+
+   private:
+    int                  numChannels_ = 0;
+    TriggerOptions       options_;
+    std::vector<uint8_t> armed_;  // Per trigger channel
+
+    // Last preScans scans, row-major:
+    std::vector<float>    preData_;
+    std::vector<uint64_t> preIndices_;
+    std::size_t           preHead_  = 0;  // Next slot to write
+    std::size_t           preCount_ = 0;
+
+    TriggerEvent event_;  // Being captured
+    bool         capturing_ = false;
+
+    int  evaluate(const float* in, std::size_t inStride, std::size_t scan);
+    void startEvent(int source, uint64_t triggerIndex);
+};
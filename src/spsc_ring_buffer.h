@@ -0,0 +1,102 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+/** Lock-free, wait-free, single-producer single-consumer ring buffer of
+ * fixed-size slots.
+ *
+ * Slots are written and read in place (no copies), so T may be a large
+ * plain buffer, e.g. one USB StreamData read. Exactly one thread may call
+ * the producer methods (writeSlot/commitWrite) and exactly one thread the
+ * consumer methods (front/pop).
+ *
+ * Capacity must be a power of two. All storage lives inside the object: no
+ * heap allocations happen after construction.
+ */
+template <typename T, std::size_t Capacity>
+class SpscRingBuffer
+{
+    static_assert(
+        Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+        "Capacity must be a power of two");
+
+   public:
+    SpscRingBuffer() = default;
+
+    SpscRingBuffer(const SpscRingBuffer&)            = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+    /// Producer: returns the next free slot to fill in, or nullptr if the
+    /// buffer is full. The slot is not visible to the consumer until
+    /// commitWrite() is called.
+    T* writeSlot()
+    {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tailCache_ == Capacity)
+        {
+            tailCache_ = tail_.load(std::memory_order_acquire);
+            if (head - tailCache_ == Capacity) return nullptr;
+        }
+        return &slots_[head & kMask];
+    }
+
+    /// Producer: publishes the slot returned by the last writeSlot().
+    void commitWrite()
+    {
+        head_.store(
+            head_.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+    }
+
+    /// Consumer: returns the oldest filled slot, or nullptr if empty.
+    const T* front()
+    {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == headCache_)
+        {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (tail == headCache_) return nullptr;
+        }
+        return &slots_[tail & kMask];
+    }
+
+    /// Consumer: releases the slot returned by the last front().
+    void pop()
+    {
+        tail_.store(
+            tail_.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+    }
+
+    /// Approximate number of filled slots (exact if called from either
+    /// the producer or the consumer thread while the other is idle).
+    std::size_t size() const
+    {
+        return head_.load(std::memory_order_acquire) -
+               tail_.load(std::memory_order_acquire);
+    }
+
+    static constexpr std::size_t capacity() { return Capacity; }
+
+   private:
+    static constexpr std::size_t kMask      = Capacity - 1;
+    static constexpr std::size_t kCacheLine = 64;
+
+    // Producer-owned:
+    alignas(kCacheLine) std::atomic<std::size_t> head_{0};
+    std::size_t tailCache_ = 0;
+
+    // Consumer-owned:
+    alignas(kCacheLine) std::atomic<std::size_t> tail_{0};
+    std::size_t headCache_ = 0;
+
+    alignas(kCacheLine) std::array<T, Capacity> slots_;
+};
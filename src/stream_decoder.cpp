@@ -0,0 +1,284 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "stream_decoder.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define LJ_DECODER_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LJ_DECODER_NEON 1
+#include <arm_neon.h>
+#endif
+
+StreamPacketStatus checkStreamPacket(
+    const uint8_t* packet, int samplesPerPacket)
+{
+    const int size     = streamDataResponseSize(samplesPerPacket);
+    uint8_t*  p        = const_cast<uint8_t*>(packet);
+    uint16_t  checksum = extendedChecksum16(p, size);
+
+    if (static_cast<uint8_t>((checksum / 256) & 0xFF) != packet[5])
+        return StreamPacketStatus::BadChecksum16Msb;
+    if (static_cast<uint8_t>(checksum & 0xFF) != packet[4])
+        return StreamPacketStatus::BadChecksum16Lsb;
+    if (extendedChecksum8(p) != packet[0])
+        return StreamPacketStatus::BadChecksum8;
+    if (packet[1] != 0xF9 || packet[2] != 4 + samplesPerPacket ||
+        packet[3] != 0xC0)
+        return StreamPacketStatus::BadCommandBytes;
+
+    return StreamPacketStatus::Ok;
+}
+
+void gatherStreamSamples(
+    const uint8_t* recBuff, int numPackets, int samplesPerPacket,
+    uint16_t* raw)
+{
+    const int packetSize = streamDataResponseSize(samplesPerPacket);
+
+    for (int m = 0; m < numPackets; m++)
+    {
+        const uint8_t* samples =
+            recBuff + m * packetSize + kStreamDataSamplesOffset;
+        uint16_t* dst = raw + m * samplesPerPacket;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        std::memcpy(dst, samples, samplesPerPacket * sizeof(uint16_t));
+#else
+        for (int k = 0; k < samplesPerPacket; k++)
+            dst[k] = static_cast<uint16_t>(
+                samples[2 * k] | (samples[2 * k + 1] << 8));
+#endif
+    }
+}
+
+namespace
+{
+using CalibrateFn = void (*)(const uint16_t*, std::size_t, float, float, float*);
+
+void calibrateScalar(
+    const uint16_t* raw, std::size_t n, float slope, float offset, float* out)
+{
+    // Note: this file is built with -ffp-contract=off, so this is a
+    // separate mul and add that rounds exactly like the SIMD versions.
+    for (std::size_t i = 0; i < n; i++)
+        out[i] = slope * static_cast<float>(raw[i]) + offset;
+}
+
+#if defined(LJ_DECODER_X86)
+void calibrateSse2(
+    const uint16_t* raw, std::size_t n, float slope, float offset, float* out)
+{
+    const __m128  vs   = _mm_set1_ps(slope);
+    const __m128  vo   = _mm_set1_ps(offset);
+    const __m128i zero = _mm_setzero_si128();
+
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i r =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+        const __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(r, zero));
+        const __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(r, zero));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(lo, vs), vo));
+        _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_mul_ps(hi, vs), vo));
+    }
+    calibrateScalar(raw + i, n - i, slope, offset, out + i);
+}
+
+__attribute__((target("avx2"))) void calibrateAvx2(
+    const uint16_t* raw, std::size_t n, float slope, float offset, float* out)
+{
+    const __m256 vs = _mm256_set1_ps(slope);
+    const __m256 vo = _mm256_set1_ps(offset);
+
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256i r =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw + i));
+        const __m256 lo = _mm256_cvtepi32_ps(
+            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(r)));
+        const __m256 hi = _mm256_cvtepi32_ps(
+            _mm256_cvtepu16_epi32(_mm256_extracti128_si256(r, 1)));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(lo, vs), vo));
+        _mm256_storeu_ps(
+            out + i + 8, _mm256_add_ps(_mm256_mul_ps(hi, vs), vo));
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i r =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+        const __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(r));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(v, vs), vo));
+    }
+    calibrateScalar(raw + i, n - i, slope, offset, out + i);
+}
+#endif
+
+#if defined(LJ_DECODER_NEON)
+void calibrateNeon(
+    const uint16_t* raw, std::size_t n, float slope, float offset, float* out)
+{
+    const float32x4_t vs = vdupq_n_f32(slope);
+    const float32x4_t vo = vdupq_n_f32(offset);
+
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const uint16x8_t  r  = vld1q_u16(raw + i);
+        const float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(r)));
+        const float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(r)));
+        vst1q_f32(out + i, vaddq_f32(vmulq_f32(lo, vs), vo));
+        vst1q_f32(out + i + 4, vaddq_f32(vmulq_f32(hi, vs), vo));
+    }
+    calibrateScalar(raw + i, n - i, slope, offset, out + i);
+}
+#endif
+
+struct CalibrateImpl
+{
+    CalibrateFn fn;
+    const char* name;
+};
+
+CalibrateImpl selectCalibrateImpl()
+{
+#if defined(LJ_DECODER_X86)
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return {&calibrateAvx2, "avx2"};
+#endif
+    return {&calibrateSse2, "sse2"};
+#elif defined(LJ_DECODER_NEON)
+    return {&calibrateNeon, "neon"};
+#else
+    return {&calibrateScalar, "scalar"};
+#endif
+}
+
+const CalibrateImpl& calibrateImpl()
+{
+    static const CalibrateImpl impl = selectCalibrateImpl();
+    return impl;
+}
+}  // namespace
+
+void calibrateSamples(
+    const uint16_t* raw, std::size_t n, const AinCalibration& cal, float* out)
+{
+    calibrateImpl().fn(raw, n, cal.slope, cal.offset, out);
+}
+
+const char* calibrateSamplesImplementation() { return calibrateImpl().name; }
+
+void deinterleaveScans(
+    const uint16_t* raw, std::size_t numScans, int numChannels,
+    uint16_t* planar, std::size_t stride)
+{
+    for (std::size_t s = 0; s < numScans; s++)
+        for (int c = 0; c < numChannels; c++)
+            planar[c * stride + s] = raw[s * numChannels + c];
+}
+
+namespace
+{
+template <int NumChannels>
+std::size_t decodeSpecialized(
+    const uint8_t* recBuff, int numPackets, int samplesPerPacket,
+    int /*numChannels*/, const AinCalibration* calib, uint16_t* scratch,
+    float* out, std::size_t outStride)
+{
+    return decodeStreamPackets<NumChannels>(
+        recBuff, numPackets, samplesPerPacket, calib, scratch, out, outStride);
+}
+
+std::size_t decodeGeneric(
+    const uint8_t* recBuff, int numPackets, int samplesPerPacket,
+    int numChannels, const AinCalibration* calib, uint16_t* scratch,
+    float* out, std::size_t outStride)
+{
+    const std::size_t numSamples =
+        static_cast<std::size_t>(numPackets) * samplesPerPacket;
+    const std::size_t numScans = numSamples / numChannels;
+
+    uint16_t* raw    = scratch;
+    uint16_t* planar = scratch + numSamples;
+
+    gatherStreamSamples(recBuff, numPackets, samplesPerPacket, raw);
+    deinterleaveScans(raw, numScans, numChannels, planar, numScans);
+
+    for (int c = 0; c < numChannels; c++)
+        calibrateSamples(
+            planar + c * numScans, numScans, calib[c], out + c * outStride);
+
+    return numScans;
+}
+}  // namespace
+
+int StreamDecoder::packetsPerReadFor(
+    int numChannels, int samplesPerPacket, int minPackets)
+{
+    // Packets needed for whole scans: numChannels / gcd(numChannels, spp)
+    int a = numChannels, b = samplesPerPacket;
+    while (b != 0)
+    {
+        const int t = a % b;
+        a           = b;
+        b           = t;
+    }
+    const int step = numChannels / a;
+
+    return ((minPackets + step - 1) / step) * step;
+}
+
+void StreamDecoder::configure(
+    const std::vector<AinCalibration>& calib, int samplesPerPacket,
+    int packetsPerRead)
+{
+    calib_            = calib;
+    samplesPerPacket_ = samplesPerPacket;
+    packetsPerRead_   = packetsPerRead;
+
+    const int numSamples = packetsPerRead * samplesPerPacket;
+    scansPerRead_        = numSamples / numChannels();
+    scratch_.assign(2 * numSamples, 0);
+
+    specialized_ = true;
+    switch (numChannels())
+    {
+        case 1:
+            kernel_ = &decodeSpecialized<1>;
+            break;
+        case 2:
+            kernel_ = &decodeSpecialized<2>;
+            break;
+        case 3:
+            kernel_ = &decodeSpecialized<3>;
+            break;
+        case 4:
+            kernel_ = &decodeSpecialized<4>;
+            break;
+        case 5:
+            kernel_ = &decodeSpecialized<5>;
+            break;
+        case 6:
+            kernel_ = &decodeSpecialized<6>;
+            break;
+        case 8:
+            kernel_ = &decodeSpecialized<8>;
+            break;
+        case 16:
+            kernel_ = &decodeSpecialized<16>;
+            break;
+        default:
+            kernel_      = &decodeGeneric;
+            specialized_ = false;
+            break;
+    }
+}
@@ -0,0 +1,208 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "u3.h"
+
+/// Offset of the first sample in a StreamData response.
+constexpr int kStreamDataSamplesOffset = 12;
+
+/// Size of a StreamData response, in bytes.
+constexpr int streamDataResponseSize(int samplesPerPacket)
+{
+    return 14 + samplesPerPacket * 2;
+}
+
+/// Result of checkStreamPacket().
+enum class StreamPacketStatus
+{
+    Ok,
+    BadChecksum16Msb,
+    BadChecksum16Lsb,
+    BadChecksum8,
+    BadCommandBytes
+};
+
+/** Checks the checksums and command bytes of one StreamData response. Its
+ * Errorcode is not checked.
+ */
+StreamPacketStatus checkStreamPacket(
+    const uint8_t* packet, int samplesPerPacket);
+
+/** Linear calibration of one stream channel:
+ *  volts = slope * raw + offset
+ *
+ * Resolved once, at stream configuration time, from the device calibration
+ * constants, so decoding a sample costs a single multiply-add.
+ */
+struct AinCalibration
+{
+    float slope  = 1.0f;
+    float offset = 0.0f;
+
+    float operator()(uint16_t raw) const
+    {
+        return slope * static_cast<float>(raw) + offset;
+    }
+};
+
+/** Builds the calibration for one (positive, negative) stream channel pair.
+ * \return false if the channel pair is not valid for this device.
+ */
+inline bool makeAinCalibration(
+    u3CalibrationInfo& caliInfo, int dac1Enabled, uint8_t positiveChannel,
+    uint8_t negativeChannel, AinCalibration& out)
+{
+    double slope, offset;
+    if (getAinVoltCalibrationLinear(
+            &caliInfo, dac1Enabled, positiveChannel, negativeChannel, &slope,
+            &offset) != 0)
+        return false;
+
+    out.slope  = static_cast<float>(slope);
+    out.offset = static_cast<float>(offset);
+    return true;
+}
+
+/** Copies the little-endian samples of numPackets consecutive StreamData
+ * responses into one contiguous array of numPackets * samplesPerPacket
+ * samples, dropping the per-packet headers and trailers.
+ */
+void gatherStreamSamples(
+    const uint8_t* recBuff, int numPackets, int samplesPerPacket,
+    uint16_t* raw);
+
+/** Converts n raw samples of one channel into calibrated values,
+ * out[i] = cal.slope * raw[i] + cal.offset, in wide SIMD lanes.
+ *
+ * The implementation (AVX2, SSE2, NEON or scalar) is selected once, at
+ * runtime, from the host CPU features. All of them round identically (no
+ * fused multiply-add), so results are bit-exact across implementations.
+ */
+void calibrateSamples(
+    const uint16_t* raw, std::size_t n, const AinCalibration& cal, float* out);
+
+/// Name of the calibrateSamples() implementation in use, e.g. "avx2".
+const char* calibrateSamplesImplementation();
+
+/** Splits interleaved scans (raw[scan * NumChannels + channel]) into one
+ * contiguous array per channel (planar[channel * stride + scan]).
+ */
+template <int NumChannels>
+void deinterleaveScans(
+    const uint16_t* raw, std::size_t numScans, uint16_t* planar,
+    std::size_t stride)
+{
+    for (std::size_t s = 0; s < numScans; s++)
+        for (int c = 0; c < NumChannels; c++)
+            planar[c * stride + s] = raw[s * NumChannels + c];
+}
+
+/** Decodes the samples of numPackets consecutive StreamData responses
+ * (whose headers must have been already validated) into calibrated,
+ * planar per-channel output: out[channel * outStride + scan].
+ *
+ * numPackets * samplesPerPacket must be a multiple of NumChannels, so the
+ * buffer holds whole scans.
+ *
+ * \param calib   Calibration of each channel, NumChannels entries.
+ * \param scratch Working memory, 2 * numPackets * samplesPerPacket entries.
+ * \return The number of decoded scans.
+ */
+template <int NumChannels>
+std::size_t decodeStreamPackets(
+    const uint8_t* recBuff, int numPackets, int samplesPerPacket,
+    const AinCalibration* calib, uint16_t* scratch, float* out,
+    std::size_t outStride)
+{
+    const std::size_t numSamples =
+        static_cast<std::size_t>(numPackets) * samplesPerPacket;
+    const std::size_t numScans = numSamples / NumChannels;
+
+    uint16_t* raw    = scratch;
+    uint16_t* planar = scratch + numSamples;
+
+    gatherStreamSamples(recBuff, numPackets, samplesPerPacket, raw);
+    deinterleaveScans<NumChannels>(raw, numScans, planar, numScans);
+
+    for (int c = 0; c < NumChannels; c++)
+        calibrateSamples(
+            planar + c * numScans, numScans, calib[c], out + c * outStride);
+
+    return numScans;
+}
+
+/** Generic (runtime channel count) version of deinterleaveScans(). */
+void deinterleaveScans(
+    const uint16_t* raw, std::size_t numScans, int numChannels,
+    uint16_t* planar, std::size_t stride);
+
+/** Decoder of StreamData reads for a scan list configured at runtime.
+ *
+ * Common channel counts are dispatched to the decodeStreamPackets<N>
+ * kernel specialized (and constant-folded) for them. Other counts use a
+ * generic kernel, which produces identical results.
+ */
+class StreamDecoder
+{
+   public:
+    /** Smallest number of StreamData responses per read, not less than
+     * minPackets, that holds whole scans of numChannels channels. */
+    static int packetsPerReadFor(
+        int numChannels, int samplesPerPacket, int minPackets);
+
+    /** Sets the scan list calibration (one entry per channel) and read
+     * layout. packetsPerRead * samplesPerPacket must be a multiple of
+     * calib.size(). Allocates all the working memory needed by decode().
+     */
+    void configure(
+        const std::vector<AinCalibration>& calib, int samplesPerPacket,
+        int packetsPerRead);
+
+    int numChannels() const { return static_cast<int>(calib_.size()); }
+    int packetsPerRead() const { return packetsPerRead_; }
+    int scansPerRead() const { return scansPerRead_; }
+
+    /// True if a kernel specialized for numChannels() is in use.
+    bool isSpecialized() const { return specialized_; }
+
+    const std::vector<AinCalibration>& calibration() const { return calib_; }
+
+    /// Raw counts of the scans of the last decode(), row-major:
+    /// [scan * numChannels() + channel].
+    const uint16_t* rawScans() const { return scratch_.data(); }
+
+    /** Decodes one read of packetsPerRead() already validated StreamData
+     * responses into out[channel * outStride + scan].
+     * \return The number of decoded scans, i.e. scansPerRead().
+     */
+    std::size_t decode(
+        const uint8_t* recBuff, float* out, std::size_t outStride)
+    {
+        return kernel_(
+            recBuff, packetsPerRead_, samplesPerPacket_, numChannels(),
+            calib_.data(), scratch_.data(), out, outStride);
+    }
+
+   private:
+    using KernelFn = std::size_t (*)(
+        const uint8_t* recBuff, int numPackets, int samplesPerPacket,
+        int numChannels, const AinCalibration* calib, uint16_t* scratch,
+        float* out, std::size_t outStride);
+
+    std::vector<AinCalibration> calib_;
+    std::vector<uint16_t>       scratch_;
+    int                         samplesPerPacket_ = 0;
+    int                         packetsPerRead_   = 0;
+    int                         scansPerRead_     = 0;
+    bool                        specialized_      = false;
+    KernelFn                    kernel_           = nullptr;
+};
@@ -6,6 +6,22 @@
 #include <stdlib.h>
 
 
+//Last known ConfigIO settings of a U3, kept in the user data of its handle
+//(all zeros, i.e. not valid, when the device is opened).
+typedef struct U3_CONFIGIO_SHADOW {
+    uint8 valid;
+    uint8 timerCounterConfig;
+    uint8 dac1Enable;
+    uint8 fioAnalog;
+    uint8 eioAnalog;
+} u3ConfigIOShadow;
+
+static u3ConfigIOShadow *getConfigIOShadow(HANDLE hDevice)
+{
+    return (u3ConfigIOShadow *)LJUSB_GetUserData(hDevice);
+}
+
+
 u3CalibrationInfo U3_CALIBRATION_INFO_DEFAULT = {
     3,
     1.31,
@@ -497,6 +513,108 @@ long getAinVoltCalibrated_hw130(u3CalibrationInfo *caliInfo, uint8 positiveChann
 }
 
 
+long getAinVoltCalibrationLinear(u3CalibrationInfo *caliInfo, int dacEnabled, uint8 positiveChannel, uint8 negChannel, double *slope, double *offset)
+{
+    int hv;
+
+    if( isCalibrationInfoValid(caliInfo) == 0 )
+        return -1;
+
+    hv = caliInfo->highVoltage;
+
+    if( positiveChannel == 30 )
+    {
+        //Temperature sensor, in Kelvins
+        *slope = caliInfo->ccConstants[8];
+        *offset = 0.0;
+        return 0;
+    }
+
+    if( caliInfo->hardwareVersion < 1.30 )
+    {
+        //Same equations as getAinVoltCalibrated
+        if( negChannel <= 15 || negChannel == 30 )
+        {
+            if( dacEnabled == 0 )
+            {
+                *slope = caliInfo->ccConstants[2];
+                *offset = caliInfo->ccConstants[3];
+            }
+            else
+            {
+                *slope = caliInfo->ccConstants[11]*2.0/65536.0;
+                *offset = -caliInfo->ccConstants[11];
+            }
+        }
+        else if( negChannel == 31 )
+        {
+            if( dacEnabled == 0 )
+            {
+                *slope = caliInfo->ccConstants[0];
+                *offset = caliInfo->ccConstants[1];
+            }
+            else
+            {
+                *slope = caliInfo->ccConstants[11]/65536.0;
+                *offset = 0.0;
+            }
+        }
+        else
+        {
+            printf("getAinVoltCalibrationLinear error: invalid negative channel.\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    //Same equations as getAinVoltCalibrated_hw130
+    if( negChannel <= 15 || negChannel == 30 )
+    {
+        if( hv == 1 && !(positiveChannel >= 4 && negChannel >= 4) )
+        {
+            printf("getAinVoltCalibrationLinear error: invalid negative channel for U3-HV.\n");
+            return -1;
+        }
+        *slope = caliInfo->ccConstants[2];
+        *offset = caliInfo->ccConstants[3];
+    }
+    else if( negChannel == 31 )
+    {
+        if( hv == 1 && positiveChannel < 4 )
+        {
+            *slope = caliInfo->ccConstants[12 + positiveChannel];
+            *offset = caliInfo->ccConstants[16 + positiveChannel];
+        }
+        else
+        {
+            *slope = caliInfo->ccConstants[0];
+            *offset = caliInfo->ccConstants[1];
+        }
+    }
+    else if( negChannel == 32 )  //Special range
+    {
+        if( hv == 1 && positiveChannel < 4 )
+        {
+            *slope = caliInfo->ccConstants[2] * caliInfo->ccConstants[12 + positiveChannel] / caliInfo->ccConstants[0];
+            *offset = (caliInfo->ccConstants[3] + caliInfo->ccConstants[9]) * caliInfo->ccConstants[12 + positiveChannel] / caliInfo->ccConstants[0] +
+                      caliInfo->ccConstants[16 + positiveChannel];
+        }
+        else
+        {
+            *slope = caliInfo->ccConstants[2];
+            *offset = caliInfo->ccConstants[3] + caliInfo->ccConstants[9];
+        }
+    }
+    else
+    {
+        printf("getAinVoltCalibrationLinear error: invalid negative channel.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
 long getDacBinVoltCalibrated(u3CalibrationInfo *caliInfo, int dacNumber, double analogVolt, uint8 *bytesVolt)
 {
     return getDacBinVoltCalibrated8Bit(caliInfo, dacNumber, analogVolt, bytesVolt);
@@ -649,7 +767,7 @@ long getTempKUncalibrated(uint16 bytesTemp, double *kelvinTemp)
 
 long I2C(HANDLE hDevice, uint8 I2COptions, uint8 SpeedAdjust, uint8 SDAPinNum, uint8 SCLPinNum, uint8 Address, uint8 NumI2CBytesToSend, uint8 NumI2CBytesToReceive, uint8 *I2CBytesCommand, uint8 *Errorcode, uint8 *AckArray, uint8 *I2CBytesResponse)
 {
-    uint8 *sendBuff, *recBuff;
+    uint8 sendBuff[U3_MAX_PACKET_SIZE], recBuff[U3_MAX_PACKET_SIZE];
     uint16 checksumTotal = 0;
     uint32 ackArrayTotal, expectedAckArray;
     int sendChars, recChars, sendSize, recSize;
@@ -660,8 +778,11 @@ long I2C(HANDLE hDevice, uint8 I2COptions, uint8 SpeedAdjust, uint8 SDAPinNum, u
     sendSize = 6 + 8 + ((NumI2CBytesToSend%2 != 0)?(NumI2CBytesToSend + 1):(NumI2CBytesToSend));
     recSize = 6 + 6 + ((NumI2CBytesToReceive%2 != 0)?(NumI2CBytesToReceive + 1):(NumI2CBytesToReceive));
 
-    sendBuff = (uint8 *)malloc(sizeof(uint8)*sendSize);
-    recBuff = (uint8 *)malloc(sizeof(uint8)*recSize);
+    if( sendSize > U3_MAX_PACKET_SIZE || recSize > U3_MAX_PACKET_SIZE )
+    {
+        printf("I2C Error : too many bytes to send or receive\n");
+        return -1;
+    }
 
     sendBuff[sendSize - 1] = 0;
 
@@ -692,8 +813,7 @@ long I2C(HANDLE hDevice, uint8 I2COptions, uint8 SpeedAdjust, uint8 SDAPinNum, u
             printf("I2C Error : write failed\n");
         else
             printf("I2C Error : did not write all of the buffer\n");
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     //Reading response from U3
@@ -708,8 +828,7 @@ long I2C(HANDLE hDevice, uint8 I2COptions, uint8 SpeedAdjust, uint8 SDAPinNum, u
             if( recChars >= 12 )
                 *Errorcode = recBuff[6];
         }
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     *Errorcode = recBuff[6];
@@ -760,12 +879,6 @@ long I2C(HANDLE hDevice, uint8 I2COptions, uint8 SpeedAdjust, uint8 SDAPinNum, u
     if( ackArrayTotal != expectedAckArray )
         printf("I2C error : expected an ack of %u, but received %u\n", expectedAckArray, ackArrayTotal);
 
-cleanmem:
-    free(sendBuff);
-    free(recBuff);
-    sendBuff = NULL;
-    recBuff = NULL;
-
     return ret;
 }
 
@@ -828,13 +941,14 @@ long eAIN(HANDLE Handle, u3CalibrationInfo *CalibrationInfo, long ConfigIO, long
         else if( ChannelN <= 15 )
             EIOAnalog = EIOAnalog | (int)pow(2, (ChannelN - 8));
 
-        //Using ConfigIO to get current FIOAnalog and EIOAnalog settings
-        if( (error = ehConfigIO(Handle, 0, 0, 0, 0, 0, &curTCConfig, &outDAC1Enable, &curFIOAnalog, &curEIOAnalog)) != 0 )
+        //Getting current FIOAnalog and EIOAnalog settings (shadow copy, or
+        //ConfigIO)
+        if( (error = ehGetConfigIO(Handle, &curTCConfig, &outDAC1Enable, &curFIOAnalog, &curEIOAnalog)) != 0 )
             return error;
 
         *DAC1Enable = outDAC1Enable;
 
-        if( !(FIOAnalog == curFIOAnalog && EIOAnalog == curEIOAnalog) )
+        if( (FIOAnalog & curFIOAnalog) != FIOAnalog || (EIOAnalog & curEIOAnalog) != EIOAnalog )
         {
             //Creating new FIOAnalog and EIOAnalog settings
             FIOAnalog = FIOAnalog | curFIOAnalog;
@@ -978,12 +1092,13 @@ long eDI(HANDLE Handle, long ConfigIO, long Channel, long *State)
         else
             EIOAnalog = 255 - pow(2, (Channel - 8));
 
-        //Using ConfigIO to get current FIOAnalog and EIOAnalog settings
-        error = ehConfigIO(Handle, 0, 0, 0, 0, 0, &curTCConfig, NULL, &curFIOAnalog, &curEIOAnalog);
+        //Getting current FIOAnalog and EIOAnalog settings (shadow copy, or
+        //ConfigIO)
+        error = ehGetConfigIO(Handle, &curTCConfig, NULL, &curFIOAnalog, &curEIOAnalog);
         if( error != 0 )
             return error;
 
-        if( !(FIOAnalog == curFIOAnalog && EIOAnalog == curEIOAnalog) )
+        if( (FIOAnalog & curFIOAnalog) != curFIOAnalog || (EIOAnalog & curEIOAnalog) != curEIOAnalog )
         {
             //Creating new FIOAnalog and EIOAnalog settings
             FIOAnalog = FIOAnalog & curFIOAnalog;
@@ -1037,12 +1152,13 @@ long eDO(HANDLE Handle, long ConfigIO, long Channel, long State)
         else
             EIOAnalog = 255 - pow(2, (Channel - 8));
 
-        //Using ConfigIO to get current FIOAnalog and EIOAnalog settings
-        error = ehConfigIO(Handle, 0, 0, 0, 0, 0, &curTCConfig, NULL, &curFIOAnalog, &curEIOAnalog);
+        //Getting current FIOAnalog and EIOAnalog settings (shadow copy, or
+        //ConfigIO)
+        error = ehGetConfigIO(Handle, &curTCConfig, NULL, &curFIOAnalog, &curEIOAnalog);
         if( error != 0 )
             return error;
 
-        if( !(FIOAnalog == curFIOAnalog && EIOAnalog == curEIOAnalog) )
+        if( (FIOAnalog & curFIOAnalog) != curFIOAnalog || (EIOAnalog & curEIOAnalog) != curEIOAnalog )
         {
             //Using ConfigIO to get current FIOAnalog and EIOAnalog settings
             FIOAnalog = FIOAnalog & curFIOAnalog;
@@ -1105,8 +1221,9 @@ long eTCConfig(HANDLE Handle, long *aEnableTimers, long *aEnableCounters, long T
     if( error != 0 )
         return error;
 
-    //Using ConfigIO to get current FIOAnalog and curEIOAnalog settings
-    error = ehConfigIO(Handle, 0, 0, 0, 0, 0, NULL, NULL, &curFIOAnalog, &curEIOAnalog);
+    //Getting current FIOAnalog and curEIOAnalog settings (shadow copy, or
+    //ConfigIO)
+    error = ehGetConfigIO(Handle, NULL, NULL, &curFIOAnalog, &curEIOAnalog);
     if( error != 0 )
         return error;
 
@@ -1243,6 +1360,204 @@ long eTCValues(HANDLE Handle, long *aReadTimers, long *aUpdateResetTimers, long
 }
 
 
+//Number of Feedback commands eBatchRead keeps in flight
+#define U3_BATCH_READ_FRAMES_IN_FLIGHT 4
+
+//Feedback command and response data sizes of one eBatchRead read, or 0 if the
+//read is not valid.
+static int batchReadCommandSize(const u3BatchRead *read)
+{
+    switch( read->type )
+    {
+        case U3_BATCH_AIN:
+            return 3;
+        case U3_BATCH_PORT_STATE:
+            return 1;
+        case U3_BATCH_COUNTER:
+            return (read->channelP <= 1) ? 2 : 0;
+        default:
+            return 0;
+    }
+}
+
+static int batchReadResponseSize(const u3BatchRead *read)
+{
+    switch( read->type )
+    {
+        case U3_BATCH_AIN:
+            return 2;
+        case U3_BATCH_PORT_STATE:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+
+long eBatchRead(HANDLE Handle, u3CalibrationInfo *CalibrationInfo, long ConfigIO, long *DAC1Enable, u3BatchRead *aReads, long NumReads, long *NumFrames)
+{
+    uint8 sendDataBuff[U3_MAX_FEEDBACK_COMMAND_DATA], *recDataBuff;
+    uint8 FIOAnalog, EIOAnalog, curFIOAnalog, curEIOAnalog, curTCConfig;
+    uint8 outDAC1Enable;
+    u3Command frames[U3_BATCH_READ_FRAMES_IN_FLIGHT];
+    int frameFirst[U3_BATCH_READ_FRAMES_IN_FLIGHT];
+    int sendSize, recSize, first, last, numFrames, frame, i, hv;
+    long error;
+    double hwver, slope, offset;
+    u3BatchRead *read;
+
+    if( NumFrames != NULL )
+        *NumFrames = 0;
+
+    if( isCalibrationInfoValid(CalibrationInfo) == 0 )
+    {
+        printf("eBatchRead error: calibration information is required");
+        return -1;
+    }
+
+    hwver = CalibrationInfo->hardwareVersion;
+    hv = CalibrationInfo->highVoltage;
+
+    FIOAnalog = 0;
+    EIOAnalog = 0;
+    for( i = 0; i < NumReads; i++ )
+    {
+        read = &aReads[i];
+        if( batchReadCommandSize(read) == 0 )
+        {
+            printf("eBatchRead error: Invalid read %d\n", i);
+            return -1;
+        }
+
+        if( read->type != U3_BATCH_AIN )
+            continue;
+
+        if( read->channelP > 31 || (read->channelP > 15 && read->channelP < 30) ||
+            read->channelN > 32 || (read->channelN > 15 && read->channelN < 30) ||
+            (hwver >= 1.30 && hv == 1 && ((read->channelP < 4 && read->channelN != 31 && read->channelN != 32) ||
+            read->channelN < 4)) )
+        {
+            printf("eBatchRead error: Invalid analog input channel in read %d\n", i);
+            return -1;
+        }
+
+        //Analog lines needed (always analog on the U3-HV AIN0-3)
+        if( hwver >= 1.30 && hv == 1 && read->channelP < 4 )
+            continue;
+        if( read->channelP <= 7 )
+            FIOAnalog |= (uint8)(1 << read->channelP);
+        else if( read->channelP <= 15 )
+            EIOAnalog |= (uint8)(1 << (read->channelP - 8));
+        if( read->channelN <= 7 )
+            FIOAnalog |= (uint8)(1 << read->channelN);
+        else if( read->channelN <= 15 )
+            EIOAnalog |= (uint8)(1 << (read->channelN - 8));
+    }
+
+    if( ConfigIO != 0 )
+    {
+        //Getting current FIOAnalog and EIOAnalog settings (shadow copy, or
+        //ConfigIO)
+        if( (error = ehGetConfigIO(Handle, &curTCConfig, &outDAC1Enable, &curFIOAnalog, &curEIOAnalog)) != 0 )
+            return error;
+
+        *DAC1Enable = outDAC1Enable;
+
+        if( (FIOAnalog & curFIOAnalog) != FIOAnalog || (EIOAnalog & curEIOAnalog) != EIOAnalog )
+        {
+            //Using ConfigIO to set new FIOAnalog and EIOAnalog settings, all
+            //channels at once
+            if( (error = ehConfigIO(Handle, 12, curTCConfig, 0, FIOAnalog | curFIOAnalog, EIOAnalog | curEIOAnalog, NULL, NULL, &curFIOAnalog, &curEIOAnalog)) != 0 )
+                return error;
+        }
+    }
+
+    for( first = 0; first < NumReads; )
+    {
+        /* Packing as many reads as possible into each Feedback command */
+        for( numFrames = 0; numFrames < U3_BATCH_READ_FRAMES_IN_FLIGHT && first < NumReads; numFrames++ )
+        {
+            sendSize = 0;
+            recSize = 0;
+            for( last = first; last < NumReads; last++ )
+            {
+                read = &aReads[last];
+                if( sendSize + batchReadCommandSize(read) > U3_MAX_FEEDBACK_COMMAND_DATA ||
+                    recSize + batchReadResponseSize(read) > U3_MAX_FEEDBACK_RESPONSE_DATA )
+                    break;
+
+                switch( read->type )
+                {
+                    case U3_BATCH_AIN:
+                        sendDataBuff[sendSize] = 1;  //IOType is AIN
+                        sendDataBuff[sendSize + 1] = read->channelP + (read->options & 0xC0);  //Positive channel (bits 0-4), LongSettling (bit 6)
+                                                                                               //QuickSample (bit 7)
+                        sendDataBuff[sendSize + 2] = (read->channelN == 32) ? 30 : read->channelN;  //Negative channel (32, special range, is sent as 30)
+                        break;
+                    case U3_BATCH_PORT_STATE:
+                        sendDataBuff[sendSize] = 26;  //IOType is PortStateRead
+                        break;
+                    case U3_BATCH_COUNTER:
+                        sendDataBuff[sendSize] = 54 + read->channelP;  //IOType is Counter0/1
+                        sendDataBuff[sendSize + 1] = read->options & 0x01;  //Reset
+                        break;
+                }
+                sendSize += batchReadCommandSize(read);
+                recSize += batchReadResponseSize(read);
+            }
+
+            if( ehFeedbackCommand(&frames[numFrames], sendDataBuff, sendSize, recSize) != 0 )
+                return -1;
+            frameFirst[numFrames] = first;
+            first = last;
+        }
+
+        //Several commands in flight, so the round trips overlap
+        if( ehPipelinedCommands(Handle, frames, numFrames, numFrames) != 0 )
+        {
+            for( frame = 0; frame < numFrames; frame++ )
+            {
+                if( frames[frame].error != 0 )
+                    return frames[frame].error;
+            }
+        }
+        if( NumFrames != NULL )
+            *NumFrames += numFrames;
+
+        /* Decoding and calibrating all the results of these commands */
+        for( frame = 0; frame < numFrames; frame++ )
+        {
+            recDataBuff = frames[frame].recBuff + 9;
+            recSize = 0;
+            last = (frame + 1 < numFrames) ? frameFirst[frame + 1] : first;
+            for( i = frameFirst[frame]; i < last; i++ )
+            {
+                read = &aReads[i];
+                switch( read->type )
+                {
+                    case U3_BATCH_AIN:
+                        read->raw = recDataBuff[recSize] + recDataBuff[recSize + 1]*256;
+                        if( getAinVoltCalibrationLinear(CalibrationInfo, (int)(*DAC1Enable), read->channelP, read->channelN, &slope, &offset) != 0 )
+                            return -1;
+                        read->value = slope*read->raw + offset;
+                        break;
+                    case U3_BATCH_PORT_STATE:
+                        read->raw = recDataBuff[recSize] + recDataBuff[recSize + 1]*256 + recDataBuff[recSize + 2]*65536;
+                        read->value = read->raw;
+                        break;
+                    case U3_BATCH_COUNTER:
+                        read->raw = recDataBuff[recSize] + recDataBuff[recSize + 1]*256 + recDataBuff[recSize + 2]*65536 + (uint32)recDataBuff[recSize + 3]*16777216;
+                        read->value = read->raw;
+                        break;
+                }
+                recSize += batchReadResponseSize(read);
+            }
+        }
+    }
+
+    return 0;
+}
+
 long ehConfigIO(HANDLE hDevice, uint8 inWriteMask, uint8 inTimerCounterConfig, uint8 inDAC1Enable, uint8 inFIOAnalog, uint8 inEIOAnalog, uint8 *outTimerCounterConfig, uint8 *outDAC1Enable, uint8 *outFIOAnalog, uint8 *outEIOAnalog)
 {
     uint8 sendBuff[12], recBuff[12];
@@ -1262,6 +1577,10 @@ long ehConfigIO(HANDLE hDevice, uint8 inWriteMask, uint8 inTimerCounterConfig, u
     sendBuff[11] = inEIOAnalog;  //EIOAnalog
     extendedChecksum(sendBuff, 12);
 
+    //On any error from here on, the device may have applied the new settings
+    //or not: the shadow copy is only valid again once a response says which.
+    clearConfigIOShadow(hDevice);
+
     //Sending command to U3
     if( (sendChars = LJUSB_Write(hDevice, sendBuff, 12)) < 12 )
     {
@@ -1313,6 +1632,8 @@ long ehConfigIO(HANDLE hDevice, uint8 inWriteMask, uint8 inTimerCounterConfig, u
         return (int)recBuff[6];
     }
 
+    setConfigIOShadow(hDevice, recBuff[8], recBuff[9], recBuff[10], recBuff[11]);
+
     if( outTimerCounterConfig != NULL )
         *outTimerCounterConfig = recBuff[8];
     if( outDAC1Enable != NULL )
@@ -1326,6 +1647,51 @@ long ehConfigIO(HANDLE hDevice, uint8 inWriteMask, uint8 inTimerCounterConfig, u
 }
 
 
+long ehGetConfigIO(HANDLE hDevice, uint8 *outTimerCounterConfig, uint8 *outDAC1Enable, uint8 *outFIOAnalog, uint8 *outEIOAnalog)
+{
+    u3ConfigIOShadow *shadow;
+
+    shadow = getConfigIOShadow(hDevice);
+    if( shadow == NULL || shadow->valid == 0 )
+        return ehConfigIO(hDevice, 0, 0, 0, 0, 0, outTimerCounterConfig, outDAC1Enable, outFIOAnalog, outEIOAnalog);
+
+    if( outTimerCounterConfig != NULL )
+        *outTimerCounterConfig = shadow->timerCounterConfig;
+    if( outDAC1Enable != NULL )
+        *outDAC1Enable = shadow->dac1Enable;
+    if( outFIOAnalog != NULL )
+        *outFIOAnalog = shadow->fioAnalog;
+    if( outEIOAnalog != NULL )
+        *outEIOAnalog = shadow->eioAnalog;
+
+    return 0;
+}
+
+
+void setConfigIOShadow(HANDLE hDevice, uint8 TimerCounterConfig, uint8 DAC1Enable, uint8 FIOAnalog, uint8 EIOAnalog)
+{
+    u3ConfigIOShadow *shadow;
+
+    if( (shadow = getConfigIOShadow(hDevice)) == NULL )
+        return;
+
+    shadow->timerCounterConfig = TimerCounterConfig;
+    shadow->dac1Enable = DAC1Enable;
+    shadow->fioAnalog = FIOAnalog;
+    shadow->eioAnalog = EIOAnalog;
+    shadow->valid = 1;
+}
+
+
+void clearConfigIOShadow(HANDLE hDevice)
+{
+    u3ConfigIOShadow *shadow;
+
+    if( (shadow = getConfigIOShadow(hDevice)) != NULL )
+        shadow->valid = 0;
+}
+
+
 long ehConfigTimerClock(HANDLE hDevice, uint8 inTimerClockConfig, uint8 inTimerClockDivisor, uint8 *outTimerClockConfig, uint8 *outTimerClockDivisor)
 {
     uint8 sendBuff[10], recBuff[10];
@@ -1406,7 +1772,7 @@ long ehConfigTimerClock(HANDLE hDevice, uint8 inTimerClockConfig, uint8 inTimerC
 
 long ehFeedback(HANDLE hDevice, uint8 *inIOTypesDataBuff, long inIOTypesDataSize, uint8 *outErrorcode, uint8 *outErrorFrame, uint8 *outDataBuff, long outDataSize)
 {
-    uint8 *sendBuff, *recBuff;
+    uint8 sendBuff[U3_MAX_PACKET_SIZE], recBuff[U3_MAX_PACKET_SIZE];
     uint16 checksumTotal;
     int sendChars, recChars, sendDWSize, recDWSize;
     int commandBytes, ret, i;
@@ -1419,12 +1785,10 @@ long ehFeedback(HANDLE hDevice, uint8 *inIOTypesDataBuff, long inIOTypesDataSize
     if( ((recDWSize = outDataSize + 3)%2) != 0 )
         recDWSize++;
 
-    sendBuff = (uint8 *)malloc(sizeof(uint8)*(commandBytes + sendDWSize));
-    recBuff = (uint8 *)malloc(sizeof(uint8)*(commandBytes + recDWSize));
-    if( sendBuff == NULL || recBuff == NULL )
+    if( commandBytes + sendDWSize > U3_MAX_PACKET_SIZE || commandBytes + recDWSize > U3_MAX_PACKET_SIZE )
     {
-        ret = -1;
-        goto cleanmem;
+        printf("ehFeedback error : IOTypes do not fit in one Feedback packet\n");
+        return -1;
     }
 
     sendBuff[sendDWSize + commandBytes - 1] = 0;
@@ -1449,8 +1813,7 @@ long ehFeedback(HANDLE hDevice, uint8 *inIOTypesDataBuff, long inIOTypesDataSize
             printf("ehFeedback error : write failed\n");
         else
             printf("ehFeedback error : did not write all of the buffer\n");
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     //Reading response from U3
@@ -1459,14 +1822,12 @@ long ehFeedback(HANDLE hDevice, uint8 *inIOTypesDataBuff, long inIOTypesDataSize
         if( recChars == -1 )
         {
             printf("ehFeedback error : read failed\n");
-            ret = -1;
-            goto cleanmem;
+            return -1;
         }
         else if( recChars < 8 )
         {
             printf("ehFeedback error : response buffer is too small\n");
-            ret = -1;
-            goto cleanmem;
+            return -1;
         }
         else
             printf("ehFeedback error : did not read all of the expected buffer (received %d, expected %d )\n", recChars, commandBytes+recDWSize);
@@ -1476,29 +1837,25 @@ long ehFeedback(HANDLE hDevice, uint8 *inIOTypesDataBuff, long inIOTypesDataSize
     if( (uint8)((checksumTotal / 256 ) & 0xff) != recBuff[5] )
     {
         printf("ehFeedback error : read buffer has bad checksum16(MSB)\n");
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     if( (uint8)(checksumTotal & 0xff) != recBuff[4] )
     {
         printf("ehFeedback error : read buffer has bad checksum16(LBS)\n");
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     if( extendedChecksum8(recBuff) != recBuff[0] )
     {
         printf("ehFeedback error : read buffer has bad checksum8\n");
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     if( recBuff[1] != (uint8)(0xF8) || recBuff[3] != (uint8)(0x00) )
     {
         printf("ehFeedback error : read buffer has wrong command bytes \n");
-        ret = -1;
-        goto cleanmem;
+        return -1;
     }
 
     *outErrorcode = recBuff[6];
@@ -1507,11 +1864,228 @@ long ehFeedback(HANDLE hDevice, uint8 *inIOTypesDataBuff, long inIOTypesDataSize
     for( i = 0; i+commandBytes+3 < recChars && i < outDataSize; i++ )
         outDataBuff[i] = recBuff[i+commandBytes+3];
 
-cleanmem:
-    free(sendBuff);
-    free(recBuff);
-    sendBuff = NULL;
-    recBuff = NULL;
+    return ret;
+}
+
+
+//Number of commands ehPipelinedCommands hands to LJUSB_WriteReadPipelined at
+//once.  Longer lists are split, and the pipeline drained, every this many.
+#define U3_PIPELINED_COMMANDS_PER_CALL 64
+
+//Validates the response of one command of ehPipelinedCommands and matches it
+//to the command.  Returns -1 or errorcode (>1 value) on error, 0 on success.
+static long checkPipelinedResponse(u3Command *Command, long Index, unsigned long recChars)
+{
+    uint8 *sendBuff = Command->sendBuff, *recBuff = Command->recBuff;
+    uint16 checksumTotal;
+
+    if( recChars < (unsigned long)Command->recSize )
+    {
+        printf("ehPipelinedCommands error : command %ld did not read all of the buffer\n", Index);
+        return -1;
+    }
+
+    if( sendBuff[1] != (uint8)(0xF8) )
+    {
+        //Normal command
+        if( normalChecksum8(recBuff, Command->recSize) != recBuff[0] )
+        {
+            printf("ehPipelinedCommands error : command %ld read buffer has bad checksum8\n", Index);
+            return -1;
+        }
+
+        //Same command byte, or the next one (e.g. StreamStart 0xA8 -> 0xA9)
+        if( recBuff[1] != sendBuff[1] && recBuff[1] != (uint8)(sendBuff[1] + 1) )
+        {
+            printf("ehPipelinedCommands error : command %ld read buffer has wrong command byte\n", Index);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    checksumTotal = extendedChecksum16(recBuff, Command->recSize);
+    if( (uint8)((checksumTotal / 256 ) & 0xff) != recBuff[5] ||
+        (uint8)(checksumTotal & 0xff) != recBuff[4] ||
+        extendedChecksum8(recBuff) != recBuff[0] )
+    {
+        printf("ehPipelinedCommands error : command %ld read buffer has bad checksum\n", Index);
+        return -1;
+    }
+
+    //Feedback responses are also matched by their echo byte
+    if( recBuff[1] != (uint8)(0xF8) || recBuff[3] != sendBuff[3] ||
+        (sendBuff[3] == 0x00 && recBuff[8] != sendBuff[6]) )
+    {
+        printf("ehPipelinedCommands error : command %ld read buffer has wrong command or echo bytes\n", Index);
+        return -1;
+    }
+
+    return (long)recBuff[6];
+}
+
+
+long ehPipelinedCommands(HANDLE hDevice, u3Command *aCommands, long NumCommands, long MaxInFlight)
+{
+    BYTE *sendBuffs[U3_PIPELINED_COMMANDS_PER_CALL], *recBuffs[U3_PIPELINED_COMMANDS_PER_CALL];
+    unsigned long sendSizes[U3_PIPELINED_COMMANDS_PER_CALL], recSizes[U3_PIPELINED_COMMANDS_PER_CALL];
+    unsigned long recChars[U3_PIPELINED_COMMANDS_PER_CALL];
+    unsigned int numResponses;
+    long first, num, i, ret;
+    u3Command *command;
+
+    if( MaxInFlight < 1 || MaxInFlight > 255 )
+    {
+        printf("ehPipelinedCommands error : MaxInFlight must be 1-255\n");
+        return -1;
+    }
+
+    ret = 0;
+    for( first = 0; first < NumCommands; first += num )
+    {
+        num = NumCommands - first;
+        if( num > U3_PIPELINED_COMMANDS_PER_CALL )
+            num = U3_PIPELINED_COMMANDS_PER_CALL;
+
+        for( i = 0; i < num; i++ )
+        {
+            command = &aCommands[first + i];
+            if( command->sendSize < 2 || command->sendSize > U3_MAX_PACKET_SIZE ||
+                command->recSize < 2 || command->recSize > U3_MAX_PACKET_SIZE )
+            {
+                printf("ehPipelinedCommands error : command %ld has an invalid size\n", first + i);
+                return -1;
+            }
+
+            if( command->sendBuff[1] == (uint8)(0xF8) )
+            {
+                if( command->sendBuff[3] == 0x00 )
+                    command->sendBuff[6] = (uint8)((first + i)%256);  //Echo, unique among the commands in flight
+                extendedChecksum(command->sendBuff, command->sendSize);
+            }
+            else
+                normalChecksum(command->sendBuff, command->sendSize);
+
+            sendBuffs[i] = command->sendBuff;
+            sendSizes[i] = command->sendSize;
+            recBuffs[i] = command->recBuff;
+            recSizes[i] = command->recSize;
+            command->error = -1;
+        }
+
+        numResponses = LJUSB_WriteReadPipelined(hDevice, (unsigned int)num, sendBuffs, sendSizes, recBuffs, recSizes, recChars, (unsigned int)MaxInFlight, 1000);
+        if( numResponses < (unsigned int)num )
+            printf("ehPipelinedCommands error : write or read failed after %ld commands\n", first + (long)numResponses);
+
+        for( i = 0; i < (long)numResponses; i++ )
+        {
+            command = &aCommands[first + i];
+            command->error = checkPipelinedResponse(command, first + i, recChars[i]);
+        }
+
+        //ConfigIO responses report the current settings.  A ConfigIO with no
+        //valid response may have been applied or not, so the shadow copy is
+        //unknown until the next good one.
+        for( i = 0; i < num; i++ )
+        {
+            command = &aCommands[first + i];
+            if( command->sendBuff[1] != (uint8)(0xF8) || command->sendBuff[3] != 0x0B )
+                continue;
+            if( command->error == 0 )
+                setConfigIOShadow(hDevice, command->recBuff[8], command->recBuff[9], command->recBuff[10], command->recBuff[11]);
+            else
+                clearConfigIOShadow(hDevice);
+        }
+
+        for( i = first; i < first + num; i++ )
+        {
+            if( aCommands[i].error != 0 )
+                ret = -1;
+        }
+
+        if( numResponses < (unsigned int)num )
+        {
+            for( i = first + num; i < NumCommands; i++ )
+                aCommands[i].error = -1;
+            break;
+        }
+    }
 
     return ret;
 }
+
+
+long ehFeedbackCommand(u3Command *Command, uint8 *inIOTypesDataBuff, long inIOTypesDataSize, long outDataSize)
+{
+    int sendDWSize, recDWSize, commandBytes, i;
+
+    commandBytes = 6;
+
+    if( ((sendDWSize = inIOTypesDataSize + 1)%2) != 0 )
+        sendDWSize++;
+    if( ((recDWSize = outDataSize + 3)%2) != 0 )
+        recDWSize++;
+
+    if( commandBytes + sendDWSize > U3_MAX_PACKET_SIZE || commandBytes + recDWSize > U3_MAX_PACKET_SIZE )
+    {
+        printf("ehFeedbackCommand error : IOTypes do not fit in one Feedback packet\n");
+        return -1;
+    }
+
+    Command->sendBuff[sendDWSize + commandBytes - 1] = 0;
+
+    Command->sendBuff[1] = (uint8)(0xF8);  //Command byte
+    Command->sendBuff[2] = sendDWSize/2;  //Number of data words (.5 word for echo,
+                                          //1.5 words for IOTypes)
+    Command->sendBuff[3] = (uint8)(0x00);  //Extended command number
+
+    Command->sendBuff[6] = 0;  //Echo
+
+    for( i = 0; i < inIOTypesDataSize; i++ )
+        Command->sendBuff[i+commandBytes+1] = inIOTypesDataBuff[i];
+
+    Command->sendSize = sendDWSize + commandBytes;
+    Command->recSize = recDWSize + commandBytes;
+    Command->error = 0;
+    return 0;
+}
+
+
+long ehConfigIOCommand(u3Command *Command, uint8 inWriteMask, uint8 inTimerCounterConfig, uint8 inDAC1Enable, uint8 inFIOAnalog, uint8 inEIOAnalog)
+{
+    Command->sendBuff[1] = (uint8)(0xF8);  //Command byte
+    Command->sendBuff[2] = (uint8)(0x03);  //Number of data words
+    Command->sendBuff[3] = (uint8)(0x0B);  //Extended command number
+
+    Command->sendBuff[6] = inWriteMask;  //Writemask
+
+    Command->sendBuff[7] = 0;  //Reserved
+    Command->sendBuff[8] = inTimerCounterConfig;  //TimerCounterConfig
+    Command->sendBuff[9] = inDAC1Enable;  //DAC1 enable
+    Command->sendBuff[10] = inFIOAnalog;  //FIOAnalog
+    Command->sendBuff[11] = inEIOAnalog;  //EIOAnalog
+
+    Command->sendSize = 12;
+    Command->recSize = 12;
+    Command->error = 0;
+    return 0;
+}
+
+
+long ehConfigTimerClockCommand(u3Command *Command, uint8 inTimerClockConfig, uint8 inTimerClockDivisor)
+{
+    Command->sendBuff[1] = (uint8)(0xF8);  //Command byte
+    Command->sendBuff[2] = (uint8)(0x02);  //Number of data words
+    Command->sendBuff[3] = (uint8)(0x0A);  //Extended command number
+
+    Command->sendBuff[6] = 0;  //Reserved
+    Command->sendBuff[7] = 0;  //Reserved
+
+    Command->sendBuff[8] = inTimerClockConfig;  //TimerClockConfig
+    Command->sendBuff[9] = inTimerClockDivisor;  //TimerClockDivisor
+
+    Command->sendSize = 10;
+    Command->recSize = 10;
+    Command->error = 0;
+    return 0;
+}
@@ -33,6 +33,14 @@ typedef unsigned char uint8;
 typedef unsigned short uint16;
 typedef unsigned int uint32;
 
+//Maximum size of a U3 low-level command or response, in bytes.
+#define U3_MAX_PACKET_SIZE 64
+
+//Maximum number of IOTypes data bytes in one Feedback command, and of data
+//bytes in its response.
+#define U3_MAX_FEEDBACK_COMMAND_DATA 57
+#define U3_MAX_FEEDBACK_RESPONSE_DATA 55
+
 //Structure for storing calibration constants
 struct U3_CALIBRATION_INFORMATION {
     uint8 prodID;
@@ -82,6 +90,42 @@ struct U3_TDAC_CALIBRATION_INFORMATION {
 
 typedef struct U3_TDAC_CALIBRATION_INFORMATION u3TdacCalibrationInfo;
 
+//Nominal calibration constants of the U3 (hardware version 1.31, not HV)
+extern u3CalibrationInfo U3_CALIBRATION_INFO_DEFAULT;
+
+//Types of reads supported by eBatchRead
+#define U3_BATCH_AIN 0         //Analog input (Feedback IOType 1)
+#define U3_BATCH_PORT_STATE 1  //All digital inputs (IOType 26)
+#define U3_BATCH_COUNTER 2     //Counter0/1 (IOTypes 54/55)
+
+//Structure for one read of a eBatchRead call
+struct U3_BATCH_READ {
+    uint8 type;      //U3_BATCH_AIN, U3_BATCH_PORT_STATE or U3_BATCH_COUNTER
+    uint8 channelP;  //AIN: positive channel.  Counter: counter number (0-1)
+    uint8 channelN;  //AIN: negative channel
+    uint8 options;   //AIN: LongSettling (bit 6), QuickSample (bit 7)
+                     //Counter: reset after reading (bit 0)
+    uint32 raw;      //Output: AIN binary reading, port state (FIO in bits
+                     //0-7, EIO in bits 8-15, CIO in bits 16-19), or count
+    double value;    //Output: AIN calibrated voltage (or Kelvin for the
+                     //temperature sensor), port state or count
+};
+
+typedef struct U3_BATCH_READ u3BatchRead;
+
+//Structure for one command of a ehPipelinedCommands call
+struct U3_COMMAND {
+    uint8 sendBuff[U3_MAX_PACKET_SIZE];  //Command, as set up by
+                                         //ehFeedbackCommand... (checksums and
+                                         //echo are set by ehPipelinedCommands)
+    long sendSize;                       //Size of the command, in bytes
+    uint8 recBuff[U3_MAX_PACKET_SIZE];   //Output: response
+    long recSize;                        //Expected size of the response
+    long error;                          //Output: 0, -1 or errorcode (>0)
+};
+
+typedef struct U3_COMMAND u3Command;
+
 
 /* Functions */
 
@@ -117,6 +161,8 @@ HANDLE openUSBConnection( int localID);
 //Opens a U3 connection over USB.  Returns NULL on failure, or a HANDLE on
 //success.
 //localID = the local ID or serial number of the U3 you want to open
+//Virtual devices (see LJUSB_AddVirtualDevice), such as software emulated
+//U3s, are looked up before the USB ones.
 
 void closeUSBConnection( HANDLE hDevice);
 //Closes a HANDLE to a U3 device.
@@ -193,6 +239,29 @@ long getAinVoltCalibrated_hw130( u3CalibrationInfo *caliInfo,
 //bytesVolt = the 2 byte voltage that will be converted
 //analogVolt = the converted analog voltage
 
+long getAinVoltCalibrationLinear( u3CalibrationInfo *caliInfo,
+                                  int dac1Enabled,
+                                  uint8 positiveChannel,
+                                  uint8 negChannel,
+                                  double *slope,
+                                  double *offset);
+//Resolves, once, the linear equation that getAinVoltCalibrated (hardware
+//versions < 1.30) or getAinVoltCalibrated_hw130 (hardware versions 1.30)
+//would apply to every binary AIN reading of a given channel pair, such that:
+//  analogVolt = slope*bytesVolt + offset
+//This lets stream decoders convert each sample with a single multiply-add,
+//with no per-sample validation or branching.  For positiveChannel 30 (the
+//temperature sensor), the equation of getTempKCalibrated is returned.
+//Call getCalibrationInfo first to set up caliInfo.
+//Returns -1 on error, 0 on success.
+//caliInfo = structure where calibrarion information is stored
+//dac1Enabled = same as in getAinVoltCalibrated.  Ignored for hardware
+//              version 1.30.
+//positiveChannel = the positive channel of the analog reading
+//negChannel = the negative channel of the analog reading
+//slope = the returned slope, in Volts per binary unit
+//offset = the returned offset, in Volts
+
 long getDacBinVoltCalibrated( u3CalibrationInfo *caliInfo,
                               int dacNumber,
                               double analogVolt,
@@ -342,7 +411,8 @@ long I2C( HANDLE hDevice,
           uint8 *I2CBytesResponse);
 //This function will perform the I2C low-level function call.  Please refer to
 //section 5.3.19 of the U3 User's Guide for parameter documentation.  Returns
-//-1 on error, 0 on success.
+//-1 on error, 0 on success.  Up to 50 bytes can be sent and 52 received.  No
+//heap memory is allocated.
 //hDevice = handle to a U3 device
 //I2COptions = byte 6 of the command
 //SpeedAdjust = byte 7 of the command
@@ -383,12 +453,13 @@ long eAIN( HANDLE Handle,
 //Call getCalibrationInfo first to set up CalibrationInfo.
 //Handle = Handle to a U3 device.
 //CalibrationInfo = Structure where calibration information is stored.
-//ConfigIO = If this is nonzero (True), then 1 or 2 ConfigIO low-level function
-//           calls will be made in addition to the 1 Feedback call to set the
-//           specified Channels to analog inputs.  If this is 0 (False), then
-//           only a Feedback low-level call will be made, and an error will be
-//           returned if the specified Channels are not already set to analog
-//           inputs.
+//ConfigIO = If this is nonzero (True), then up to 2 ConfigIO low-level
+//           function calls will be made in addition to the 1 Feedback call to
+//           set the specified Channels to analog inputs (none if the handle's
+//           ConfigIO shadow copy shows they already are, see ehGetConfigIO).
+//           If this is 0 (False), then only a Feedback low-level call will be
+//           made, and an error will be returned if the specified Channels are
+//           not already set to analog inputs.
 //DAC1Enable = This parameter helps to determine the appropriate equation to
 //             use when calculating Voltage.  If the long variable that is
 //             being pointed to is nonzero (True), then it is indicated that
@@ -396,7 +467,7 @@ long eAIN( HANDLE Handle,
 //             DAC1 is disabled.  For both case, if ConfigIO is set to True,
 //             then input value will be ignored and the output value will be
 //             set to the current DAC1Enable value in the ConfigIO low-level
-//             response.
+//             response (or shadow copy).
 //ChannelP = The positive AIN channel to acquire.
 //ChannelN = The negative AIN channel to acquire.  For single-ended channels on
 //           the U3, this parameter should be 31 (see Section 2.6.1).
@@ -444,11 +515,12 @@ long eDI( HANDLE Handle,
 //ConfigIO is set as True.  Returns 0 for no error, or -1 or >0 value
 //(low-level errorcode) on error.
 //Handle = Handle to a U3 device.
-//ConfigIO = If this is nonzero (True), then 2 ConfigIO low-level functions
-//           calls will be made in addition to the 1 Feedback call to set
-//           Channel as digital.  If this is 0 (False), then only a Feedback
-//           low-level call will be made, and an error will be returned if
-//           Channel is not already set as digital.
+//ConfigIO = If this is nonzero (True), then up to 2 ConfigIO low-level
+//           function calls will be made in addition to the 1 Feedback call to
+//           set Channel as digital (none if the handle's ConfigIO shadow copy
+//           shows it already is, see ehGetConfigIO).  If this is 0 (False),
+//           then only a Feedback low-level call will be made, and an error
+//           will be returned if Channel is not already set as digital.
 //Channel = The channel to read.  0-19 corresponds to FIO0-CIO3.
 //          For U3 hardware versions 1.30, HV model, Channel needs to be 4-19,
 //State = Returns the state of the digital input.  0=False=Low and 1=True=High.
@@ -462,11 +534,12 @@ long eDO( HANDLE Handle,
 //unless ConfigIO is set as True.  Returns 0 for no error, or -1 or >0 value
 //(low-level errorcode) on error.
 //Handle = Handle to a U3 device.
-//ConfigIO = If this is nonzero (True), then 2 ConfigIO low-level functions
-//           calls will be made in addition to the 1 Feedback call to set
-//           Channel as digital. If this is 0 (False), then only a Feedback
-//           low-level call will be made, and an error will be returned if
-//           Channel is not already set as digital.
+//ConfigIO = If this is nonzero (True), then up to 2 ConfigIO low-level
+//           function calls will be made in addition to the 1 Feedback call to
+//           set Channel as digital (none if the handle's ConfigIO shadow copy
+//           shows it already is, see ehGetConfigIO). If this is 0 (False),
+//           then only a Feedback low-level call will be made, and an error
+//           will be returned if Channel is not already set as digital.
 //Channel = The channel to write to.  0-19 corresponds to FIO0-CIO3.
 //          For U3 hardware versions 1.30, HV model, Channel needs to be 4-19,
 //State = The state to write to the digital output.  0=False=Low and
@@ -557,6 +630,35 @@ long eTCValues( HANDLE Handle,
 //                 elements.
 //Reserved (1&2) = Pass 0.
 
+long eBatchRead( HANDLE Handle,
+                 u3CalibrationInfo *CalibrationInfo,
+                 long ConfigIO,
+                 long *DAC1Enable,
+                 u3BatchRead *aReads,
+                 long NumReads,
+                 long *NumFrames);
+//An "easy" function that performs many analog input, digital port and counter
+//reads with as few Feedback low-level calls as possible.  Reads are packed, in
+//order, into one Feedback command until it is full (57 command or 55 response
+//bytes, e.g. 19 analog inputs), and only then split into more commands, up to
+//4 of which are kept in flight at once (see ehPipelinedCommands).  All results
+//are decoded and calibrated together.  Returns 0 for no error, or -1
+//or >0 value (low-level errorcode) on error.
+//Handle = Handle to a U3 device.
+//CalibrationInfo = Structure containing the calibration information.
+//ConfigIO = If this is nonzero (True), all the analog input channels are
+//           configured as analog with a single ConfigIO read and write, if
+//           needed (the read is skipped if the handle's ConfigIO shadow copy
+//           is known, see ehGetConfigIO), before reading.  If this is 0
+//           (False), the channels must already be configured as analog.
+//DAC1Enable = Only used with U3 hardware versions older than 1.30.  Input:
+//             whether DAC1 is enabled, if ConfigIO is 0.  Output: whether
+//             DAC1 is enabled, if ConfigIO is nonzero.
+//aReads = The reads to perform.  The results are stored in their raw and
+//         value fields.
+//NumReads = The number of elements in aReads.
+//NumFrames = Returns the number of Feedback commands used.  Can be NULL.
+
 
 /* Easy Function Helpers */
 
@@ -573,7 +675,35 @@ long ehConfigIO( HANDLE hDevice,
 //Used by the eAIN, eDAC, eDI, eDO and eTCConfig easy functions.  This function
 //takes the ConfigIO low-level command and response bytes (not including
 //checksum and command bytes) as its parameter and performs a ConfigIO call
-//with the U3.  Returns -1 or errorcode (>1 value) on error, 0 on success.
+//with the U3.  The response also updates the handle's ConfigIO shadow copy
+//(see ehGetConfigIO).  Returns -1 or errorcode (>1 value) on error, 0 on
+//success.
+
+long ehGetConfigIO( HANDLE hDevice,
+                    uint8 *outTimerCounterConfig,
+                    uint8 *outDAC1Enable,
+                    uint8 *outFIOAnalog,
+                    uint8 *outEIOAnalog);
+//Used by the eAIN, eDI, eDO, eTCConfig and eBatchRead easy functions.  Returns
+//the current ConfigIO settings of the U3, as a ehConfigIO call with a
+//WriteMask of 0 would, but without any USB traffic when they are already
+//known: every ConfigIO response received by ehConfigIO is kept in a per-handle
+//shadow copy.  Returns -1 or errorcode (>1 value) on error, 0 on success.  Any
+//output pointer can be NULL.
+
+void setConfigIOShadow( HANDLE hDevice,
+                        uint8 TimerCounterConfig,
+                        uint8 DAC1Enable,
+                        uint8 FIOAnalog,
+                        uint8 EIOAnalog);
+//Sets the ConfigIO shadow copy of a handle from a ConfigIO response received
+//without ehConfigIO (e.g. from a ConfigIO low-level command sent by the
+//application), so the easy functions do not need to read it again.
+
+void clearConfigIOShadow(HANDLE hDevice);
+//Discards the ConfigIO shadow copy of a handle, so the easy functions read the
+//settings from the U3 again.  Call it after changing them without ehConfigIO
+//or setConfigIOShadow (e.g. with a ConfigU3 low-level command).
 
 long ehConfigTimerClock( HANDLE hDevice,
                          uint8 inTimerClockConfig,
@@ -596,6 +726,49 @@ long ehFeedback( HANDLE hDevice,
 //low-level command and response bytes (not including checksum and command
 //bytes) as its parameter and performs a Feedback call with the U3.  Returns -1
 //or errorcode (>1 value) on error, 0 on success.
+//inIOTypesDataSize must be at most U3_MAX_FEEDBACK_COMMAND_DATA and
+//outDataSize at most U3_MAX_FEEDBACK_RESPONSE_DATA.  The command and response
+//are built on the stack, so no heap memory is allocated.
+
+long ehPipelinedCommands( HANDLE hDevice,
+                          u3Command *aCommands,
+                          long NumCommands,
+                          long MaxInFlight);
+//Used by the eBatchRead easy function.  Performs several low-level commands,
+//in order, like as many ehFeedback, ehConfigIO... calls would, but writing up
+//to MaxInFlight commands (1-255) before reading their responses, so their
+//throughput is not bounded by the USB round trip time.  Feedback commands get
+//a different echo byte each, and every response is matched to its command by
+//its command bytes (and echo byte), besides validating its checksums.  ConfigIO
+//responses update the handle's ConfigIO shadow copy (see ehGetConfigIO).
+//Returns 0 if all the commands succeeded, or -1 otherwise: the result of each
+//command (0, -1 or errorcode (>0) of its response) is in its error field.
+
+long ehFeedbackCommand( u3Command *Command,
+                        uint8 *inIOTypesDataBuff,
+                        long inIOTypesDataSize,
+                        long outDataSize);
+//Sets up Command as the Feedback command ehFeedback would perform, for
+//ehPipelinedCommands.  In the response, recBuff[6] is the Errorcode,
+//recBuff[7] the ErrorFrame, and outDataSize data bytes start at recBuff[9].
+//Returns -1 if the IOTypes do not fit in one command, 0 on success.
+
+long ehConfigIOCommand( u3Command *Command,
+                        uint8 inWriteMask,
+                        uint8 inTimerCounterConfig,
+                        uint8 inDAC1Enable,
+                        uint8 inFIOAnalog,
+                        uint8 inEIOAnalog);
+//Sets up Command as the ConfigIO command ehConfigIO would perform, for
+//ehPipelinedCommands.  In the response, recBuff[8] to recBuff[11] are the
+//TimerCounterConfig, DAC1Enable, FIOAnalog and EIOAnalog.  Returns 0.
+
+long ehConfigTimerClockCommand( u3Command *Command,
+                                uint8 inTimerClockConfig,
+                                uint8 inTimerClockDivisor);
+//Sets up Command as the ConfigTimerClock command ehConfigTimerClock would
+//perform, for ehPipelinedCommands.  In the response, recBuff[8] and recBuff[9]
+//are the TimerClockConfig and TimerClockDivisor.  Returns 0.
 
 
 /* Easy function constants */
@@ -0,0 +1,177 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+/* Checks that the low-level U3 command path (ehFeedback, the easy functions
+ * built on it, and I2C) does no heap allocation per call.
+ *
+ * Link it with u3.c only, and with malloc, calloc and realloc wrapped by
+ * the linker (-Wl,--wrap=malloc,...): USB I/O goes to the stand-ins below,
+ * which answer every command with a valid, all-zeros response.
+ * Exits with 0 if the calls made no allocation, 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "u3.h"
+
+#define NUM_CALLS 1000
+
+static unsigned long gNumAllocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    gNumAllocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    gNumAllocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    gNumAllocs++;
+    return __real_realloc(p, size);
+}
+
+/* Software stand-in of the USB I/O: the last command written is answered by
+ * the next read. */
+static BYTE          gCommand[U3_MAX_PACKET_SIZE];
+static unsigned long gCommandSize = 0;
+
+unsigned long LJUSB_Write(
+    HANDLE hDevice, const BYTE *pBuff, unsigned long count)
+{
+    (void)hDevice;
+    if (count > sizeof(gCommand)) return 0;
+    memcpy(gCommand, pBuff, count);
+    gCommandSize = count;
+    return count;
+}
+
+unsigned long LJUSB_Read(HANDLE hDevice, BYTE *pBuff, unsigned long count)
+{
+    (void)hDevice;
+    if (gCommandSize < 6 || count < 6) return 0;
+
+    memset(pBuff, 0, count);
+    pBuff[1] = gCommand[1];
+    pBuff[2] = (BYTE)((count - 6) / 2);
+    pBuff[3] = gCommand[3];
+
+    // I2C: acknowledge the address and all the bytes sent.
+    if (gCommand[1] == 0xF8 && gCommand[3] == 0x3B && count >= 12)
+    {
+        const unsigned long acks = (2ul << gCommand[12]) - 1;
+        pBuff[8]                 = (BYTE)acks;
+        pBuff[9]                 = (BYTE)(acks >> 8);
+        pBuff[10]                = (BYTE)(acks >> 16);
+        pBuff[11]                = (BYTE)(acks >> 24);
+    }
+
+    extendedChecksum(pBuff, (int)count);
+    gCommandSize = 0;
+    return count;
+}
+
+// Not used by the calls checked, but referenced by u3.c:
+unsigned int LJUSB_GetDevCount(unsigned long ProductID)
+{
+    (void)ProductID;
+    return 0;
+}
+
+HANDLE LJUSB_OpenDevice(
+    UINT DevNum, unsigned int dwReserved, unsigned long ProductID)
+{
+    (void)DevNum;
+    (void)dwReserved;
+    (void)ProductID;
+    return NULL;
+}
+
+void LJUSB_CloseDevice(HANDLE hDevice) { (void)hDevice; }
+
+void *LJUSB_GetUserData(HANDLE hDevice)
+{
+    (void)hDevice;
+    return NULL;
+}
+
+unsigned int LJUSB_WriteReadPipelined(
+    HANDLE hDevice, unsigned int numCommands, BYTE *const *pCommands,
+    const unsigned long *commandSizes, BYTE *const *pResponses,
+    const unsigned long *responseSizes, unsigned long *responseCounts,
+    unsigned int maxInFlight, unsigned int timeout)
+{
+    (void)hDevice;
+    (void)numCommands;
+    (void)pCommands;
+    (void)commandSizes;
+    (void)pResponses;
+    (void)responseSizes;
+    (void)responseCounts;
+    (void)maxInFlight;
+    (void)timeout;
+    return 0;
+}
+
+// Runs one of each call, returns nonzero on any error.
+static int runCalls(HANDLE h)
+{
+    u3CalibrationInfo cal     = U3_CALIBRATION_INFO_DEFAULT;
+    long              dac1    = 0, state;
+    double            voltage = 0;
+    uint8             ioTypes[3] = {1, 0, 31};  // AIN0, single-ended
+    uint8             errorcode, errorFrame, data[2];
+    uint8             i2cSend[2] = {0x12, 0x34}, i2cReceive[4], acks[4];
+    int               err = 0;
+
+    err |= ehFeedback(h, ioTypes, 3, &errorcode, &errorFrame, data, 2) != 0;
+    err |= eAIN(h, &cal, 0, &dac1, 0, 31, &voltage, 0, 0, 0, 0, 0, 0) != 0;
+    err |= eDI(h, 0, 4, &state) != 0;
+    err |= eDO(h, 0, 4, 1) != 0;
+    err |= I2C(h, 0, 0, 6, 7, 0xA0, 2, 4, i2cSend, &errorcode, acks,
+               i2cReceive) != 0;
+    return err;
+}
+
+int main(void)
+{
+    // Any handle: the stand-ins above ignore it.
+    HANDLE        h = (HANDLE)&gCommandSize;
+    unsigned long numAllocs;
+    int           i;
+
+    // First call outside of the count (e.g. lazy stdio buffers):
+    if (runCalls(h) != 0)
+    {
+        fprintf(stderr, "u3_alloc_check: a U3 call failed\n");
+        return 1;
+    }
+
+    gNumAllocs = 0;
+    for (i = 0; i < NUM_CALLS; i++)
+        if (runCalls(h) != 0)
+        {
+            fprintf(stderr, "u3_alloc_check: a U3 call failed\n");
+            return 1;
+        }
+    numAllocs = gNumAllocs;
+
+    printf(
+        "u3_alloc_check: %lu heap allocations in %d rounds of calls\n",
+        numAllocs, NUM_CALLS);
+    return numAllocs == 0 ? 0 : 1;
+}
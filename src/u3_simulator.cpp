@@ -0,0 +1,803 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#include "u3_simulator.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+// U3 errorcodes answered by the simulator:
+constexpr uint8_t kErrorFunctionInvalid     = 5;
+constexpr uint8_t kErrorStreamIsActive      = 48;
+constexpr uint8_t kErrorStreamTableInvalid  = 49;
+constexpr uint8_t kErrorStreamConfigInvalid = 50;
+constexpr uint8_t kErrorStreamNotRunning    = 52;
+constexpr uint8_t kErrorStreamSampleNum     = 56;
+constexpr uint8_t kErrorStreamScanRate      = 58;
+constexpr uint8_t kErrorAutoRecoverReport   = 60;
+
+// Fastest U3 stream, in samples per second:
+constexpr double kMaxStreamSampleRate = 50000.0;
+
+// Firmware version reported by ConfigU3:
+constexpr uint8_t kFirmwareMajor = 1, kFirmwareMinor = 46;
+
+// Round trip of a command, on top of the USB latency [s]:
+constexpr double kCommandProcessingTime = 300e-6;
+
+static double fraction(double x) { return x - std::floor(x); }
+
+bool parseSimWaveform(const std::string& name, SimWaveform& out)
+{
+    static const std::pair<const char*, SimWaveform> names[] = {
+        {"constant", SimWaveform::Constant},
+        {"sine", SimWaveform::Sine},
+        {"square", SimWaveform::Square},
+        {"triangle", SimWaveform::Triangle},
+        {"sawtooth", SimWaveform::Sawtooth},
+        {"noise", SimWaveform::Noise}};
+
+    for (const auto& n : names)
+    {
+        if (name == n.first)
+        {
+            out = n.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+double SimSignal::channel(int c, double t) const
+{
+    const double phase = frequency * t - c / 16.0;
+    const double f     = fraction(phase);
+
+    switch (waveform)
+    {
+        case SimWaveform::Sine:
+            return offset + amplitude * std::sin(2 * M_PI * phase);
+        case SimWaveform::Square:
+            return offset + (f < 0.5 ? amplitude : -amplitude);
+        case SimWaveform::Triangle:
+            return offset + amplitude * (f < 0.5 ? 4 * f - 1 : 3 - 4 * f);
+        case SimWaveform::Sawtooth:
+            return offset + amplitude * (2 * f - 1);
+        case SimWaveform::Constant:
+        case SimWaveform::Noise:
+        default:
+            return offset;
+    }
+}
+
+double SimSignal::volts(uint8_t positive, uint8_t negative, double t) const
+{
+    double v = channel(positive, t);
+    if (negative <= 15) v -= channel(negative, t);
+    return v;
+}
+
+double SimSignal::noiseStdDev() const
+{
+    return waveform == SimWaveform::Noise ? std::hypot(amplitude, noise)
+                                          : noise;
+}
+
+StreamPacketGenerator::StreamPacketGenerator(
+    const std::vector<AinCalibration>& calib,
+    const std::vector<uint8_t>& positive, const std::vector<uint8_t>& negative,
+    int samplesPerPacket, double scanPeriod, const SimSignal& signal,
+    uint32_t seed)
+    : calib_(calib),
+      positive_(positive),
+      negative_(negative),
+      samplesPerPacket_(samplesPerPacket),
+      scanPeriod_(scanPeriod),
+      signal_(signal),
+      rng_(seed)
+{
+    if (calib_.empty() || positive_.size() != calib_.size() ||
+        negative_.size() != calib_.size() || samplesPerPacket_ < 1 ||
+        samplesPerPacket_ > 25)
+        throw std::invalid_argument("StreamPacketGenerator: invalid scan list");
+}
+
+uint16_t StreamPacketGenerator::rawSample(int entry, double volts) const
+{
+    const AinCalibration& cal = calib_[entry];
+    const double raw = std::round((volts - cal.offset) / cal.slope);
+
+    // 12-bit conversions, left justified:
+    return static_cast<uint16_t>(std::clamp(raw, 0.0, 65535.0)) & 0xFFF0;
+}
+
+void StreamPacketGenerator::generate(
+    uint8_t* out, int numPackets, uint8_t backlog)
+{
+    const int    size     = packetSize();
+    const double noiseStd = signal_.noiseStdDev();
+
+    for (int p = 0; p < numPackets; p++)
+    {
+        uint8_t* b = out + p * size;
+
+        std::memset(b, 0, size);
+        b[1]  = 0xF9;
+        b[2]  = 4 + samplesPerPacket_;
+        b[3]  = 0xC0;
+        b[10] = packetCounter_++;
+
+        for (int s = 0; s < samplesPerPacket_; s++)
+        {
+            if (channel_ == 0 && pendingSkip_ > 0)
+            {
+                const uint32_t reported =
+                    std::min<uint32_t>(pendingSkip_, 65535);
+                b[6]  = reported & 0xFF;
+                b[7]  = reported >> 8;
+                b[11] = kErrorAutoRecoverReport;
+                scan_ += pendingSkip_;
+                pendingSkip_ = 0;
+            }
+
+            double v = signal_.volts(
+                positive_[channel_], negative_[channel_], scan_ * scanPeriod_);
+            if (noiseStd > 0) v += noiseStd * noise_(rng_);
+
+            const uint16_t raw = rawSample(channel_, v);
+            b[kStreamDataSamplesOffset + 2 * s]     = raw & 0xFF;
+            b[kStreamDataSamplesOffset + 2 * s + 1] = raw >> 8;
+
+            if (++channel_ == numChannels())
+            {
+                channel_ = 0;
+                scan_++;
+            }
+        }
+
+        b[13 + 2 * samplesPerPacket_] = backlog;
+        extendedChecksum(b, size);
+    }
+}
+
+U3Simulator::U3Simulator(const U3SimulatorOptions& options)
+    : options_(options), rng_(options.serialNumber), created_(Clock::now())
+{
+    if (options_.localID < 0 || options_.localID > 255)
+        throw std::runtime_error("U3Simulator: localID must be in 0-255");
+    if (options_.streamBufferSamples < 1)
+        throw std::runtime_error("U3Simulator: invalid stream buffer size");
+
+    caliInfo_                 = U3_CALIBRATION_INFO_DEFAULT;
+    caliInfo_.prodID          = 3;
+    caliInfo_.hardwareVersion = options_.hardwareVersion;
+    caliInfo_.highVoltage     = options_.highVoltage ? 1 : 0;
+
+    static const LJUSB_Transport transport = {
+        &U3Simulator::transportWrite, &U3Simulator::transportRead,
+        &U3Simulator::transportStream, &U3Simulator::transportStreamWait,
+        &U3Simulator::transportClose};
+
+    if (!LJUSB_AddVirtualDevice(U3_PRODUCT_ID, &transport, this))
+        throw std::runtime_error(
+            std::string("U3Simulator: LJUSB_AddVirtualDevice failed: ") +
+            std::strerror(errno));
+}
+
+U3Simulator::~U3Simulator() { LJUSB_RemoveVirtualDevice(this); }
+
+double U3Simulator::secondsSince(Clock::time_point t0) const
+{
+    return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+static std::chrono::steady_clock::duration toDuration(double seconds)
+{
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(seconds));
+}
+
+unsigned long U3Simulator::transportWrite(
+    void* context, const BYTE* pBuff, unsigned long count,
+    unsigned int /*timeout*/)
+{
+    auto&                       me = *static_cast<U3Simulator*>(context);
+    std::lock_guard<std::mutex> lck(me.mutex_);
+
+    me.handleCommand(pBuff, count);
+    return count;
+}
+
+unsigned long U3Simulator::transportRead(
+    void* context, BYTE* pBuff, unsigned long count, unsigned int timeout)
+{
+    auto&                        me = *static_cast<U3Simulator*>(context);
+    std::unique_lock<std::mutex> lck(me.mutex_);
+
+    if (me.responses_.empty())
+    {
+        // Nothing to answer: the read times out.
+        lck.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+        errno = ETIMEDOUT;
+        return 0;
+    }
+
+    Response response = std::move(me.responses_.front());
+    me.responses_.pop_front();
+    lck.unlock();
+
+    std::this_thread::sleep_until(response.readyTime);
+
+    const unsigned long n =
+        std::min<unsigned long>(count, response.data.size());
+    std::memcpy(pBuff, response.data.data(), n);
+    return n;
+}
+
+U3Simulator::Clock::time_point U3Simulator::streamReadyTime(
+    int numPackets) const
+{
+    const int      numChannels = generator_->numChannels();
+    const uint64_t lastScan =
+        generator_->nextScan() + generator_->pendingSkip() +
+        (generator_->nextChannel() +
+         numPackets * generator_->samplesPerPacket() - 1) /
+            numChannels;
+
+    // Scan k is sampled one scan period after scan k-1, the first one
+    // a scan period after StreamStart:
+    return streamStart_ +
+           toDuration(
+               (lastScan + 1) * hostScanPeriod_ + options_.usbLatency +
+               readJitter_);
+}
+
+void U3Simulator::checkStreamOverflow()
+{
+    const int    numChannels = generator_->numChannels();
+    const double sampled     = secondsSince(streamStart_) / hostScanPeriod_;
+    const double waiting     = std::floor(sampled) -
+                           static_cast<double>(
+                               generator_->nextScan() +
+                               generator_->pendingSkip());
+    const double capacity = options_.streamBufferSamples / numChannels;
+
+    // The device buffer is full: the oldest buffered scans are lost.
+    if (waiting > capacity)
+        generator_->skipScans(static_cast<uint32_t>(waiting - capacity));
+}
+
+unsigned long U3Simulator::transportStream(
+    void* context, BYTE* pBuff, unsigned long count, unsigned int timeout)
+{
+    auto&                        me = *static_cast<U3Simulator*>(context);
+    std::unique_lock<std::mutex> lck(me.mutex_);
+
+    if (!me.streaming_ || count < static_cast<unsigned long>(
+                                      me.generator_->packetSize()))
+    {
+        errno = me.streaming_ ? EOVERFLOW : ETIMEDOUT;
+        return 0;
+    }
+
+    const int numPackets =
+        static_cast<int>(count / me.generator_->packetSize());
+    const auto ready = me.streamReadyTime(numPackets);
+
+    if (ready > Clock::now())
+    {
+        if (timeout > 0 &&
+            ready - Clock::now() > std::chrono::milliseconds(timeout))
+        {
+            lck.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+            errno = ETIMEDOUT;
+            return 0;
+        }
+
+        lck.unlock();
+        std::this_thread::sleep_until(ready);
+        lck.lock();
+
+        if (!me.streaming_)
+        {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+    }
+
+    me.checkStreamOverflow();
+
+    const double backlog =
+        (me.secondsSince(me.streamStart_) / me.hostScanPeriod_ -
+         me.generator_->nextScan()) *
+        me.generator_->numChannels() / me.generator_->samplesPerPacket();
+
+    me.generator_->generate(
+        pBuff, numPackets,
+        static_cast<uint8_t>(std::clamp(backlog - numPackets, 0.0, 255.0)));
+
+    std::uniform_real_distribution<double> jitter(0.0, me.options_.usbJitter);
+    me.readJitter_ = jitter(me.rng_);
+
+    return numPackets * static_cast<unsigned long>(me.generator_->packetSize());
+}
+
+long U3Simulator::transportStreamWait(void* context, unsigned long count)
+{
+    auto&                       me = *static_cast<U3Simulator*>(context);
+    std::lock_guard<std::mutex> lck(me.mutex_);
+
+    if (!me.streaming_) return -1;
+
+    const int numPackets = std::max(
+        1, static_cast<int>(count / me.generator_->packetSize()));
+    const auto wait = me.streamReadyTime(numPackets) - Clock::now();
+
+    if (wait <= Clock::duration::zero()) return 0;
+    return static_cast<long>(
+        std::chrono::ceil<std::chrono::microseconds>(wait).count());
+}
+
+void U3Simulator::transportClose(void* context)
+{
+    auto&                       me = *static_cast<U3Simulator*>(context);
+    std::lock_guard<std::mutex> lck(me.mutex_);
+
+    // Unread responses are lost, but, as in a real U3, the stream goes on.
+    me.responses_.clear();
+}
+
+void U3Simulator::push(std::vector<uint8_t> response)
+{
+    const auto ready =
+        Clock::now() +
+        toDuration(2 * options_.usbLatency + kCommandProcessingTime);
+    responses_.push_back({std::move(response), ready});
+}
+
+void U3Simulator::pushExtended(std::vector<uint8_t> response)
+{
+    response[1] = 0xF8;
+    response[2] = static_cast<uint8_t>((response.size() - 6) / 2);
+    extendedChecksum(response.data(), static_cast<int>(response.size()));
+    push(std::move(response));
+}
+
+void U3Simulator::pushNormal(std::vector<uint8_t> response)
+{
+    normalChecksum(response.data(), static_cast<int>(response.size()));
+    push(std::move(response));
+}
+
+void U3Simulator::handleCommand(const uint8_t* cmd, unsigned long count)
+{
+    if (count < 2) return;
+
+    std::vector<uint8_t> buff(cmd, cmd + count);
+    bool                 checksumOk;
+
+    const bool extended = buff[1] == 0xF8;
+    if (extended)
+    {
+        const uint16_t checksum16 =
+            count >= 6 ? extendedChecksum16(buff.data(), buff.size()) : 0;
+        checksumOk = count >= 6 && count == 6 + 2ul * buff[2] &&
+                     buff[4] == (checksum16 & 0xFF) &&
+                     buff[5] == (checksum16 >> 8) &&
+                     buff[0] == extendedChecksum8(buff.data());
+    }
+    else
+    {
+        checksumOk = buff[0] == normalChecksum8(buff.data(), buff.size());
+    }
+
+    if (!checksumOk)
+    {
+        pushNormal({0xB8, 0xB8});
+        return;
+    }
+
+    if (extended)
+    {
+        switch (buff[3])
+        {
+            case 0x00: feedback(buff.data(), count); break;
+            case 0x08:
+                if (count == 26) configU3(buff.data());
+                break;
+            case 0x0A:
+                if (count == 10) configTimerClock(buff.data());
+                break;
+            case 0x0B:
+                if (count == 12) configIO(buff.data());
+                break;
+            case 0x11: streamConfig(buff.data(), count); break;
+            case 0x2D:
+                if (count == 8) readMem(buff.data());
+                break;
+            default: break;  // Not emulated: no response
+        }
+    }
+    else
+    {
+        switch (buff[1])
+        {
+            case 0xA8: streamStart(); break;
+            case 0xB0: streamStop(); break;
+            default: break;  // Not emulated: no response
+        }
+    }
+}
+
+void U3Simulator::configU3(const uint8_t* cmd)
+{
+    // Only the LocalID is written (WriteMask0 bit 3). The other settings
+    // are power-up defaults, and the current ones are reported.
+    if (cmd[6] & 0x08) options_.localID = cmd[8];
+
+    const int hwMajor = static_cast<int>(options_.hardwareVersion);
+    const int hwMinor = static_cast<int>(
+        std::lround((options_.hardwareVersion - hwMajor) * 100));
+
+    std::vector<uint8_t> r(38, 0);
+    r[3]  = 0x08;
+    r[9]  = kFirmwareMinor;
+    r[10] = kFirmwareMajor;
+    r[13] = static_cast<uint8_t>(hwMinor);
+    r[14] = static_cast<uint8_t>(hwMajor);
+    for (int i = 0; i < 4; i++)
+        r[15 + i] = (options_.serialNumber >> (8 * i)) & 0xFF;
+    r[19] = U3_PRODUCT_ID;
+    r[21] = static_cast<uint8_t>(options_.localID);
+    r[22] = timerCounterConfig_;
+    r[23] = fioAnalog_;
+    r[24] = portDir_[0];
+    r[25] = portState_[0];
+    r[26] = eioAnalog_;
+    r[27] = portDir_[1];
+    r[28] = portState_[1];
+    r[29] = portDir_[2];
+    r[30] = portState_[2];
+    r[31] = dac1Enable_;
+    r[32] = dac_[0] >> 8;
+    r[33] = dac_[1] >> 8;
+    r[34] = timerClockConfig_;
+    r[35] = timerClockDivisor_;
+    r[37] = options_.highVoltage ? 18 : 2;  // VersionInfo
+    pushExtended(std::move(r));
+}
+
+void U3Simulator::configIO(const uint8_t* cmd)
+{
+    const uint8_t writeMask = cmd[6];
+
+    if (writeMask & 0x01) timerCounterConfig_ = cmd[8];
+    if (writeMask & 0x02) dac1Enable_ = cmd[9];
+    if (writeMask & 0x04) fioAnalog_ = cmd[10];
+    if (writeMask & 0x08) eioAnalog_ = cmd[11];
+
+    // FIO0-3 of the U3-HV are always analog inputs:
+    if (options_.highVoltage) fioAnalog_ |= 0x0F;
+
+    std::vector<uint8_t> r(12, 0);
+    r[3]  = 0x0B;
+    r[8]  = timerCounterConfig_;
+    r[9]  = dac1Enable_;
+    r[10] = fioAnalog_;
+    r[11] = eioAnalog_;
+    pushExtended(std::move(r));
+}
+
+void U3Simulator::configTimerClock(const uint8_t* cmd)
+{
+    if (cmd[8] & 0x80)
+    {
+        timerClockConfig_  = cmd[8] & 0x07;
+        timerClockDivisor_ = cmd[9];
+    }
+
+    std::vector<uint8_t> r(10, 0);
+    r[3] = 0x0A;
+    r[8] = timerClockConfig_;
+    r[9] = timerClockDivisor_;
+    pushExtended(std::move(r));
+}
+
+void U3Simulator::readMem(const uint8_t* cmd)
+{
+    const int block = cmd[7];
+
+    std::vector<uint8_t> r(40, 0);
+    r[3] = 0x2D;
+
+    // Blocks 0-4 hold the calibration constants, as 32.32 fixed point
+    // numbers. The rest of the calibration memory is left blank.
+    for (int i = 0; block < 5 && i < 4; i++)
+    {
+        const double v     = caliInfo_.ccConstants[block * 4 + i];
+        double       whole = std::floor(v);
+        double       frac  = std::round((v - whole) * 4294967296.0);
+        if (frac >= 4294967296.0)
+        {
+            whole += 1;
+            frac = 0;
+        }
+
+        const uint32_t dec = static_cast<uint32_t>(frac);
+        const uint32_t wh  = static_cast<uint32_t>(static_cast<int32_t>(whole));
+        for (int k = 0; k < 4; k++)
+        {
+            r[8 + i * 8 + k]     = (dec >> (8 * k)) & 0xFF;
+            r[8 + i * 8 + 4 + k] = (wh >> (8 * k)) & 0xFF;
+        }
+    }
+    pushExtended(std::move(r));
+}
+
+uint16_t U3Simulator::ainRaw(uint8_t positive, uint8_t negative, double t)
+{
+    double slope, offset;
+    if (getAinVoltCalibrationLinear(
+            &caliInfo_, dac1Enabled(), positive, negative, &slope,
+            &offset) != 0)
+        return 0;
+
+    double v = options_.signal.volts(positive, negative, t);
+    if (const double noiseStd = options_.signal.noiseStdDev(); noiseStd > 0)
+        v += std::normal_distribution<double>(0.0, noiseStd)(rng_);
+
+    const double raw = std::round((v - offset) / slope);
+    return static_cast<uint16_t>(std::clamp(raw, 0.0, 65535.0)) & 0xFFF0;
+}
+
+void U3Simulator::feedback(const uint8_t* cmd, unsigned long count)
+{
+    const double t = secondsSince(created_);
+
+    std::vector<uint8_t> data;
+    uint8_t              errorcode = 0, errorFrame = 0;
+
+    // IOTypes start after the echo byte:
+    unsigned long i = 7;
+    for (uint8_t frame = 0; i < count && cmd[i] != 0 && !errorcode; frame++)
+    {
+        const uint8_t* io = cmd + i;
+
+        // Size of each IOType command, in bytes:
+        int size;
+        switch (io[0])
+        {
+            case 26:
+            case 28: size = 1; break;
+            case 5:
+            case 6:
+            case 9:
+            case 10:
+            case 11:
+            case 12:
+            case 13:
+            case 34:
+            case 35:
+            case 54:
+            case 55: size = 2; break;
+            case 1:
+            case 38:
+            case 39: size = 3; break;
+            case 42:
+            case 43:
+            case 44:
+            case 45: size = 4; break;
+            case 63: size = 6; break;
+            case 27:
+            case 29: size = 7; break;
+            default: size = 0; break;
+        }
+
+        if (size == 0 || i + size > count)
+        {
+            errorcode  = kErrorFunctionInvalid;
+            errorFrame = frame;
+            break;
+        }
+
+        const int bit = io[1] & 0x1F, port = bit / 8;
+        switch (io[0])
+        {
+            case 1:  // AIN
+            {
+                const uint16_t raw = ainRaw(io[1] & 0x1F, io[2] & 0x1F, t);
+                data.push_back(raw & 0xFF);
+                data.push_back(raw >> 8);
+                break;
+            }
+            case 10:  // BitStateRead
+                data.push_back(bit < 20 ? (portState_[port] >> (bit % 8)) & 1
+                                        : 0);
+                break;
+            case 11:  // BitStateWrite
+                if (bit < 20)
+                {
+                    portState_[port] &= ~(1 << (bit % 8));
+                    portState_[port] |= ((io[1] >> 7) & 1) << (bit % 8);
+                }
+                break;
+            case 12:  // BitDirRead
+                data.push_back(bit < 20 ? (portDir_[port] >> (bit % 8)) & 1
+                                        : 0);
+                break;
+            case 13:  // BitDirWrite
+                if (bit < 20)
+                {
+                    portDir_[port] &= ~(1 << (bit % 8));
+                    portDir_[port] |= ((io[1] >> 7) & 1) << (bit % 8);
+                }
+                break;
+            case 26:  // PortStateRead
+                data.insert(data.end(), portState_, portState_ + 3);
+                break;
+            case 27:  // PortStateWrite
+                for (int p = 0; p < 3; p++)
+                    portState_[p] = (portState_[p] & ~io[1 + p]) |
+                                    (io[4 + p] & io[1 + p]);
+                break;
+            case 28:  // PortDirRead
+                data.insert(data.end(), portDir_, portDir_ + 3);
+                break;
+            case 29:  // PortDirWrite
+                for (int p = 0; p < 3; p++)
+                    portDir_[p] = (portDir_[p] & ~io[1 + p]) |
+                                  (io[4 + p] & io[1 + p]);
+                break;
+            case 34:  // DAC0 (8-bit)
+            case 35:  // DAC1 (8-bit)
+                dac_[io[0] - 34] = io[1] << 8;
+                break;
+            case 38:  // DAC0 (16-bit)
+            case 39:  // DAC1 (16-bit)
+                dac_[io[0] - 38] = io[1] | (io[2] << 8);
+                break;
+            case 42:  // Timer0
+            case 44:  // Timer1
+            {
+                const int timer = (io[0] - 42) / 2;
+                if (io[1] & 0x01) timerValue_[timer] = io[2] | (io[3] << 8);
+                data.push_back(timerValue_[timer] & 0xFF);
+                data.push_back(timerValue_[timer] >> 8);
+                data.push_back(0);
+                data.push_back(0);
+                break;
+            }
+            case 43:  // Timer0Config
+            case 45:  // Timer1Config
+                timerValue_[(io[0] - 43) / 2] = io[2] | (io[3] << 8);
+                break;
+            case 54:  // Counter0
+            case 55:  // Counter1
+            {
+                // Counts the rising edges of the input signal frequency:
+                const int      counter = io[0] - 54;
+                const uint32_t value   = static_cast<uint32_t>(
+                    options_.signal.frequency * (t - counterReset_[counter]));
+                for (int k = 0; k < 4; k++) data.push_back(value >> (8 * k));
+                if (io[1] & 0x01) counterReset_[counter] = t;
+                break;
+            }
+            default: break;  // Waits, LED and buzzer: nothing to emulate
+        }
+
+        i += size;
+    }
+
+    // Errorcode, ErrorFrame and Echo, then the data, padded to words:
+    std::vector<uint8_t> r(6 + 3 + data.size() + (data.size() + 3) % 2, 0);
+    r[3] = 0x00;
+    r[6] = errorcode;
+    r[7] = errorFrame;
+    r[8] = count > 6 ? cmd[6] : 0;
+    std::copy(data.begin(), data.end(), r.begin() + 9);
+    pushExtended(std::move(r));
+}
+
+void U3Simulator::streamConfig(const uint8_t* cmd, unsigned long count)
+{
+    uint8_t errorcode = 0;
+
+    const int numChannels = count >= 12 ? cmd[6] : 0;
+    const int spp         = count >= 12 ? cmd[7] : 0;
+
+    if (streaming_)
+        errorcode = kErrorStreamIsActive;
+    else if (
+        numChannels < 1 || numChannels > 25 ||
+        count != 12 + 2 * static_cast<unsigned long>(numChannels))
+        errorcode = kErrorStreamConfigInvalid;
+    else if (spp < 1 || spp > 25)
+        errorcode = kErrorStreamSampleNum;
+
+    StreamSetup setup;
+    if (!errorcode)
+    {
+        const uint8_t  scanConfig = cmd[9];
+        const uint16_t interval   = cmd[10] | (cmd[11] << 8);
+        const double   clock =
+            (scanConfig & 0x08 ? 48e6 : 4e6) / (scanConfig & 0x04 ? 256 : 1);
+
+        setup.samplesPerPacket = spp;
+        setup.scanPeriod       = interval / clock;
+        if (interval == 0 ||
+            numChannels / setup.scanPeriod > kMaxStreamSampleRate)
+            errorcode = kErrorStreamScanRate;
+
+        for (int c = 0; c < numChannels && !errorcode; c++)
+        {
+            setup.positive.push_back(cmd[12 + 2 * c]);
+            setup.negative.push_back(cmd[13 + 2 * c]);
+
+            AinCalibration cal;
+            if (!makeAinCalibration(
+                    caliInfo_, dac1Enabled(), setup.positive.back(),
+                    setup.negative.back(), cal))
+                errorcode = kErrorStreamTableInvalid;
+        }
+    }
+
+    if (!errorcode)
+    {
+        streamSetup_      = setup;
+        streamConfigured_ = true;
+    }
+
+    std::vector<uint8_t> r(8, 0);
+    r[3] = 0x11;
+    r[6] = errorcode;
+    pushExtended(std::move(r));
+}
+
+void U3Simulator::streamStart()
+{
+    uint8_t errorcode = 0;
+
+    if (streaming_)
+        errorcode = kErrorStreamIsActive;
+    else if (!streamConfigured_)
+        errorcode = kErrorStreamConfigInvalid;
+    else
+    {
+        const StreamSetup& s = streamSetup_;
+
+        std::vector<AinCalibration> calib(s.positive.size());
+        for (size_t c = 0; c < calib.size(); c++)
+            makeAinCalibration(
+                caliInfo_, dac1Enabled(), s.positive[c], s.negative[c],
+                calib[c]);
+
+        generator_ = std::make_unique<StreamPacketGenerator>(
+            calib, s.positive, s.negative, s.samplesPerPacket, s.scanPeriod,
+            options_.signal, options_.serialNumber);
+
+        // A fast device clock (positive drift) samples sooner:
+        hostScanPeriod_ = s.scanPeriod / (1 + options_.clockDriftPpm * 1e-6);
+        streamStart_    = Clock::now();
+        readJitter_     = 0;
+        streaming_      = true;
+    }
+
+    pushNormal({0, 0xA9, errorcode, 0});
+}
+
+void U3Simulator::streamStop()
+{
+    const uint8_t errorcode = streaming_ ? 0 : kErrorStreamNotRunning;
+    streaming_              = false;
+
+    pushNormal({0, 0xB1, errorcode, 0});
+}
@@ -0,0 +1,244 @@
+/*---------------------------------------------------------------------------
+ *  Labjack DAQ USB devices ROS 2 node
+ *  Copyright, José Luis Blanco-Claraco, University of Almería (C) 2023
+ *  License: MIT
+ *-------------------------------------------------------------------------- */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "stream_decoder.h"
+#include "u3.h"
+
+/// Analog input signal shapes of the software U3.
+enum class SimWaveform
+{
+    Constant,
+    Sine,
+    Square,
+    Triangle,
+    Sawtooth,
+    Noise
+};
+
+/// Parses "constant", "sine", "square", "triangle", "sawtooth" or "noise".
+/// \return false if the name is not known.
+bool parseSimWaveform(const std::string& name, SimWaveform& out);
+
+/** Analog signal seen by every input of a software U3. Channel c is the
+ * waveform delayed by c / 16 of its period, so channels can be told apart.
+ * The Noise waveform is Gaussian noise of std. deviation amplitude.
+ */
+struct SimSignal
+{
+    SimWaveform waveform  = SimWaveform::Sine;
+    double      amplitude = 1.0;  // [V]
+    double      frequency = 1.0;  // [Hz]
+    double      offset    = 1.2;  // [V]
+    double      noise     = 0.0;  // Gaussian noise std. deviation [V]
+
+    /// Noiseless value [V] of one input channel at device time t [s].
+    double channel(int c, double t) const;
+
+    /// Noiseless value [V] of a (positive, negative) channel pair, as
+    /// measured by the U3: negative channels other than 0-15 are ignored.
+    double volts(uint8_t positive, uint8_t negative, double t) const;
+
+    /// Std. deviation [V] of the noise added to each sample.
+    double noiseStdDev() const;
+};
+
+/** Builds valid StreamData responses, as sent by a streaming U3, for a
+ * given scan list and signal.
+ *
+ * Samples are quantized to 12 bits and encoded with the inverse of the
+ * channel calibration, so decoding them returns the signal. The output is
+ * fully deterministic for a given seed. It is used by the U3Simulator and
+ * by the benchmarks.
+ */
+class StreamPacketGenerator
+{
+   public:
+    /** \param calib       Calibration of each scan list entry.
+     *  \param positive    Positive channel of each scan list entry.
+     *  \param negative    Negative channel of each scan list entry.
+     *  \param scanPeriod  Device time between scans [s].
+     */
+    StreamPacketGenerator(
+        const std::vector<AinCalibration>& calib,
+        const std::vector<uint8_t>& positive,
+        const std::vector<uint8_t>& negative, int samplesPerPacket,
+        double scanPeriod, const SimSignal& signal, uint32_t seed = 1);
+
+    int numChannels() const { return static_cast<int>(calib_.size()); }
+    int samplesPerPacket() const { return samplesPerPacket_; }
+    int packetSize() const
+    {
+        return streamDataResponseSize(samplesPerPacket_);
+    }
+
+    /// Device scan index of the next generated sample, and its channel.
+    uint64_t nextScan() const { return scan_; }
+    int      nextChannel() const { return channel_; }
+
+    /** Drops the next numScans scans, starting at the next whole scan. The
+     * packet holding the first sample after them carries an auto-recovery
+     * report (errorcode 60) with their count.
+     */
+    void skipScans(uint32_t numScans) { pendingSkip_ += numScans; }
+    uint32_t pendingSkip() const { return pendingSkip_; }
+
+    /** Writes numPackets consecutive StreamData responses to out, with
+     * the given Backlog byte (StreamData responses left in the device).
+     */
+    void generate(uint8_t* out, int numPackets, uint8_t backlog = 0);
+
+    /// Raw 16-bit value of volts on a scan list entry, as the U3 sends it.
+    uint16_t rawSample(int entry, double volts) const;
+
+   private:
+    std::vector<AinCalibration> calib_;
+    std::vector<uint8_t>        positive_, negative_;
+    int                         samplesPerPacket_;
+    double                      scanPeriod_;
+    SimSignal                   signal_;
+    std::mt19937                rng_;
+    std::normal_distribution<double> noise_{0.0, 1.0};
+
+    uint64_t scan_          = 0;
+    int      channel_       = 0;
+    uint8_t  packetCounter_ = 0;
+    uint32_t pendingSkip_   = 0;
+};
+
+/// Settings of a software U3.
+struct U3SimulatorOptions
+{
+    int       localID         = 1;
+    uint32_t  serialNumber    = 320000001;
+    bool      highVoltage     = false;
+    double    hardwareVersion = 1.30;
+    SimSignal signal;
+    double    clockDriftPpm = 0.0;  // Device clock error vs. host [ppm]
+    double    usbLatency    = 200e-6;  // Packet ready -> USB completion [s]
+    double    usbJitter     = 100e-6;  // Uniform extra latency [s]
+    int       streamBufferSamples = 984;  // Device stream buffer size
+};
+
+/** Software emulated U3, seen by the driver as a virtual USB device (see
+ * LJUSB_AddVirtualDevice), so openUSBConnection() and every command and
+ * stream function work on it unchanged. For tests and load tests on hosts
+ * without the hardware.
+ *
+ * It answers ConfigU3, ConfigIO, ConfigTimerClock, ReadMem (calibration
+ * blocks 0-4, with the nominal constants), Feedback (analog inputs,
+ * digital I/O, DACs, timers and counters), StreamConfig, StreamStart and
+ * StreamStop. StreamData is paced in real time from the configured scan
+ * rate, clock drift and USB latency. Reads falling behind overflow the
+ * device buffer, and the lost scans are reported as auto-recovery reports.
+ */
+class U3Simulator
+{
+   public:
+    /// Adds the device to the driver. Throws std::runtime_error on errors.
+    explicit U3Simulator(const U3SimulatorOptions& options);
+
+    /// Removes the device from the driver. It must be closed.
+    ~U3Simulator();
+
+    U3Simulator(const U3Simulator&)            = delete;
+    U3Simulator& operator=(const U3Simulator&) = delete;
+
+    const U3SimulatorOptions& options() const { return options_; }
+
+    /// Calibration constants reported by ReadMem.
+    const u3CalibrationInfo& calibration() const { return caliInfo_; }
+
+   private:
+    using Clock = std::chrono::steady_clock;
+
+    U3SimulatorOptions options_;
+    u3CalibrationInfo  caliInfo_;
+    std::mutex         mutex_;
+    std::mt19937       rng_;
+    Clock::time_point  created_;
+
+    // Command responses, in order, waiting to be read:
+    struct Response
+    {
+        std::vector<uint8_t> data;
+        Clock::time_point    readyTime;
+    };
+    std::deque<Response> responses_;
+
+    // I/O state:
+    uint8_t  timerCounterConfig_ = 0x40;
+    uint8_t  dac1Enable_         = 0;
+    uint8_t  fioAnalog_          = 0x0F;
+    uint8_t  eioAnalog_          = 0;
+    uint8_t  timerClockConfig_   = 0x02;
+    uint8_t  timerClockDivisor_  = 0;
+    uint8_t  portState_[3]       = {0, 0, 0};  // FIO, EIO, CIO
+    uint8_t  portDir_[3]         = {0, 0, 0};
+    uint16_t dac_[2]             = {0, 0};
+    uint16_t timerValue_[2]      = {0, 0};
+    double   counterReset_[2]    = {0, 0};  // Time of last reset [s]
+
+    // Stream state:
+    struct StreamSetup
+    {
+        std::vector<uint8_t> positive, negative;
+        int                  samplesPerPacket = 0;
+        double               scanPeriod       = 0;  // Device time [s]
+    };
+    bool              streamConfigured_ = false;
+    bool              streaming_        = false;
+    StreamSetup       streamSetup_;
+    Clock::time_point streamStart_;
+    double            hostScanPeriod_ = 0;  // With the clock drift
+    double            readJitter_     = 0;  // Of the next stream read
+    std::unique_ptr<StreamPacketGenerator> generator_;
+
+    // LJUSB_Transport callbacks:
+    static unsigned long transportWrite(
+        void* context, const BYTE* pBuff, unsigned long count,
+        unsigned int timeout);
+    static unsigned long transportRead(
+        void* context, BYTE* pBuff, unsigned long count, unsigned int timeout);
+    static unsigned long transportStream(
+        void* context, BYTE* pBuff, unsigned long count, unsigned int timeout);
+    static long transportStreamWait(void* context, unsigned long count);
+    static void transportClose(void* context);
+
+    void handleCommand(const uint8_t* cmd, unsigned long count);
+    void configU3(const uint8_t* cmd);
+    void configIO(const uint8_t* cmd);
+    void configTimerClock(const uint8_t* cmd);
+    void readMem(const uint8_t* cmd);
+    void feedback(const uint8_t* cmd, unsigned long count);
+    void streamConfig(const uint8_t* cmd, unsigned long count);
+    void streamStart();
+    void streamStop();
+
+    // Checksum and queue a response to an extended or normal command:
+    void pushExtended(std::vector<uint8_t> response);
+    void pushNormal(std::vector<uint8_t> response);
+    void push(std::vector<uint8_t> response);
+
+    int      dac1Enabled() const { return dac1Enable_ ? 1 : 0; }
+    uint16_t ainRaw(uint8_t positive, uint8_t negative, double t);
+    double   secondsSince(Clock::time_point t0) const;
+
+    // Host time at which numPackets more StreamData responses are ready.
+    Clock::time_point streamReadyTime(int numPackets) const;
+    // Drops the scans that no longer fit in the device buffer.
+    void checkStreamOverflow();
+};